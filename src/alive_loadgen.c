@@ -0,0 +1,744 @@
+/*************************************************************************\
+* Copyright (c) 2020 UChicago Argonne, LLC,
+*               as Operator of Argonne National Laboratory.
+\*************************************************************************/
+
+/*
+  Written by Dohn A. Arms (Advanced Photon Source, ANL)
+*/
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "config_parse.h"
+
+/*
+  Sends heartbeats for simulated IOCs, for load testing the daemon.
+  The packets are laid out just like ioc_parse_packet() reads them,
+  for versions 4, 5 and 6.  IOCs can be made to reboot, and old or
+  duplicate heartbeats can be mixed in, which the daemon should throw
+  out.  If an environment port is given, that is served too, else the
+  IOCs tell the daemon not to read their environment.
+
+  In benchmark mode, heartbeats are sent as fast as possible, and the
+  daemon's stats (through the control socket) and the kernel's UDP
+  drop counters are compared before and after the run.
+
+  In query mode, no heartbeats are sent.  Instead the full IOC list is
+  asked for over the database port the given number of times, one
+  request after another, to time what a client asking for everything
+  costs the daemon.  With several clients, each makes its share of the
+  requests at the same time as the others.
+*/
+
+// times in packets are from the EPICS epoch
+#define EPICS_EPOCH (631152000)
+
+#define NAME_FORMAT "loadgen%06d"
+#define NAME_PREFIX_LEN (7)
+
+struct sim_ioc
+{
+  char name[32];
+  uint32_t incarnation;
+  uint32_t heartbeat;
+  uint32_t id;   // v6 record id, 0 if not given one
+};
+
+struct
+{
+  int number;
+  int period;
+  int version;
+  int duration;
+  double reboot;     // percent of heartbeats
+  double old;
+  double duplicate;
+  int env_port;
+  int sockets;
+  int benchmark;
+  int queries;
+  int clients;
+  struct sockaddr_in daemon_addr;
+} opts = { 1000, 15, 5, 60, 0.0, 0.0, 0.0, 0, 1, 0, 0, 1 };
+
+struct sim_ioc *iocs;
+int *sockfds;
+char *control_socket = NULL;
+
+struct
+{
+  uint64_t sent;
+  uint64_t reboots;
+  uint64_t old;
+  uint64_t duplicates;
+  uint64_t ids;
+  uint64_t send_errors;
+} counts;
+
+
+static double time_now( void)
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int packet_build( char *buffer, struct sim_ioc *ioc, uint32_t heartbeat)
+{
+  char *p;
+  uint16_t flags;
+
+  // flag 2 means don't read environment
+  flags = opts.env_port ? 0 : 2;
+
+  p = buffer;
+  *((uint32_t *) p) = htonl( 0x12345678);
+  p += 4;
+  *((uint16_t *) p) = htons( opts.version);
+  p += 2;
+  *((uint32_t *) p) = htonl( ioc->incarnation - EPICS_EPOCH);
+  p += 4;
+  *((uint32_t *) p) = htonl( time(NULL) - EPICS_EPOCH);
+  p += 4;
+  *((uint32_t *) p) = htonl( heartbeat);
+  p += 4;
+  if( opts.version >= 5)
+    {
+      *((uint16_t *) p) = htons( opts.period);
+      p += 2;
+    }
+  *((uint16_t *) p) = htons( flags);
+  p += 2;
+  *((uint16_t *) p) = htons( opts.env_port);
+  p += 2;
+  *((uint32_t *) p) = htonl( 0);  // user message
+  p += 4;
+  if( opts.version >= 6)
+    {
+      *((uint32_t *) p) = htonl( ioc->id);
+      p += 4;
+    }
+  p = stpcpy( p, ioc->name) + 1;
+
+  return p - buffer;
+}
+
+
+static void packet_send( int index, char *buffer, int length)
+{
+  if( sendto( sockfds[index % opts.sockets], buffer, length, 0,
+              (struct sockaddr *) &(opts.daemon_addr),
+              sizeof( opts.daemon_addr)) == -1)
+    counts.send_errors++;
+  else
+    counts.sent++;
+}
+
+
+static int chance( double percent)
+{
+  return (percent > 0.0) && ((drand48() * 100.0) < percent);
+}
+
+
+static void heartbeat_send( int index)
+{
+  struct sim_ioc *ioc;
+  char buffer[128];
+  int length;
+
+  ioc = &(iocs[index]);
+
+  if( chance( opts.reboot))
+    {
+      // new incarnation, so daemon sees a BOOT
+      ioc->incarnation++;
+      ioc->heartbeat = 0;
+      ioc->id = 0;
+      counts.reboots++;
+    }
+
+  ioc->heartbeat++;
+  length = packet_build( buffer, ioc, ioc->heartbeat);
+  packet_send( index, buffer, length);
+
+  if( chance( opts.duplicate))
+    {
+      packet_send( index, buffer, length);
+      counts.duplicates++;
+    }
+  if( (ioc->heartbeat > 1) && chance( opts.old))
+    {
+      length = packet_build( buffer, ioc, ioc->heartbeat - 1);
+      packet_send( index, buffer, length);
+      counts.old++;
+    }
+}
+
+
+// v6 record ids sent back by the daemon
+static void id_replies_read( void)
+{
+  char buffer[128];
+  int i, len, index;
+
+  for( i = 0; i < opts.sockets; i++)
+    while( (len = recv( sockfds[i], buffer, sizeof( buffer) - 1,
+                        MSG_DONTWAIT)) > 0)
+      {
+        if( (len < 17) || (ntohl( *((uint32_t *) buffer)) != 0x12345678) ||
+            (ntohs( *((uint16_t *) (buffer + 6))) != 1) )
+          continue;
+        buffer[len] = '\0';
+        if( strncmp( buffer + 16, NAME_FORMAT, NAME_PREFIX_LEN) )
+          continue;
+        index = atoi( buffer + 16 + NAME_PREFIX_LEN);
+        if( (index < 0) || (index >= opts.number) ||
+            (ntohl( *((uint32_t *) (buffer + 8))) + EPICS_EPOCH !=
+             iocs[index].incarnation) )
+          continue;
+        iocs[index].id = ntohl( *((uint32_t *) (buffer + 12)));
+        counts.ids++;
+      }
+}
+
+
+///////////////////////////////////
+
+static void *env_server( void *data)
+{
+  int sockfd, client;
+  char message[256];
+  char *p;
+  int i;
+
+  char *env[] = { "EPICS_BASE", "/opt/epics/base",
+                  "ARCH", "linux-x86_64" };
+  char *extra[] = { "loadgen", "loadgen", "localhost" };
+
+  sockfd = *((int *) data);
+
+  // fixed message for all IOCs, Linux type
+  p = message + 8;
+  *((uint16_t *) p) = htons( 2);
+  p += 2;
+  for( i = 0; i < 4; i += 2)
+    {
+      *((uint8_t *) p) = strlen( env[i]);
+      p = stpcpy( p + 1, env[i]);
+      *((uint16_t *) p) = htons( strlen( env[i+1]));
+      p = stpcpy( p + 2, env[i+1]);
+    }
+  for( i = 0; i < 3; i++)
+    {
+      *((uint8_t *) p) = strlen( extra[i]);
+      p = stpcpy( p + 1, extra[i]);
+    }
+  *((uint16_t *) message) = htons( opts.version);
+  *((uint16_t *) (message + 2)) = htons( 2);
+  *((uint32_t *) (message + 4)) = htonl( p - message);
+
+  while( 1)
+    {
+      if( (client = accept( sockfd, NULL, NULL)) == -1)
+        continue;
+      if( write( client, message, p - message) == -1)
+        perror("env write");
+      close( client);
+    }
+
+  return NULL;
+}
+
+
+static int env_server_start( void)
+{
+  static int sockfd;
+  struct sockaddr_in addr;
+  pthread_t thread;
+  int flag = 1;
+
+  sockfd = socket( AF_INET, SOCK_STREAM, 0);
+  setsockopt( sockfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof( flag));
+  bzero( &addr, sizeof( addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl( INADDR_ANY);
+  addr.sin_port = htons( opts.env_port);
+  if( bind( sockfd, (struct sockaddr *) &addr, sizeof( addr)) ||
+      listen( sockfd, 1024) )
+    {
+      perror("env server");
+      return 1;
+    }
+
+  pthread_create( &thread, NULL, env_server, &sockfd);
+  pthread_detach( thread);
+
+  return 0;
+}
+
+
+///////////////////////////////////
+
+// gets numbers out of daemon's control stats, returns 1 on failure
+static int daemon_stats( uint64_t *packets, double *cpu)
+{
+  int sockfd, len, t;
+  struct sockaddr_un u_addr;
+  char buffer[8192];
+  char *p;
+
+  if( control_socket == NULL)
+    return 1;
+
+  if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    return 1;
+  u_addr.sun_family = AF_UNIX;
+  strcpy(u_addr.sun_path, control_socket);
+  len = strlen(u_addr.sun_path) + sizeof(u_addr.sun_family);
+  if( connect(sockfd, (struct sockaddr *)&u_addr, len) ||
+      (send(sockfd, "stats", 6, 0) == -1) )
+    {
+      close( sockfd);
+      return 1;
+    }
+  shutdown( sockfd, SHUT_WR);
+
+  len = 0;
+  while( (len < sizeof( buffer) - 1) &&
+         ((t = recv(sockfd, buffer + len, sizeof( buffer) - 1 - len, 0)) > 0))
+    len += t;
+  buffer[len] = '\0';
+  close(sockfd);
+
+  *packets = 0;
+  *cpu = 0.0;
+  if( (p = strstr( buffer, "heartbeat packets = ")) == NULL)
+    return 1;
+  *packets = strtoull( p + 20, NULL, 10);
+  if( (p = strstr( buffer, "cpu time (s) = ")) != NULL)
+    *cpu = strtod( p + 15, NULL);
+
+  return 0;
+}
+
+// kernel drops for all UDP sockets bound to port
+static uint64_t udp_drops( int port)
+{
+  FILE *fptr;
+  char line[512];
+  unsigned int local_port;
+  unsigned long long drops;
+  uint64_t total = 0;
+  char *p;
+
+  if( (fptr = fopen( "/proc/net/udp", "r")) == NULL)
+    return 0;
+  while( fgets( line, sizeof( line), fptr) != NULL)
+    {
+      // "  sl  local_address ..." is the header
+      if( ((p = strchr( line, ':')) == NULL) ||
+          ((p = strchr( p + 1, ':')) == NULL) ||
+          (sscanf( p + 1, "%x", &local_port) != 1) ||
+          (local_port != port) )
+        continue;
+      // drops is the thirteenth field
+      if( sscanf( line, "%*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s "
+                  "%llu", &drops) == 1)
+        total += drops;
+    }
+  fclose( fptr);
+
+  return total;
+}
+
+
+///////////////////////////////////
+
+// returns bytes in reply to a full-list request, or -1
+static int64_t query_all( struct sockaddr_in *addr)
+{
+  int sockfd;
+  uint16_t type;
+  char buffer[65536];
+  int64_t total;
+  int len;
+
+  if( (sockfd = socket( AF_INET, SOCK_STREAM, 0)) == -1)
+    return -1;
+  type = htons( 1);
+  if( connect( sockfd, (struct sockaddr *) addr, sizeof( *addr)) ||
+      (write( sockfd, &type, sizeof( type)) != sizeof( type)) )
+    {
+      close( sockfd);
+      return -1;
+    }
+
+  total = 0;
+  while( (len = read( sockfd, buffer, sizeof( buffer))) > 0)
+    total += len;
+  close( sockfd);
+
+  return (len < 0) ? -1 : total;
+}
+
+struct query_client
+{
+  pthread_t thread;
+  struct sockaddr_in *addr;
+  int requests;
+  int64_t bytes;  // -1 if a request failed
+};
+
+static void *query_thread( void *data)
+{
+  struct query_client *qc;
+  int64_t len;
+  int i;
+
+  qc = data;
+  qc->bytes = 0;
+  for( i = 0; i < qc->requests; i++)
+    {
+      if( (len = query_all( qc->addr)) < 0)
+        {
+          perror("query");
+          qc->bytes = -1;
+          break;
+        }
+      qc->bytes += len;
+    }
+
+  return NULL;
+}
+
+static int query_benchmark( void)
+{
+  struct sockaddr_in addr;
+  struct query_client *qcs;
+  char *port_str;
+  double start, elapsed;
+  double cpu_before, cpu_after;
+  uint64_t packets;
+  int64_t bytes;
+  int stats_flag;
+  int fail_flag;
+  int i;
+
+  if( config_find( "database_tcp_port", &port_str) || (port_str == NULL))
+    {
+      printf("Error: No database port configured.\n");
+      return 4;
+    }
+  addr = opts.daemon_addr;
+  addr.sin_port = htons( atoi( port_str));
+
+  stats_flag = !daemon_stats( &packets, &cpu_before);
+  if( !stats_flag)
+    printf("Can't get daemon stats, only request time is reported.\n");
+
+  if( (qcs = calloc( opts.clients, sizeof( struct query_client))) == NULL)
+    return 5;
+  for( i = 0; i < opts.clients; i++)
+    {
+      qcs[i].addr = &addr;
+      // the first ones make any left over
+      qcs[i].requests = opts.queries / opts.clients + 
+        (i < (opts.queries % opts.clients));
+    }
+
+  start = time_now();
+  for( i = 0; i < opts.clients; i++)
+    pthread_create( &(qcs[i].thread), NULL, query_thread, &(qcs[i]));
+  bytes = 0;
+  fail_flag = 0;
+  for( i = 0; i < opts.clients; i++)
+    {
+      pthread_join( qcs[i].thread, NULL);
+      if( qcs[i].bytes < 0)
+        fail_flag = 1;
+      else
+        bytes += qcs[i].bytes;
+    }
+  elapsed = time_now() - start;
+  free( qcs);
+  if( fail_flag)
+    return 6;
+
+  printf("full-list requests = %d\n", opts.queries);
+  printf("clients = %d\n", opts.clients);
+  printf("reply size (bytes) = %.0f\n", ((double) bytes) / opts.queries);
+  printf("time per request (ms) = %.3f\n", elapsed * 1000 / opts.queries);
+  printf("requests per second = %.1f\n", opts.queries / elapsed);
+  if( stats_flag && !daemon_stats( &packets, &cpu_after))
+    printf("daemon cpu per request (ms) = %.3f\n",
+           (cpu_after - cpu_before) * 1000 / opts.queries);
+
+  return 0;
+}
+
+
+///////////////////////////////////
+
+void helper(void)
+{
+  printf("alive_loadgen [-n <iocs>] [-p <period>] [-V <version>] "
+         "[-t <seconds>]\n"
+         "              [-r <pct>] [-o <pct>] [-d <pct>] [-e <port>] "
+         "[-s <sockets>]\n"
+         "              [-a <address>] [-u <port>] [-b] [-q <requests>] "
+         "[-c <clients>]\n"
+         "              [<socket>]\n"
+         "  Sends heartbeats for simulated IOCs to the alive daemon.\n"
+         "  The control socket can be specified, else a default value will "
+         "be used.\n"
+         "    -n  number of IOCs (default 1000)\n"
+         "    -p  heartbeat period in seconds (default 15)\n"
+         "    -V  protocol version: 4, 5 or 6 (default 5)\n"
+         "    -t  run time in seconds (default 60)\n"
+         "    -r  percent of heartbeats that are reboots\n"
+         "    -o  percent of heartbeats followed by an older one\n"
+         "    -d  percent of heartbeats sent twice\n"
+         "    -e  serves environment reads on this TCP port\n"
+         "    -s  number of sending sockets (default 1)\n"
+         "    -a  daemon address (default 127.0.0.1)\n"
+         "    -u  daemon heartbeat port (default from configuration)\n"
+         "    -b  benchmark, sending as fast as possible and reporting "
+         "daemon throughput\n"
+         "    -q  instead of heartbeats, times this many requests for "
+         "all IOCs\n"
+         "    -c  number of clients making the -q requests at once "
+         "(default 1)\n"
+         );
+}
+
+
+int main( int argc, char *argv[])
+{
+  int opt;
+  char *port_str;
+  int i, next;
+  double start, now, elapsed;
+
+  uint64_t packets_before, packets_after;
+  double cpu_before, cpu_after;
+  uint64_t drops_before = 0, drops_after;
+  int stats_flag;
+
+  opts.daemon_addr.sin_family = AF_INET;
+  opts.daemon_addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK);
+  opts.daemon_addr.sin_port = 0;
+
+  while((opt = getopt( argc, argv, "hn:p:V:t:r:o:d:e:s:a:u:bq:c:")) != -1)
+    {
+      switch(opt)
+        {
+        case 'h':
+          helper();
+          return 0;
+        case 'n':
+          opts.number = atoi( optarg);
+          break;
+        case 'p':
+          opts.period = atoi( optarg);
+          break;
+        case 'V':
+          opts.version = atoi( optarg);
+          break;
+        case 't':
+          opts.duration = atoi( optarg);
+          break;
+        case 'r':
+          opts.reboot = atof( optarg);
+          break;
+        case 'o':
+          opts.old = atof( optarg);
+          break;
+        case 'd':
+          opts.duplicate = atof( optarg);
+          break;
+        case 'e':
+          opts.env_port = atoi( optarg);
+          break;
+        case 's':
+          opts.sockets = atoi( optarg);
+          break;
+        case 'a':
+          if( !inet_aton( optarg, &(opts.daemon_addr.sin_addr)) )
+            {
+              printf("Error: Bad address \"%s\".\n", optarg);
+              return 2;
+            }
+          break;
+        case 'u':
+          opts.daemon_addr.sin_port = htons( atoi( optarg));
+          break;
+        case 'b':
+          opts.benchmark = 1;
+          break;
+        case 'q':
+          opts.queries = atoi( optarg);
+          break;
+        case 'c':
+          opts.clients = atoi( optarg);
+          break;
+        case ':':
+        case '?':
+          return 2;
+          break;
+        }
+    }
+
+  if( (opts.number < 1) || (opts.number > 999999) || (opts.period < 1) ||
+      (opts.version < 4) || (opts.version > 6) || (opts.duration < 1) ||
+      (opts.sockets < 1) || (opts.queries < 0) || (opts.clients < 1) )
+    {
+      printf("Error: Bad option value.\n");
+      return 2;
+    }
+
+  if( (argc - optind) > 1)
+    {
+      printf("Error: Only single control port argument allowed as "
+             "non-command.\n");
+      return 3;
+    }
+  if( (argc - optind) == 1)
+    control_socket = strdup( argv[optind] );
+  else if( config_find( "control_socket", &control_socket) )
+    control_socket = NULL;
+
+  if( opts.queries)
+    return query_benchmark();
+
+  if( !opts.daemon_addr.sin_port)
+    {
+      if( config_find( "heartbeat_udp_port", &port_str) || (port_str == NULL))
+        {
+          printf("Error: No heartbeat port given or configured.\n");
+          return 4;
+        }
+      opts.daemon_addr.sin_port = htons( atoi( port_str));
+    }
+
+  iocs = calloc( opts.number, sizeof( struct sim_ioc));
+  sockfds = calloc( opts.sockets, sizeof( int));
+  if( (iocs == NULL) || (sockfds == NULL))
+    {
+      printf("Error: Out of memory.\n");
+      return 5;
+    }
+  for( i = 0; i < opts.sockets; i++)
+    if( (sockfds[i] = socket( AF_INET, SOCK_DGRAM, 0)) == -1)
+      {
+        perror("socket");
+        return 5;
+      }
+
+  srand48( time(NULL));
+  for( i = 0; i < opts.number; i++)
+    {
+      snprintf( iocs[i].name, 32, NAME_FORMAT, i);
+      // spread boot times over the last day
+      iocs[i].incarnation = time(NULL) - 3600 - (lrand48() % 86400);
+    }
+
+  if( opts.env_port && env_server_start())
+    return 6;
+
+  stats_flag = 0;
+  if( opts.benchmark)
+    {
+      stats_flag = !daemon_stats( &packets_before, &cpu_before);
+      if( !stats_flag)
+        printf("Can't get daemon stats, only sending rate is reported.\n");
+      drops_before = udp_drops( ntohs( opts.daemon_addr.sin_port));
+    }
+
+  start = time_now();
+  next = 0;
+  while( 1)
+    {
+      now = time_now();
+      elapsed = now - start;
+      if( elapsed >= opts.duration)
+        break;
+
+      if( opts.benchmark)
+        {
+          for( i = 0; i < 1024; i++)
+            {
+              heartbeat_send( next);
+              next = (next + 1) % opts.number;
+            }
+        }
+      else
+        {
+          // every IOC once per period, spread evenly
+          uint64_t due;
+
+          due = (uint64_t) (elapsed * opts.number / opts.period) + 1;
+          while( counts.sent - counts.duplicates - counts.old < due)
+            {
+              heartbeat_send( next);
+              next = (next + 1) % opts.number;
+            }
+          usleep( 10000);
+        }
+
+      if( opts.version >= 6)
+        id_replies_read();
+    }
+  elapsed = time_now() - start;
+
+  printf("%llu heartbeats sent in %.2f s (%.0f/s), %llu send errors\n",
+         (unsigned long long) counts.sent, elapsed, counts.sent / elapsed,
+         (unsigned long long) counts.send_errors);
+  printf("%llu reboots, %llu old, %llu duplicates, %llu record ids "
+         "received\n",
+         (unsigned long long) counts.reboots, (unsigned long long) counts.old,
+         (unsigned long long) counts.duplicates,
+         (unsigned long long) counts.ids);
+
+  if( opts.benchmark)
+    {
+      // let the daemon catch up
+      sleep( 1);
+      drops_after = udp_drops( ntohs( opts.daemon_addr.sin_port));
+      printf("kernel drops = %llu\n",
+             (unsigned long long) (drops_after - drops_before));
+      if( stats_flag && !daemon_stats( &packets_after, &cpu_after))
+        {
+          printf("daemon accepted = %llu (%.0f/s)\n",
+                 (unsigned long long) (packets_after - packets_before),
+                 (packets_after - packets_before) / elapsed);
+          printf("daemon cpu = %.3f s, %.2f us per packet\n",
+                 cpu_after - cpu_before,
+                 (packets_after > packets_before) ?
+                 (cpu_after - cpu_before) * 1e6 /
+                 (packets_after - packets_before) : 0.0);
+        }
+    }
+
+  return 0;
+}
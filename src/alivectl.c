@@ -184,7 +184,7 @@ int send_receive_message( char *message, int length)
 
 void helper(void)
 {
-  printf("alivectl (-v|-q|-p|-s|-c|-l|-e|-i <ioc>|-d <ioc>|-a <prefix>) [<socket>]\n"
+  printf("alivectl (-v|-q|-p|-s|-c|-l|-e|-r|-i <ioc>|-d <ioc>|-a <prefix>) [<socket>]\n"
          "  The socket can be specified, else a default value will be used.\n"
          "    -v  prints the version of the alive daemon and tools\n"
          "    -q  stops current alived\n"
@@ -193,6 +193,7 @@ void helper(void)
          "    -c  prints configuration information\n"
          "    -l  prints list of IOCs\n"
          "    -e  prints list of event subscription clients\n"
+         "    -r  reopens the log and event files, for after rotating them\n"
          "    -i  prints information about IOC\n"
          "    -d  deletes ioc specified from database\n"
          "    -a  archives the database into CSV files, using prefix for file names\n"
@@ -237,11 +238,11 @@ int main( int argc, char *argv[])
 
   enum command { None, Help, Version, Quit, Ping, List, Subscribers, Info,
                  Stats, Delete, Archive, Configuration, TreeDump,
-                 Experimental };
+                 Experimental, ReopenLogs };
   enum command cmd = None;
 
   arg = NULL;
-  while((opt = getopt( argc, argv, "hvcqpsx:lei:d:a:t:")) != -1)
+  while((opt = getopt( argc, argv, "hvcqpsrx:lei:d:a:t:")) != -1)
     {
       // only one command switch can be specified
       if( cmd != None)
@@ -281,6 +282,9 @@ int main( int argc, char *argv[])
         case 's':
           cmd = Stats;
           break;
+        case 'r':
+          cmd = ReopenLogs;
+          break;
         case 'a':
           cmd = Archive;
           arg = strdup(optarg);
@@ -355,6 +359,9 @@ int main( int argc, char *argv[])
     case Configuration:
       send_receive_message( "configuration", 14);
       break;
+    case ReopenLogs:
+      send_receive_message( "reopen_logs", 12);
+      break;
     case Info:
       cnt = snprintf( buffer, BUFSIZE, "info %s", arg);
       if( cnt < BUFSIZE)
@@ -111,7 +111,7 @@ void *client_reply( void *data)
         goto error;
       type = ntohs( o16);
 
-      now = time(NULL);
+      now = clock_now();
 
       o16 = htons( API_PROCOTOL_VERSION); //version
       write( client_sockfd, &o16, sizeof(o16));
@@ -146,6 +146,9 @@ void *client_reply( void *data)
           iocdb_socket_send_single( client_sockfd, name);
           free(name);
           break;
+        case 4:
+          iocdb_socket_send_loading( client_sockfd);
+          break;
 
         case 15:
           name = net_string_grab( 1, client_sockfd);
@@ -292,7 +295,13 @@ int control_loop(void )
         }
       else if( !strcmp( buffer, "stats") )
         {
-          cnt = sprintf(buffer, "%d IOCs\n", iocdb_number_iocs() );
+          iocdb_socket_send_control_stats( c_sockfd);
+        }
+      else if( !strcmp( buffer, "reopen_logs") )
+        {
+          log_reopen();
+          event_files_close();
+          cnt = sprintf(buffer, "reopening logs\n" );
           send(c_sockfd, buffer, cnt + 1, 0);
         }
       else if( !strcmp( buffer, "configuration") )
@@ -353,7 +362,14 @@ int control_loop(void )
                 }
               p++;
             }
-          if( safe)
+          if( safe && iocdb_loading( NULL, NULL))
+            {
+              cnt = snprintf(buffer, BUFSIZE, 
+                             "state still loading, \'%s\' not deleted\n",
+                             tbuffer );
+              send(c_sockfd, buffer, cnt + 1, 0);
+            }
+          else if( safe)
             {
               if( !iocdb_remove( tbuffer, 1) )
                 cnt = snprintf(buffer, BUFSIZE, "\'%s\' not found\n", tbuffer );
@@ -394,16 +410,28 @@ int control_loop(void )
 
 int config_dict_reader(struct config_dictionary *dict)
 {
+  // settings after RequiredNumber are optional, and have defaults
   enum Settings { HeartbeatUdpPort, DatabaseTcpPort, SubscriptionUdpPort,
                   FailNumberHeartbeats, FailCheckPeriod, InstanceRetainTime,
                   LogFile, EventFile, InfoFile, ControlSocket, EventDir,
-                  StateDir, SettingsNumber };
+                  StateDir, RequiredNumber,
+                  HeartbeatBatchSize = RequiredNumber, HeartbeatReceivers,
+                  DatabaseShards, EnvFetchThreads, EnvFetchQueueSize,
+                  EnvFetchConnections, EnvFetchTimeout, EventFileCache,
+                  StateSnapshotPeriod, StateCommitInterval, StateLazyEnv,
+                  EnvWireCache, SettingsNumber };
 
   char *setting_str[] = { "heartbeat_udp_port", "database_tcp_port",
                           "subscription_udp_port", "fail_number_heartbeats",
                           "fail_check_period", "instance_retain_time",
                           "log_file", "event_file", "info_file",
-                          "control_socket", "event_dir", "state_dir" };
+                          "control_socket", "event_dir", "state_dir",
+                          "heartbeat_batch_size", "heartbeat_receivers",
+                          "database_shards", "env_fetch_threads",
+                          "env_fetch_queue_size", "env_fetch_connections",
+                          "env_fetch_timeout", "event_file_cache",
+                          "state_snapshot_period", "state_commit_interval",
+                          "state_lazy_env", "env_wire_cache" };
 
   
 
@@ -429,6 +457,20 @@ int config_dict_reader(struct config_dictionary *dict)
       printf("Can't allocate memory.\n");
       return 1;
     }
+
+  // defaults for optional settings
+  config.heartbeat_batch_size = 32;
+  config.heartbeat_receivers = 1;
+  config.database_shards = 16;
+  config.env_fetch_threads = 4;
+  config.env_fetch_queue_size = 4096;
+  config.env_fetch_connections = 256;
+  config.env_fetch_timeout = 5;
+  config.event_file_cache = 256;
+  config.state_snapshot_period = 600;
+  config.state_commit_interval = 200;
+  config.state_lazy_env = 0;
+  config.env_wire_cache = 16384;
   
   for( i = 0; i < dict->count; i++)
     {
@@ -504,6 +546,138 @@ int config_dict_reader(struct config_dictionary *dict)
           else
             config.subscription_udp_port = val;
           break;
+        case HeartbeatBatchSize:
+          val = atoi( token2);
+          if( (val <= 0) || (val > 1024) )
+            {
+              printf("Configuration file error in \"%s\" :\n"
+                     "Bad value of \"%s\" for \"%s\".\n",
+                     dict->filename, token2, token1);
+              return 1;
+            }
+          config.heartbeat_batch_size = val;
+          break;
+        case HeartbeatReceivers:
+          val = atoi( token2);
+          if( (val <= 0) || (val > 64) )
+            {
+              printf("Configuration file error in \"%s\" :\n"
+                     "Bad value of \"%s\" for \"%s\".\n",
+                     dict->filename, token2, token1);
+              return 1;
+            }
+          config.heartbeat_receivers = val;
+          break;
+        case DatabaseShards:
+          val = atoi( token2);
+          if( (val <= 0) || (val > 256) )
+            {
+              printf("Configuration file error in \"%s\" :\n"
+                     "Bad value of \"%s\" for \"%s\".\n",
+                     dict->filename, token2, token1);
+              return 1;
+            }
+          config.database_shards = val;
+          break;
+        case EnvFetchThreads:
+          val = atoi( token2);
+          if( (val <= 0) || (val > 1024) )
+            {
+              printf("Configuration file error in \"%s\" :\n"
+                     "Bad value of \"%s\" for \"%s\".\n",
+                     dict->filename, token2, token1);
+              return 1;
+            }
+          config.env_fetch_threads = val;
+          break;
+        case EnvFetchQueueSize:
+          val = atoi( token2);
+          if( (val <= 0) || (val > 1000000) )
+            {
+              printf("Configuration file error in \"%s\" :\n"
+                     "Bad value of \"%s\" for \"%s\".\n",
+                     dict->filename, token2, token1);
+              return 1;
+            }
+          config.env_fetch_queue_size = val;
+          break;
+        case EnvFetchConnections:
+          val = atoi( token2);
+          if( (val <= 0) || (val > 16384) )
+            {
+              printf("Configuration file error in \"%s\" :\n"
+                     "Bad value of \"%s\" for \"%s\".\n",
+                     dict->filename, token2, token1);
+              return 1;
+            }
+          config.env_fetch_connections = val;
+          break;
+        case EnvFetchTimeout:
+          val = atoi( token2);
+          if( (val <= 0) || (val > 600) )
+            {
+              printf("Configuration file error in \"%s\" :\n"
+                     "Bad value of \"%s\" for \"%s\".\n",
+                     dict->filename, token2, token1);
+              return 1;
+            }
+          config.env_fetch_timeout = val;
+          break;
+        case EventFileCache:
+          val = atoi( token2);
+          if( (val < 0) || (val > 16384) )
+            {
+              printf("Configuration file error in \"%s\" :\n"
+                     "Bad value of \"%s\" for \"%s\".\n",
+                     dict->filename, token2, token1);
+              return 1;
+            }
+          config.event_file_cache = val;
+          break;
+        case StateSnapshotPeriod:
+          val = atoi( token2);
+          if( (val < 0) || (val > 604800) )
+            {
+              printf("Configuration file error in \"%s\" :\n"
+                     "Bad value of \"%s\" for \"%s\".\n",
+                     dict->filename, token2, token1);
+              return 1;
+            }
+          config.state_snapshot_period = val;
+          break;
+        case StateCommitInterval:
+          val = atoi( token2);
+          if( (val < 0) || (val > 60000) )
+            {
+              printf("Configuration file error in \"%s\" :\n"
+                     "Bad value of \"%s\" for \"%s\".\n",
+                     dict->filename, token2, token1);
+              return 1;
+            }
+          config.state_commit_interval = val;
+          break;
+        case StateLazyEnv:
+          val = atoi( token2);
+          if( (val < 0) || (val > 1) )
+            {
+              printf("Configuration file error in \"%s\" :\n"
+                     "Bad value of \"%s\" for \"%s\".\n",
+                     dict->filename, token2, token1);
+              return 1;
+            }
+          config.state_lazy_env = val;
+          break;
+        case EnvWireCache:
+          val = atoi( token2);
+          if( (val < 0) || (val > 4194304) )
+            {
+              printf("Configuration file error in \"%s\" :\n"
+                     "Bad value of \"%s\" for \"%s\".\n",
+                     dict->filename, token2, token1);
+              return 1;
+            }
+          config.env_wire_cache = val;
+          break;
         case LogFile:
           config.log_file = strdup( token2);
           break;
@@ -533,7 +707,7 @@ int config_dict_reader(struct config_dictionary *dict)
       flags[current] = 1;
     }
 
-  for( i = 0; i < SettingsNumber; i++)
+  for( i = 0; i < RequiredNumber; i++)
     {
       if( !flags[i] )
         {
@@ -632,8 +806,14 @@ int main( int argc, char *argv[])
 
   log_init(config.log_file);
 
+  // primes the coarse clock before any threads use it
+  clock_update();
+
   debug_init("/tmp/alived-debug.log");
 
+  if( event_file_init( config.event_file_cache))
+    log_write("Can't allocate event file cache, files won't be kept open.\n");
+
 
   log_write("Start\n");
 
@@ -709,6 +889,7 @@ int main( int argc, char *argv[])
   //  pthread_exit(NULL);
 
   log_write("Halt\n");
+  log_flush();
 
   return 0;
 }
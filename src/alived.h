@@ -35,6 +35,20 @@ struct alived_config
 
   char *event_dir;
   char *state_dir;
+
+  // optional settings, defaults set before configuration is read
+  uint16_t heartbeat_batch_size;
+  uint16_t heartbeat_receivers;
+  uint16_t database_shards;
+  uint16_t env_fetch_threads;
+  uint32_t env_fetch_queue_size;
+  uint16_t env_fetch_connections;
+  uint16_t env_fetch_timeout;
+  uint16_t event_file_cache;
+  uint32_t env_wire_cache;  // kB
+  uint32_t state_snapshot_period;
+  uint16_t state_commit_interval;  // msec
+  uint8_t state_lazy_env;
 };
 
 ///////////////////////////
@@ -0,0 +1,418 @@
+/*************************************************************************\
+* Copyright (c) 2020 UChicago Argonne, LLC,
+*               as Operator of Argonne National Laboratory.
+\*************************************************************************/
+
+/*
+  Written by Dohn A. Arms (Advanced Photon Source, ANL)
+*/
+
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+
+#include "envfetch.h"
+#include "logging.h"
+#include "utility.h"
+
+
+/*
+  This reads IOC environments with a single thread, using non-blocking
+  sockets and epoll, so that many reads can be going at once without
+  a thread for each one.
+
+  Requests are pulled from the source callback whenever a connection
+  slot is free.  Each connection has a deadline covering both the
+  connect and the read, and as every connection gets the same timeout,
+  the active list is in deadline order and only its head needs checking.
+
+  The message header (version, type, length) is read first, then a
+  buffer of exactly the given length is allocated for the rest.
+*/
+
+#define ENVFETCH_HEADER (8)
+#define ENVFETCH_MIN_LENGTH (10)
+#define ENVFETCH_MAX_LENGTH (1048576)
+
+#define ENVFETCH_EVENTS (64)
+
+struct envfetch_conn
+{
+  int fd;
+  int connected;
+  struct envfetch_request *request;
+  uint64_t deadline;  // msec
+
+  char header[ENVFETCH_HEADER];
+  uint32_t got;
+
+  struct envfetch_conn *prev;
+  struct envfetch_conn *next;
+};
+
+static struct
+{
+  int epoll_fd;
+  int wake_fd;
+  int timeout;  // msec
+
+  struct envfetch_request *(* source)( void);
+  void (* finish)( struct envfetch_request *);
+
+  struct envfetch_conn *conns;
+  struct envfetch_conn *free_list;
+  // active connections, oldest first
+  struct envfetch_conn *oldest;
+  struct envfetch_conn *newest;
+
+  pthread_mutex_t lock;
+  struct envfetch_stats stats;
+} ef = { -1, -1 };
+
+
+static uint64_t msec_now( void)
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static void conn_finish( struct envfetch_conn *conn, int result)
+{
+  struct envfetch_request *request;
+
+  // closing also takes it out of epoll
+  if( conn->fd != -1)
+    close( conn->fd);
+
+  if( conn->prev == NULL)
+    ef.oldest = conn->next;
+  else
+    conn->prev->next = conn->next;
+  if( conn->next == NULL)
+    ef.newest = conn->prev;
+  else
+    conn->next->prev = conn->prev;
+
+  request = conn->request;
+  conn->request = NULL;
+  conn->next = ef.free_list;
+  ef.free_list = conn;
+
+  request->result = result;
+  if( result != ENVFETCH_OK)
+    {
+      free( request->buffer);
+      request->buffer = NULL;
+      request->length = 0;
+    }
+
+  pthread_mutex_lock( &(ef.lock));
+  ef.stats.active--;
+  if( result == ENVFETCH_TIMEOUT)
+    ef.stats.timeouts++;
+  else if( result != ENVFETCH_OK)
+    ef.stats.failures++;
+  pthread_mutex_unlock( &(ef.lock));
+
+  ef.finish( request);
+}
+
+
+static void conn_start( struct envfetch_request *request)
+{
+  struct envfetch_conn *conn;
+  struct sockaddr_in ioc_addr;
+  struct epoll_event event;
+
+  conn = ef.free_list;
+  ef.free_list = conn->next;
+
+  conn->request = request;
+  conn->connected = 0;
+  conn->got = 0;
+  conn->deadline = msec_now() + ef.timeout;
+  request->buffer = NULL;
+  request->length = 0;
+
+  // on active list before anything can fail
+  conn->next = NULL;
+  conn->prev = ef.newest;
+  if( ef.newest == NULL)
+    ef.oldest = conn;
+  else
+    ef.newest->next = conn;
+  ef.newest = conn;
+
+  pthread_mutex_lock( &(ef.lock));
+  ef.stats.started++;
+  ef.stats.active++;
+  if( ef.stats.active > ef.stats.active_max)
+    ef.stats.active_max = ef.stats.active;
+  pthread_mutex_unlock( &(ef.lock));
+
+  conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if( conn->fd == -1)
+    {
+      log_error_write(errno, "envfetch socket");
+      conn_finish( conn, ENVFETCH_CONNECT);
+      return;
+    }
+
+  bzero( &ioc_addr, sizeof(ioc_addr) );
+  ioc_addr.sin_family = AF_INET;
+  ioc_addr.sin_port = htons(request->port);
+  ioc_addr.sin_addr = request->address;
+
+  event.events = EPOLLIN;
+  if( connect( conn->fd, (struct sockaddr *)&ioc_addr, sizeof(ioc_addr)) )
+    {
+      if( errno != EINPROGRESS)
+        {
+          conn_finish( conn, ENVFETCH_CONNECT);
+          return;
+        }
+      event.events = EPOLLOUT;
+    }
+  else
+    conn->connected = 1;
+
+  event.data.ptr = conn;
+  if( epoll_ctl( ef.epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) )
+    {
+      log_error_write(errno, "envfetch epoll add");
+      conn_finish( conn, ENVFETCH_CONNECT);
+    }
+}
+
+
+static void conn_read( struct envfetch_conn *conn)
+{
+  struct envfetch_request *request;
+  int len;
+
+  request = conn->request;
+
+  while( 1)
+    {
+      if( conn->got < ENVFETCH_HEADER)
+        len = read( conn->fd, conn->header + conn->got,
+                    ENVFETCH_HEADER - conn->got);
+      else
+        len = read( conn->fd, request->buffer + conn->got,
+                    request->length - conn->got);
+
+      if( len == 0)
+        {
+          // closed before the whole message got here
+          conn_finish( conn, (conn->got < ENVFETCH_HEADER) ?
+                       ENVFETCH_SHORT : ENVFETCH_LENGTH);
+          return;
+        }
+      if( len < 0)
+        {
+          if( errno == EINTR)
+            continue;
+          if( (errno != EAGAIN) && (errno != EWOULDBLOCK) )
+            conn_finish( conn, ENVFETCH_SHORT);
+          return;
+        }
+
+      conn->got += len;
+      if( conn->got == ENVFETCH_HEADER)
+        {
+          request->length = ntohl( *((uint32_t *) (conn->header + 4)) );
+          if( request->length < ENVFETCH_MIN_LENGTH)
+            {
+              conn_finish( conn, ENVFETCH_SHORT);
+              return;
+            }
+          if( request->length > ENVFETCH_MAX_LENGTH)
+            {
+              conn_finish( conn, ENVFETCH_LENGTH);
+              return;
+            }
+          if( (request->buffer = malloc( request->length)) == NULL)
+            {
+              conn_finish( conn, ENVFETCH_MEMORY);
+              return;
+            }
+          memcpy( request->buffer, conn->header, ENVFETCH_HEADER);
+        }
+      else if( (conn->got > ENVFETCH_HEADER) &&
+               (conn->got == request->length) )
+        {
+          conn_finish( conn, ENVFETCH_OK);
+          return;
+        }
+    }
+}
+
+
+static void conn_event( struct envfetch_conn *conn)
+{
+  struct epoll_event event;
+  int error;
+  socklen_t error_len;
+
+  if( conn->connected)
+    {
+      conn_read( conn);
+      return;
+    }
+
+  error_len = sizeof( error);
+  if( getsockopt( conn->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) ||
+      error)
+    {
+      conn_finish( conn, ENVFETCH_CONNECT);
+      return;
+    }
+
+  conn->connected = 1;
+  event.events = EPOLLIN;
+  event.data.ptr = conn;
+  if( epoll_ctl( ef.epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) )
+    {
+      log_error_write(errno, "envfetch epoll modify");
+      conn_finish( conn, ENVFETCH_CONNECT);
+    }
+}
+
+
+static void *envfetch_loop( void *data)
+{
+  struct epoll_event events[ENVFETCH_EVENTS];
+  struct envfetch_request *request;
+  uint64_t now;
+  uint64_t count;
+  int timeout;
+  int number;
+  int i;
+
+  while( 1)
+    {
+      while( (ef.free_list != NULL) && ((request = ef.source()) != NULL) )
+        conn_start( request);
+
+      if( ef.oldest == NULL)
+        timeout = -1;
+      else
+        {
+          now = msec_now();
+          timeout = (ef.oldest->deadline > now) ?
+            (ef.oldest->deadline - now) : 0;
+        }
+
+      number = epoll_wait( ef.epoll_fd, events, ENVFETCH_EVENTS, timeout);
+      // the workers use the coarse clock for what finishes here
+      clock_update();
+      if( number == -1)
+        {
+          if( errno != EINTR)
+            log_error_write(errno, "envfetch epoll_wait");
+          continue;
+        }
+
+      for( i = 0; i < number; i++)
+        {
+          if( events[i].data.ptr == NULL)
+            {
+              if( (read( ef.wake_fd, &count, sizeof( count)) == -1) &&
+                  (errno != EAGAIN) )
+                log_error_write(errno, "envfetch eventfd read");
+            }
+          else
+            conn_event( events[i].data.ptr);
+        }
+
+      now = msec_now();
+      while( (ef.oldest != NULL) && (ef.oldest->deadline <= now) )
+        conn_finish( ef.oldest, ENVFETCH_TIMEOUT);
+    }
+
+  return NULL;
+}
+
+
+void envfetch_wake( void)
+{
+  uint64_t count = 1;
+
+  if( write( ef.wake_fd, &count, sizeof( count)) == -1)
+    log_error_write(errno, "envfetch eventfd write");
+}
+
+
+void envfetch_stats_get( struct envfetch_stats *stats)
+{
+  pthread_mutex_lock( &(ef.lock));
+  *stats = ef.stats;
+  pthread_mutex_unlock( &(ef.lock));
+}
+
+
+// timeout is in seconds
+int envfetch_start( int connections, int timeout,
+                    struct envfetch_request *(* source)( void),
+                    void (* finish)( struct envfetch_request *))
+{
+  pthread_t thread;
+  pthread_attr_t attr;
+  struct epoll_event event;
+  int i;
+
+  ef.source = source;
+  ef.finish = finish;
+  ef.timeout = timeout * 1000;
+  pthread_mutex_init( &(ef.lock), NULL);
+
+  ef.conns = calloc( connections, sizeof( struct envfetch_conn));
+  if( ef.conns == NULL)
+    return 1;
+  for( i = 0; i < connections; i++)
+    ef.conns[i].next = (i + 1 < connections) ? &(ef.conns[i + 1]) : NULL;
+  ef.free_list = ef.conns;
+
+  if( (ef.epoll_fd = epoll_create1( EPOLL_CLOEXEC)) == -1)
+    {
+      log_error_write(errno, "envfetch epoll_create");
+      return 1;
+    }
+  if( (ef.wake_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    {
+      log_error_write(errno, "envfetch eventfd");
+      return 1;
+    }
+  // the wake descriptor is the only one with a NULL pointer
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if( epoll_ctl( ef.epoll_fd, EPOLL_CTL_ADD, ef.wake_fd, &event) )
+    {
+      log_error_write(errno, "envfetch epoll add");
+      return 1;
+    }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_create(&thread, &attr, envfetch_loop, NULL );
+  pthread_attr_destroy( &attr);
+
+  return 0;
+}
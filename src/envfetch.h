@@ -0,0 +1,54 @@
+/*************************************************************************\
+* Copyright (c) 2020 UChicago Argonne, LLC,
+*               as Operator of Argonne National Laboratory.
+\*************************************************************************/
+
+/*
+  Written by Dohn A. Arms (Advanced Photon Source, ANL)
+*/
+
+
+
+#ifndef ENVFETCH_H
+#define ENVFETCH_H 1
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/////////////////////////
+
+enum envfetch_results { ENVFETCH_OK, ENVFETCH_CONNECT, ENVFETCH_SHORT,
+                        ENVFETCH_LENGTH, ENVFETCH_TIMEOUT, ENVFETCH_MEMORY };
+
+// One environment read.  The address and port are filled in by the
+// requester, the rest by the engine.  On success, buffer holds the
+// whole message (header included), and belongs to the requester.
+struct envfetch_request
+{
+  struct in_addr address;
+  uint16_t port;
+
+  int result;
+  char *buffer;
+  uint32_t length;
+};
+
+struct envfetch_stats
+{
+  uint32_t active;     // connections in progress
+  uint32_t active_max;
+  uint64_t started;
+  uint64_t failures;   // connect, read or format problems
+  uint64_t timeouts;
+};
+
+// source gives the next request, or NULL if there is none;
+// finish gets every request back when done, from the engine's thread
+int envfetch_start( int connections, int timeout,
+                    struct envfetch_request *(* source)( void),
+                    void (* finish)( struct envfetch_request *));
+// tells the engine that source has something new
+void envfetch_wake( void);
+void envfetch_stats_get( struct envfetch_stats *stats);
+
+#endif
@@ -17,111 +17,162 @@
 
 #include "gentypes.h"
 
+// each thread sticks with one reader slot
+static __thread int worm_thread_slot = -1;
+// unsigned, as it wraps once enough threads have come and gone
+static unsigned int worm_next_slot = 0;
+
+static struct worm_slot *worm_slot_get( struct worm_mutex_struct *worm)
+{
+  if( worm_thread_slot < 0)
+    worm_thread_slot = __atomic_fetch_add( &worm_next_slot, 1,
+                                           __ATOMIC_RELAXED) % WORM_SLOTS;
+
+  return &(worm->readers[worm_thread_slot]);
+}
+
+static int worm_reader_count( struct worm_mutex_struct *worm)
+{
+  int i, count;
+
+  count = 0;
+  for( i = 0; i < WORM_SLOTS; i++)
+    count += __atomic_load_n( &(worm->readers[i].count), __ATOMIC_SEQ_CST);
+
+  return count;
+}
+
 void worm_init( struct worm_mutex_struct *worm)
 {
-  worm->read_count = 0;
-  worm->write_count = 0;
-  pthread_mutex_init(&(worm->m_1), NULL);
-  pthread_mutex_init(&(worm->m_2), NULL);
-  pthread_mutex_init(&(worm->m_3), NULL);
+  int i;
+
+  for( i = 0; i < WORM_SLOTS; i++)
+    worm->readers[i].count = 0;
+  worm->writer = 0;
   pthread_mutex_init(&(worm->m_w), NULL);
-  pthread_mutex_init(&(worm->m_r), NULL);
+  pthread_mutex_init(&(worm->m), NULL);
+  pthread_cond_init(&(worm->c_r), NULL);
+  pthread_cond_init(&(worm->c_w), NULL);
 }
 
 void worm_clear( struct worm_mutex_struct *worm)
 {
-  worm->read_count = 0;
-  worm->write_count = 0;
-  pthread_mutex_destroy(&(worm->m_1));
-  pthread_mutex_destroy(&(worm->m_2));
-  pthread_mutex_destroy(&(worm->m_3));
+  int i;
+
+  for( i = 0; i < WORM_SLOTS; i++)
+    worm->readers[i].count = 0;
+  worm->writer = 0;
   pthread_mutex_destroy(&(worm->m_w));
-  pthread_mutex_destroy(&(worm->m_r));
+  pthread_mutex_destroy(&(worm->m));
+  pthread_cond_destroy(&(worm->c_r));
+  pthread_cond_destroy(&(worm->c_w));
+}
+
+// take reader out, and wake writer if it's waiting on readers
+static void worm_reader_leave( struct worm_mutex_struct *worm,
+                               struct worm_slot *slot)
+{
+  __atomic_fetch_sub( &(slot->count), 1, __ATOMIC_SEQ_CST);
+  if( __atomic_load_n( &(worm->writer), __ATOMIC_SEQ_CST))
+    {
+      pthread_mutex_lock(&(worm->m));
+      pthread_cond_signal(&(worm->c_w));
+      pthread_mutex_unlock(&(worm->m));
+    }
 }
 
-// add reader to lock, lock out writer by at most one new reader
+// add reader to lock, unless a writer holds or wants it
+// Reader shows itself first, then checks for a writer; the writer does
+// the opposite, so at least one of them always sees the other.
 void worm_lock_reader(struct worm_mutex_struct *worm)
 {
-  pthread_mutex_lock(&(worm->m_3));
-  pthread_mutex_lock(&(worm->m_r));
-  pthread_mutex_lock(&(worm->m_1));
-  worm->read_count++;
-  if( worm->read_count == 1)
-    pthread_mutex_lock(&(worm->m_w));
-  pthread_mutex_unlock(&(worm->m_1));
-  pthread_mutex_unlock(&(worm->m_r));
-  pthread_mutex_unlock(&(worm->m_3));
+  struct worm_slot *slot;
+
+  slot = worm_slot_get( worm);
+  while( 1)
+    {
+      __atomic_fetch_add( &(slot->count), 1, __ATOMIC_SEQ_CST);
+      if( !__atomic_load_n( &(worm->writer), __ATOMIC_SEQ_CST))
+        return;
+
+      // writer first, so back out and wait for it
+      worm_reader_leave( worm, slot);
+      pthread_mutex_lock(&(worm->m));
+      while( __atomic_load_n( &(worm->writer), __ATOMIC_SEQ_CST))
+        pthread_cond_wait(&(worm->c_r), &(worm->m));
+      pthread_mutex_unlock(&(worm->m));
+    }
 }
 
-// remove reader from lock, remove lock from writer if no more readers
+// remove reader from lock
 void worm_unlock_reader(struct worm_mutex_struct *worm)
 {
-  pthread_mutex_lock(&(worm->m_1));
-  worm->read_count--;
-  if( worm->read_count == 0)
-    pthread_mutex_unlock(&(worm->m_w));
-  pthread_mutex_unlock(&(worm->m_1));
+  worm_reader_leave( worm, worm_slot_get( worm));
 }
 
 // set writer lock, but have to wait for previous writer to end
-// lock out the readers
+// lock out new readers, then wait for the current ones to leave
 void worm_lock_writer(struct worm_mutex_struct *worm)
 {
-  pthread_mutex_lock(&(worm->m_2));
-  worm->write_count++;
-  if( worm->write_count == 1)
-    pthread_mutex_lock(&(worm->m_r));
-  pthread_mutex_unlock(&(worm->m_2));
   pthread_mutex_lock(&(worm->m_w));
+  pthread_mutex_lock(&(worm->m));
+  __atomic_store_n( &(worm->writer), 1, __ATOMIC_SEQ_CST);
+  while( worm_reader_count( worm))
+    pthread_cond_wait(&(worm->c_w), &(worm->m));
+  pthread_mutex_unlock(&(worm->m));
 }
 
-// remove write lock, remove lock from readers if no more writers
+// remove write lock, and let readers in
 void worm_unlock_writer(struct worm_mutex_struct *worm)
 {
+  pthread_mutex_lock(&(worm->m));
+  __atomic_store_n( &(worm->writer), 0, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&(worm->c_r));
+  pthread_mutex_unlock(&(worm->m));
   pthread_mutex_unlock(&(worm->m_w));
-  pthread_mutex_lock(&(worm->m_2));
-  worm->write_count--;
-  if( worm->write_count == 0)
-    pthread_mutex_unlock(&(worm->m_r));
-  pthread_mutex_unlock(&(worm->m_2));
 }
 
 ///////////////////////////////
 
+// A reference count.  Taking a reference needs no ordering, as the
+// taker already has one to reach the thing.  Dropping one releases what
+// this thread did to the thing, and the drop that reaches zero also
+// acquires, so whoever frees it sees what every other holder did.
+
 void sharedint_init( struct sharedint_struct *shint, int count)
 {
-  pthread_mutex_init(&(shint->lock), NULL);
-  pthread_mutex_lock(&(shint->lock));
-  shint->count = count;
-  pthread_mutex_unlock(&(shint->lock));
+  __atomic_store_n( &(shint->count), count, __ATOMIC_RELAXED);
 }
 
 void sharedint_uninit( struct sharedint_struct *shint)
 {
-  pthread_mutex_destroy(&(shint->lock));
 }
 
 int sharedint_alter( struct sharedint_struct *shint, int count)
 {
-  int cnt;
+  if( count >= 0)
+    return __atomic_add_fetch( &(shint->count), count, __ATOMIC_RELAXED);
+  return __atomic_add_fetch( &(shint->count), count, __ATOMIC_ACQ_REL);
+}
 
-  pthread_mutex_lock(&(shint->lock));
-  shint->count += count;
-  cnt = shint->count;
-  pthread_mutex_unlock(&(shint->lock));
+// Drops one unless that would leave none, returning 1 if it did, so a
+// caller can take its own lock only for what might be the last one.
+int sharedint_drop_unless_last( struct sharedint_struct *shint)
+{
+  int count;
 
-  return cnt;
+  count = __atomic_load_n( &(shint->count), __ATOMIC_RELAXED);
+  while( count > 1)
+    if( __atomic_compare_exchange_n( &(shint->count), &count, count - 1, 1,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) )
+      return 1;
+
+  return 0;
 }
 
 int sharedint_value( struct sharedint_struct *shint)
 {
-  int cnt;
-
-  pthread_mutex_lock(&(shint->lock));
-  cnt = shint->count;
-  pthread_mutex_unlock(&(shint->lock));
-
-  return cnt;
+  return __atomic_load_n( &(shint->count), __ATOMIC_ACQUIRE);
 }
 
 ////////////////////////////////
@@ -231,6 +282,103 @@ unsigned char *netbuffer_export( struct netbuffer_struct *nbuff, int *size)
 }
 
 
+///////////////////////////////
+
+int timerwheel_init( struct timerwheel_struct *tw, int bits, uint32_t now)
+{
+  pthread_mutex_init(&(tw->lock), NULL);
+  tw->size = 1U << bits;
+  tw->current = now;
+  tw->number = 0;
+  tw->slots = calloc( tw->size, sizeof( struct timer_entry *));
+
+  return (tw->slots == NULL);
+}
+
+int timerwheel_add( struct timerwheel_struct *tw, uint32_t deadline,
+                    void *data)
+{
+  struct timer_entry *te;
+  uint32_t slot;
+
+  te = malloc( sizeof( struct timer_entry));
+  if( te == NULL)
+    return 1;
+  te->deadline = deadline;
+  te->data = data;
+
+  pthread_mutex_lock(&(tw->lock));
+  // already past goes in the next tick
+  if( (int32_t) (deadline - tw->current) <= 0)
+    slot = (tw->current + 1) & (tw->size - 1);
+  else
+    slot = deadline & (tw->size - 1);
+  te->next = tw->slots[slot];
+  tw->slots[slot] = te;
+  tw->number++;
+  pthread_mutex_unlock(&(tw->lock));
+
+  return 0;
+}
+
+void timerwheel_expire( struct timerwheel_struct *tw, uint32_t now,
+                        void (* func)( void *, uint32_t, void *), void *arg)
+{
+  struct timer_entry *due, *te, **tptr;
+  uint32_t ticks, i;
+
+  due = NULL;
+
+  pthread_mutex_lock(&(tw->lock));
+  ticks = now - tw->current;
+  if( (int32_t) ticks <= 0)
+    {
+      pthread_mutex_unlock(&(tw->lock));
+      return;
+    }
+  // no need to go around more than once
+  if( ticks > tw->size)
+    ticks = tw->size;
+  for( i = 1; i <= ticks; i++)
+    {
+      tptr = &(tw->slots[(now - ticks + i) & (tw->size - 1)]);
+      while( (te = *tptr) != NULL)
+        {
+          if( (int32_t) (te->deadline - now) <= 0)
+            {
+              *tptr = te->next;
+              te->next = due;
+              due = te;
+              tw->number--;
+            }
+          else
+            tptr = &(te->next);
+        }
+    }
+  tw->current = now;
+  pthread_mutex_unlock(&(tw->lock));
+
+  while( due != NULL)
+    {
+      te = due;
+      due = te->next;
+      func( te->data, te->deadline, arg);
+      free( te);
+    }
+}
+
+uint32_t timerwheel_number( struct timerwheel_struct *tw)
+{
+  uint32_t number;
+
+  pthread_mutex_lock(&(tw->lock));
+  number = tw->number;
+  pthread_mutex_unlock(&(tw->lock));
+
+  return number;
+}
+
+
 ///////////////////////////////
 
 struct llist *list_create( void)
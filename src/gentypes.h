@@ -16,15 +16,25 @@
 #include <stdint.h>
 
 // writer one, reader many; prefer writer
+// Readers count themselves in one of several slots, picked per thread,
+// so they don't all fight over the same cache line.  The mutex and
+// conditions are only used when a writer is around.
+#define WORM_SLOTS (16)
+
+struct worm_slot
+{
+  int count;
+  char pad[64 - sizeof(int)];  // one slot per cache line
+};
+
 struct worm_mutex_struct
 {
-  int read_count;
-  int write_count;
-  pthread_mutex_t m_1;
-  pthread_mutex_t m_2;
-  pthread_mutex_t m_3;
-  pthread_mutex_t m_w;
-  pthread_mutex_t m_r;
+  struct worm_slot readers[WORM_SLOTS];
+  int writer;              // set while a writer holds or wants the lock
+  pthread_mutex_t m_w;     // writers take turns on this
+  pthread_mutex_t m;       // for waiting on the conditions
+  pthread_cond_t c_r;      // readers wait for writer to finish
+  pthread_cond_t c_w;      // writer waits for readers to leave
 };
 
 
@@ -41,14 +51,14 @@ void worm_unlock_writer(struct worm_mutex_struct *worm);
 
 struct sharedint_struct
 {
-  pthread_mutex_t lock;
-  int count;
+  int count;  // atomic
 };
 
 
 void sharedint_init( struct sharedint_struct *shint, int count);
 void sharedint_uninit( struct sharedint_struct *shint);
 int sharedint_alter( struct sharedint_struct *shint, int count);
+int sharedint_drop_unless_last( struct sharedint_struct *shint);
 int sharedint_value( struct sharedint_struct *shint);
 
 ///////////////////////////////////
@@ -77,6 +87,36 @@ unsigned char *netbuffer_export( struct netbuffer_struct *nbuff, int *size);
 
 /////////////////////////////////////
 
+// Hashed timer wheel with one second ticks.  Deadlines past the end of
+// the wheel go around again, and are just skipped until they are due.
+struct timer_entry
+{
+  uint32_t deadline;
+  void *data;
+  struct timer_entry *next;
+};
+
+struct timerwheel_struct
+{
+  pthread_mutex_t lock;
+  uint32_t size;      // power of two
+  uint32_t current;   // last tick expired
+  uint32_t number;
+  struct timer_entry **slots;
+};
+
+// returns 1 on failure
+int timerwheel_init( struct timerwheel_struct *tw, int bits, uint32_t now);
+// returns 1 on failure
+int timerwheel_add( struct timerwheel_struct *tw, uint32_t deadline,
+                    void *data);
+// calls func for everything due, with the wheel unlocked
+void timerwheel_expire( struct timerwheel_struct *tw, uint32_t now,
+                        void (* func)( void *, uint32_t, void *), void *arg);
+uint32_t timerwheel_number( struct timerwheel_struct *tw);
+
+/////////////////////////////////////
+
 
 struct llink
 {
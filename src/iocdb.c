@@ -10,12 +10,22 @@
 
 
 
+// for recvmmsg
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <errno.h>
+#include <time.h>
+#include <stddef.h>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "alived.h"
 #include "llrb_db.h"
@@ -24,9 +34,10 @@
 #include "utility.h"
 
 #include "notifydb.h"
+#include "envfetch.h"
 
 #define MIN_PROTOCOL_VERSION (4)
-#define MAX_PROTOCOL_VERSION (5)
+#define MAX_PROTOCOL_VERSION (6)
 
 
 // just some config strings
@@ -53,6 +64,27 @@ struct event_adder_data
 struct timeout_data
 {
   time_t currtime;
+  uint32_t currmono;
+  uint32_t deadline;  // of the timer that went off
+};
+
+// what a client gets for an IOC in the IOC list
+struct ioc_visible
+{
+  uint8_t status;
+  uint32_t time_value;
+  uint32_t ip_address;
+  uint32_t user_msg;
+  struct iocinfo_env *env;
+};
+
+// one parsed heartbeat, as pulled from a batch of datagrams
+struct heartbeat_packet
+{
+  char ioc_name[64];
+  struct iocinfo_ping ping;
+  uint16_t ioc_flags;
+  uint32_t ioc_id;    // v6, 0 if IOC doesn't have one yet
 };
 
 
@@ -62,543 +94,2462 @@ struct timeout_data
 struct 
 {
   struct tree_db *ioc_db;
-} db = { NULL};
+  // bumped on every change clients can see in the IOC list, atomic
+  uint32_t generation;
+} db = { NULL, 0};
+
+// heartbeat receive counters, updated once per receive call
+struct 
+{
+  pthread_mutex_t lock;
+  struct iocdb_stats stats;
+} hb_stats = { PTHREAD_MUTEX_INITIALIZER };
+
+// info file lock, shared by all heartbeat receivers
+static pthread_mutex_t info_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// IOC timeout deadlines, holding copies of the IOC names
+static struct timerwheel_struct timers;
+
+// The monitor thread looks up the IOCs whose timers go off, so it's
+// stopped and joined before the database goes away.
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int stop;
+  int running;
+  pthread_t thread;
+} monitor = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+
+static void db_changed( void)
+{
+  __atomic_add_fetch( &(db.generation), 1, __ATOMIC_RELEASE);
+}
+
+// sharded by name, so adding a new IOC only holds up its own shard
+static struct tree_db *ioc_db_create( void)
+{
+  struct tree_db *ioc_db;
+
+  ioc_db = db_create_sharded( (void * (*)(void *)) strdup, free,
+                              (int (*)(const void *, const void *)) strcmp,
+                              1, db_string_hash, config.database_shards);
+  if( ioc_db != NULL)
+    {
+      // names are short enough to be kept in the nodes
+      db_inline_keys( ioc_db, db_string_size);
+      // nearly all lookups are by name, which don't need the tree
+      if( db_hash_index( ioc_db))
+        log_write("Can't create IOC database hash index.\n");
+    }
+
+  return ioc_db;
+}
 
 
 ////////////////////////////////////
 
 // state file stuff
 
+// The state of all IOCs is kept in a snapshot, plus a log of the changes
+// made since.  Changes are appended to the log in memory and written and
+// synced together every state_commit_interval msec.  The log is folded
+// into a new snapshot every state_snapshot_period seconds, when it gets
+// large, and at shutdown, so a restart never has much to replay.
+//
+// A state record is the same in the snapshot, the log, and the older
+// per-IOC state files: status, three spare bytes, name, heartbeat
+// fields, then the env if there is one.  The per-IOC files are now only
+// read when there's no snapshot, which is how their IOCs get moved over.
+//
+// State is loaded by the persistence thread before it does anything
+// else, while heartbeats and queries are already being handled.  It is
+// loaded into a database of its own, then merged into the live one,
+// where IOCs that sent heartbeats in the meantime keep what those said.
+
+#define STATE_SNAPSHOT_NAME ".snapshot"
+#define STATE_SNAPSHOT_TEMP ".snapshot.tmp"
+#define STATE_SNAPSHOT_MAGIC "ALVSNAP1"
+
+#define STATE_LOG_NAME ".log"
+#define STATE_LOG_TEMP ".log.tmp"
+#define STATE_LOG_MAGIC "ALVLOG01"
+// bytes of log that cause a snapshot
+#define STATE_LOG_COMPACT_SIZE (64*1024*1024)
+
+// The snapshot is this header, then each record preceded by its length.
+struct state_snapshot_header
+{
+  char magic[8];
+  uint32_t count;
+  uint32_t log_generation;  // last log folded into it
+  int64_t time_sec;  // realtime when snapshot was started
+  int64_t time_nsec;
+};
+
+// The log is this header, then records each with the length of the
+// rest and a checksum, so a torn write at the end is found.
+struct state_log_header
+{
+  char magic[8];
+  uint32_t generation;
+  uint32_t spare;
+};
+
+enum state_log_types { STATE_LOG_INFO = 1, STATE_LOG_STATUS,
+                       STATE_LOG_REMOVE };
+
+#define STATE_LOG_RECORD_HEAD (2*sizeof(uint32_t))
+
+// only touched by the persistence thread once started
+static struct
+{
+  struct tree_db *ioc_db;
+  int fd;
+  uint32_t generation;
+  uint64_t size;
+  struct netbuffer_struct pending;  // not yet written
+  struct timespec pending_since;    // monotonic
+  int behind;  // a commit failed, so only a new snapshot has it all
+  // for stats
+  uint64_t records;
+  uint64_t commits;
+} state_log = { NULL, -1 };
+
+// startup loading, watched by other threads
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t done_cond;
+  int flag;
+  int stop;  // shutting down, so the rest isn't read (atomic)
+  struct tree_db *ioc_db;  // live database, loaded IOCs end up here
+  uint32_t done;   // records parsed so far
+  uint32_t total;  // records to parse, once known
+} state_loading = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+struct state_reader
+{
+  const unsigned char *p;
+  const unsigned char *end;
+  int error;
+  int network;  // numbers are big endian, as in an env message
+};
+
+
+// defined further down
+static int delete_callback( void *entry, void *data);
+static void destroy_callback( void *entry, void *data);
+static void free_iocenv(struct iocinfo_env *env);
+static int env_raw_put( struct netbuffer_struct *nb, struct iocinfo_env *env);
+static int check_ping_id_match( struct iocinfo_ping *ping1, 
+                                struct iocinfo_ping *ping2);
+static void persist_snapshot( void);
+static struct iocinfo_data *get_overall_status_timeval( struct iocinfo *ioc,
+                                                        uint8_t *status,
+                                                        uint32_t *timeval);
+
 static void *load_callback( void *data)
 {
   return data;
 }
 
-static int state_files_load( void)
+static void state_put( struct netbuffer_struct *nb, void *data, int size)
 {
-  DIR *dp = NULL;
-  struct dirent *dptr = NULL;
-
-  char *ioc_name;
-  struct iocinfo *ioc;
-  struct iocinfo_data *infodata;
-
-  FILE *fptr;
-  char *filename;
+  netbuffer_add_string( nb, data, size);
+}
 
+// same as file_string_write(), so NULL writes nothing
+static void state_put_string( struct netbuffer_struct *nb, int bytes,
+                              char *string)
+{
   uint8_t o8;
+  uint16_t o16, len;
 
-  int i;
+  if( string == NULL)
+    return;
+  len = strlen( string);
 
-  if((dp = opendir(config.state_dir)) == NULL)
+  if( bytes == 1)
     {
-      log_error_write(errno, "Reading state directory");
-      return 1;
+      o8 = len;
+      state_put( nb, &o8, sizeof(o8));
     }
-  
-  while((dptr = readdir(dp)) != NULL)
+  else
     {
-      if( dptr->d_name[0] == '.')
-        continue;
-
-      filename = make_file_path( config.state_dir, dptr->d_name);
-      fptr = fopen( filename, "r");
-      free( filename);
-      if( fptr == NULL)
-        {
-          log_error_write(errno, "IOC state file read");
-          return 1;
-        }
+      o16 = len;
+      state_put( nb, &o16, sizeof(o16));
+    }
+  if( len)
+    state_put( nb, string, len);
+}
 
-      infodata = calloc( 1, sizeof( struct iocinfo_data) );
-      if( infodata == NULL)
-        {
-          fclose( fptr);
-          continue;
-        }
-      infodata->next = NULL;
+static void state_record_build( struct netbuffer_struct *nb, char *ioc_name,
+                                uint8_t status, struct iocinfo_ping *ping,
+                                struct iocinfo_env *env)
+{
+  uint8_t o8 = 0;
+  int i;
 
-      fread( &(infodata->status), sizeof(uint8_t), 1, fptr);
-      if( (infodata->status == INSTANCE_UP) ||
-          (infodata->status == INSTANCE_MAYBE_UP) )
-        infodata->status = INSTANCE_MAYBE_UP;
-      else // DOWN , UNTIMED_DOWN
-        infodata->status = INSTANCE_MAYBE_DOWN;
+  state_put( nb, &status, sizeof(uint8_t));
+  state_put( nb, &o8, sizeof(uint8_t));
+  state_put( nb, &o8, sizeof(uint8_t));
+  state_put( nb, &o8, sizeof(uint8_t));
 
-      fread( &o8, sizeof(uint8_t), 1, fptr); // throw away
-      fread( &o8, sizeof(uint8_t), 1, fptr); // throw away
-      fread( &o8, sizeof(uint8_t), 1, fptr); // throw away
+  state_put_string( nb, 1, ioc_name);
+  state_put( nb, &(ping->period), sizeof(uint16_t));
+  state_put( nb, &(ping->ip_address.s_addr), sizeof(uint32_t));
+  state_put( nb, &(ping->origin_port), sizeof(uint16_t));
+  state_put( nb, &(ping->incarnation), sizeof(uint32_t));
+  state_put( nb, &(ping->boottime), sizeof(uint32_t));
+  state_put( nb, &(ping->reply_port), sizeof(uint16_t));
 
-      ioc_name = file_string_grab( 1, fptr);
-      if( ioc_name == NULL)
-        {
-          fclose( fptr);
-          free( infodata);
-          continue;
-        }
+  if( env == NULL)
+    {
+      o8 = 0; // no env
+      state_put( nb, &o8, sizeof(uint8_t));
+      return;
+    }
 
-      // no failing out from here
+  o8 = 1; // env
+  state_put( nb, &o8, sizeof(uint8_t));
 
-      ioc = calloc( 1, sizeof( struct iocinfo));
-      ioc->ioc_name = ioc_name;
-      ioc->conflict_flag = 0;
-      if( infodata->status == INSTANCE_MAYBE_UP)
-        {
-          ioc->data_up = infodata;
-          ioc->data_down = NULL;
-        }
-      else
-        {
-          ioc->data_up = NULL;
-          ioc->data_down = infodata;
-        }
+  if( env_raw_put( nb, env))
+    return;
 
-      fread( &(infodata->ping.period), sizeof(uint16_t), 1, fptr);
-      fread( &(infodata->ping.ip_address.s_addr), sizeof(uint32_t), 1, fptr);
-      fread( &(infodata->ping.origin_port), sizeof(uint16_t), 1, fptr);
-      fread( &(infodata->ping.incarnation), sizeof(uint32_t), 1, fptr);
-      fread( &(infodata->ping.boottime), sizeof(uint32_t), 1, fptr);
-      fread( &(infodata->ping.reply_port), sizeof(uint16_t), 1, fptr);
-      
-      // fill out fields
-      infodata->ping.heartbeat = 0;
-      infodata->ping.timestamp = 0;
-      infodata->ping.user_msg = 0;
-
-      fread( &o8, sizeof(uint8_t), 1, fptr); // env flag
-      if( !o8)
-        infodata->env = NULL;
-      else
-        {
-          struct iocinfo_env *env;
+  // write environment fields
+  state_put( nb, &(env->count), sizeof(uint16_t));
+  for( i = 0; i < env->count; i++)
+    {
+      state_put_string( nb, 1, env->key[i]);
+      state_put_string( nb, 2, env->value[i]);
+    }
 
-          env = infodata->env = malloc( sizeof( struct iocinfo_env));
+  state_put( nb, &(env->extra_type), sizeof(uint16_t));
+  switch(env->extra_type)
+    {
+    case VXWORKS: // vxworks
+      {
+        struct iocinfo_extra_vxworks *vw;
 
-          // REF
-          sharedint_init( &(env->ref), 1);
+        vw = env->extra;
+        state_put_string( nb, 1, vw->bootdev);
+        state_put( nb, &(vw->unitnum), sizeof(uint32_t));
+        state_put( nb, &(vw->procnum), sizeof(uint32_t));
+        state_put_string( nb, 1, vw->boothost_name);
+        state_put_string( nb, 1, vw->bootfile);
+        state_put_string( nb, 1, vw->address);
+        state_put_string( nb, 1, vw->backplane_address);
+        state_put_string( nb, 1, vw->boothost_address);
+        state_put_string( nb, 1, vw->gateway_address);
+        state_put_string( nb, 1, vw->boothost_username);
+        state_put_string( nb, 1, vw->boothost_password);
+        state_put( nb, &(vw->flags), sizeof(uint32_t));
+        state_put_string( nb, 1, vw->target_name);
+        state_put_string( nb, 1, vw->startup_script);
+        state_put_string( nb, 1, vw->other);
+      }
+      break;
+    case LINUX:
+      {
+        struct iocinfo_extra_linux *lnx;
 
-          fread( &(env->count), sizeof(uint16_t), 1, fptr);
-          env->key = malloc( env->count * sizeof( char *) );
-          env->value = malloc( env->count * sizeof( char *) );
-          for( i = 0; i < env->count; i++)
-            {
-              env->key[i] = file_string_grab( 1, fptr);
-              env->value[i] = file_string_grab( 2, fptr);
-            }
+        lnx = env->extra;
+        state_put_string( nb, 1, lnx->user);
+        state_put_string( nb, 1, lnx->group);
+        state_put_string( nb, 1, lnx->hostname);
+      }
+      break;
+    case DARWIN:
+      {
+        struct iocinfo_extra_darwin *dar;
 
-          fread( &(env->extra_type), sizeof(uint16_t), 1, fptr);
-          env->extra = NULL;
-          switch(env->extra_type)
-            {
-            case VXWORKS: // vxworks
-              {
-                struct iocinfo_extra_vxworks *vw;
-                vw = env->extra = 
-                  malloc( sizeof( struct iocinfo_extra_vxworks));
-            
-                vw->bootdev = file_string_grab( 1, fptr);
-                fread( &(vw->unitnum), sizeof(uint32_t), 1, fptr);
-                fread( &(vw->procnum), sizeof(uint32_t), 1, fptr);
-                vw->boothost_name = file_string_grab( 1, fptr);
-                vw->bootfile = file_string_grab( 1, fptr);
-                vw->address = file_string_grab( 1, fptr);
-                vw->backplane_address = file_string_grab( 1, fptr);
-                vw->boothost_address = file_string_grab( 1, fptr);
-                vw->gateway_address = file_string_grab( 1, fptr);
-                vw->boothost_username = file_string_grab( 1, fptr);
-                vw->boothost_password = file_string_grab( 1, fptr);
-                fread( &(vw->flags), sizeof(uint32_t), 1, fptr);
-                vw->target_name = file_string_grab( 1, fptr);
-                vw->startup_script = file_string_grab( 1, fptr);
-                vw->other = file_string_grab( 1, fptr);
-              }
-              break;
-            case LINUX:
-              {
-                struct iocinfo_extra_linux *lnx;
-                lnx = env->extra = 
-                  malloc( sizeof( struct iocinfo_extra_linux));
-                
-                lnx->user = file_string_grab( 1, fptr);
-                lnx->group = file_string_grab( 1, fptr);
-                lnx->hostname = file_string_grab( 1, fptr);
-              }
-              break;
-            case DARWIN:
-              {
-                struct iocinfo_extra_darwin *dar;
-                dar = env->extra = 
-                  malloc( sizeof( struct iocinfo_extra_darwin));
-            
-                dar->user = file_string_grab( 1, fptr);
-                dar->group = file_string_grab( 1, fptr);
-                dar->hostname = file_string_grab( 1, fptr);
-              }
-              break;
-            case WINDOWS:
-              {
-                struct iocinfo_extra_windows *win;
-                win = env->extra = 
-                  malloc( sizeof( struct iocinfo_extra_windows));
-            
-                win->user = file_string_grab( 1, fptr);
-                win->machine = file_string_grab( 1, fptr);
-              }
-              break;
-            }
-        }
+        dar = env->extra;
+        state_put_string( nb, 1, dar->user);
+        state_put_string( nb, 1, dar->group);
+        state_put_string( nb, 1, dar->hostname);
+      }
+      break;
+    case WINDOWS:
+      {
+        struct iocinfo_extra_windows *win;
 
-      fclose( fptr);
+        win = env->extra;
+        state_put_string( nb, 1, win->user);
+        state_put_string( nb, 1, win->machine);
+      }
+      break;
+    }
+}
 
-      db_add( db.ioc_db, ioc_name, load_callback, NULL, ioc);
 
-      // add this to a daemon event file that the IOCs could cross-reference
-      // daemon_event_write( dptr->d_name, (uint32_t) time(NULL), 0, 0, START);
+// a short read zeroes the destination and marks the error
+static void state_get( struct state_reader *sr, void *dest, size_t size)
+{
+  if( sr->error || ((size_t) (sr->end - sr->p) < size) )
+    {
+      sr->error = 1;
+      memset( dest, 0, size);
+      return;
     }
+  memcpy( dest, sr->p, size);
+  sr->p += size;
+}
 
+static uint16_t state_get_uint16( struct state_reader *sr)
+{
+  uint16_t o16;
 
-  closedir( dp);
-
-  return 0;
+  state_get( sr, &o16, sizeof( uint16_t));
+  return sr->network ? ntohs( o16) : o16;
 }
 
+static uint32_t state_get_uint32( struct state_reader *sr)
+{
+  uint32_t o32;
 
-static int state_write( char *ioc_name, uint8_t status)
+  state_get( sr, &o32, sizeof( uint32_t));
+  return sr->network ? ntohl( o32) : o32;
+}
+
+// returns where the string's bytes are in the source, or NULL
+static const unsigned char *state_get_bytes( struct state_reader *sr,
+                                             int bytes, int *len)
 {
-  FILE *fptr;
-  char *filename;
+  const unsigned char *str;
+  uint8_t o8;
 
-  filename = make_file_path( config.state_dir, ioc_name);
-  fptr = fopen( filename, "r+");
-  free( filename);
-  if( fptr == NULL)
+  if( bytes == 1)
     {
-      log_error_write(errno, "IOC state write");
-      return -1;
+      state_get( sr, &o8, sizeof( uint8_t));
+      *len = o8;
     }
+  else
+    *len = state_get_uint16( sr);
+  if( sr->error || ((sr->end - sr->p) < *len) )
+    {
+      sr->error = 1;
+      return NULL;
+    }
+  str = sr->p;
+  sr->p += *len;
 
-  fwrite( &status, sizeof(uint8_t), 1, fptr);
-
-  fclose( fptr);
-
-  return 0;
+  return str;
 }
 
-static int state_file_remove( char *ioc_name)
+static char *state_get_string( struct state_reader *sr, int bytes)
 {
-  char *filename;
-  int ret;
-
-  filename = make_file_path( config.state_dir, ioc_name);
-  ret = unlink( filename);
-  free(filename);
+  const unsigned char *bstr;
+  char *str;
+  int len;
 
-  if( ret)
+  if( (bstr = state_get_bytes( sr, bytes, &len)) == NULL)
+    return NULL;
+  if( (str = malloc( sizeof( char) * (len + 1) )) == NULL)
     {
-      log_error_write(errno, "IOC state remove");
-      return -1;
+      sr->error = 1;
+      return NULL;
     }
+  memcpy( str, bstr, len);
+  str[len] = '\0';
 
-  return 0;
+  return str;
 }
 
 
-static int state_info_write( char *ioc_name, uint8_t status, 
-                      struct iocinfo_ping *ping, struct iocinfo_env *env)
+////////////////////////////////////
+
+// Envs are shared.  Many IOCs report the same env, and a rebooted IOC
+// nearly always sends the env it had.  Before an env is made, one
+// holding the same things is looked for by a hash of them, and if found
+// it just gets another reference.
+//
+// The hash is of what the env holds, not of the bytes it came in, so a
+// state record and an env message that say the same thing match.  An
+// env is one block: the struct, the key and value arrays, the extra for
+// the IOC type, then the strings.  The table is split into shards with
+// their own locks, as state records are parsed by several threads at
+// once.
+//
+// The env as clients are sent it is made apart from the block, the
+// first time it's sent, so envs that never are don't pay for it.  All
+// of these together are kept to env_wire_cache kilobytes, and past that
+// the fields are sent one by one.
+//
+// Like the database hash index, the table uses linear probing and
+// deletes by shifting entries back.  The hashes are kept apart from the
+// entries, so probing and growing don't touch the entries, and it gets
+// up to 3/4 full.
+
+#define ENV_SHARE_SHARDS (64)
+#define ENV_SHARE_MIN_BITS (4)
+
+struct env_share_shard
 {
-  FILE *fptr;
-  char *filename;
+  pthread_mutex_t lock;
+  uint32_t *hashes;
+  void **entries;
+  uint32_t size;
+  uint32_t shift;
+  uint32_t number;
+};
 
-  uint8_t o8 = 0;
+static struct
+{
+  struct env_share_shard envs[ENV_SHARE_SHARDS];
+  uint64_t wire_bytes;  // atomic
+} env_share;
 
-  int i;
+// the extras as lists of their fields, in the order they are sent
+enum env_field_types { ENV_FIELD_END, ENV_FIELD_STRING, ENV_FIELD_UINT32 };
 
+struct env_field
+{
+  int type;
+  size_t offset;
+  int hidden;  // kept in state, but not sent to clients
+};
 
-  filename = make_file_path( config.state_dir, ioc_name);
-  fptr = fopen( filename, "w");
-  free( filename);
-  if( fptr == NULL)
+#define ENV_STRING( type, field) \
+  { ENV_FIELD_STRING, offsetof( type, field), 0 }
+#define ENV_HIDDEN( type, field) \
+  { ENV_FIELD_STRING, offsetof( type, field), 1 }
+#define ENV_UINT32( type, field) \
+  { ENV_FIELD_UINT32, offsetof( type, field), 0 }
+
+static const struct env_field env_fields_vxworks[] = {
+  ENV_STRING( struct iocinfo_extra_vxworks, bootdev),
+  ENV_UINT32( struct iocinfo_extra_vxworks, unitnum),
+  ENV_UINT32( struct iocinfo_extra_vxworks, procnum),
+  ENV_STRING( struct iocinfo_extra_vxworks, boothost_name),
+  ENV_STRING( struct iocinfo_extra_vxworks, bootfile),
+  ENV_STRING( struct iocinfo_extra_vxworks, address),
+  ENV_STRING( struct iocinfo_extra_vxworks, backplane_address),
+  ENV_STRING( struct iocinfo_extra_vxworks, boothost_address),
+  ENV_STRING( struct iocinfo_extra_vxworks, gateway_address),
+  ENV_HIDDEN( struct iocinfo_extra_vxworks, boothost_username),
+  ENV_HIDDEN( struct iocinfo_extra_vxworks, boothost_password),
+  ENV_UINT32( struct iocinfo_extra_vxworks, flags),
+  ENV_STRING( struct iocinfo_extra_vxworks, target_name),
+  ENV_STRING( struct iocinfo_extra_vxworks, startup_script),
+  ENV_STRING( struct iocinfo_extra_vxworks, other),
+  { ENV_FIELD_END, 0, 0 } };
+
+static const struct env_field env_fields_linux[] = {
+  ENV_STRING( struct iocinfo_extra_linux, user),
+  ENV_STRING( struct iocinfo_extra_linux, group),
+  ENV_STRING( struct iocinfo_extra_linux, hostname),
+  { ENV_FIELD_END, 0, 0 } };
+
+static const struct env_field env_fields_darwin[] = {
+  ENV_STRING( struct iocinfo_extra_darwin, user),
+  ENV_STRING( struct iocinfo_extra_darwin, group),
+  ENV_STRING( struct iocinfo_extra_darwin, hostname),
+  { ENV_FIELD_END, 0, 0 } };
+
+static const struct env_field env_fields_windows[] = {
+  ENV_STRING( struct iocinfo_extra_windows, user),
+  ENV_STRING( struct iocinfo_extra_windows, machine),
+  { ENV_FIELD_END, 0, 0 } };
+
+static const struct env_field env_fields_none[] = {
+  { ENV_FIELD_END, 0, 0 } };
+
+
+static const struct env_field *env_extra_fields( int extra_type)
+{
+  switch( extra_type)
     {
-      log_error_write(errno, "IOC state and info write");
-      return -1;
+    case VXWORKS:
+      return env_fields_vxworks;
+    case LINUX:
+      return env_fields_linux;
+    case DARWIN:
+      return env_fields_darwin;
+    case WINDOWS:
+      return env_fields_windows;
     }
+  return env_fields_none;
+}
 
-  fwrite( &status, sizeof(uint8_t), 1, fptr);
-  fwrite( &o8, sizeof(uint8_t), 1, fptr);
-  fwrite( &o8, sizeof(uint8_t), 1, fptr);
-  fwrite( &o8, sizeof(uint8_t), 1, fptr);
+static size_t env_extra_size( int extra_type)
+{
+  switch( extra_type)
+    {
+    case VXWORKS:
+      return sizeof( struct iocinfo_extra_vxworks);
+    case LINUX:
+      return sizeof( struct iocinfo_extra_linux);
+    case DARWIN:
+      return sizeof( struct iocinfo_extra_darwin);
+    case WINDOWS:
+      return sizeof( struct iocinfo_extra_windows);
+    }
+  return 0;
+}
 
-  file_string_write( 1, fptr, ioc_name);
-  fwrite( &(ping->period), sizeof(uint16_t), 1, fptr);
-  fwrite( &(ping->ip_address.s_addr), sizeof(uint32_t), 1, fptr);
-  fwrite( &(ping->origin_port), sizeof(uint16_t), 1, fptr);
-  fwrite( &(ping->incarnation), sizeof(uint32_t), 1, fptr);
-  fwrite( &(ping->boottime), sizeof(uint32_t), 1, fptr);
-  fwrite( &(ping->reply_port), sizeof(uint16_t), 1, fptr);
+// a word at a time, as every env loaded from state gets hashed
+static uint32_t env_hash_add( uint32_t hash, const void *data, size_t len)
+{
+  const unsigned char *p;
+  uint64_t h, word;
 
-  if( env == NULL)
+  h = hash;
+  for( p = data; len >= sizeof( uint64_t); 
+       len -= sizeof( uint64_t), p += sizeof( uint64_t))
     {
-      o8 = 0; // no env
-      fwrite( &o8, sizeof(uint8_t), 1, fptr);
+      memcpy( &word, p, sizeof( uint64_t));
+      h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+      h ^= h >> 29;
     }
-  else
-    {
-      o8 = 1; // env
-      fwrite( &o8, sizeof(uint8_t), 1, fptr);
+  for( ; len > 0; len--, p++)
+    h = (h ^ *p) * 0x100000001b3ULL;
 
-      // write environment fields
-      fwrite( &(env->count), sizeof(uint16_t), 1, fptr);
-      for( i = 0; i < env->count; i++)
-        {
-          file_string_write( 1, fptr, env->key[i]);
-          file_string_write( 2, fptr, env->value[i]);
-        }
+  return h ^ (h >> 32);
+}
 
-      fwrite( &(env->extra_type), sizeof(uint16_t), 1, fptr);
-      switch(env->extra_type)
-        {
-        case VXWORKS: // vxworks
-          {
-            struct iocinfo_extra_vxworks *vw;
-
-            vw = env->extra;
-            file_string_write( 1, fptr, vw->bootdev);
-            fwrite( &(vw->unitnum), sizeof(uint32_t), 1, fptr);
-            fwrite( &(vw->procnum), sizeof(uint32_t), 1, fptr);
-            file_string_write( 1, fptr, vw->boothost_name);
-            file_string_write( 1, fptr, vw->bootfile);
-            file_string_write( 1, fptr, vw->address);
-            file_string_write( 1, fptr, vw->backplane_address);
-            file_string_write( 1, fptr, vw->boothost_address);
-            file_string_write( 1, fptr, vw->gateway_address);
-            file_string_write( 1, fptr, vw->boothost_username);
-            file_string_write( 1, fptr, vw->boothost_password);
-            fwrite( &(vw->flags), sizeof(uint32_t), 1, fptr);
-            file_string_write( 1, fptr, vw->target_name);
-            file_string_write( 1, fptr, vw->startup_script);
-            file_string_write( 1, fptr, vw->other);
-          }
-          break;
-        case LINUX:
-          {
-            struct iocinfo_extra_linux *lnx;
+static uint32_t env_hash_string( uint32_t hash, const unsigned char *str,
+                                 int len)
+{
+  uint16_t o16;
 
-            lnx = env->extra;
-            file_string_write( 1, fptr, lnx->user);
-            file_string_write( 1, fptr, lnx->group);
-            file_string_write( 1, fptr, lnx->hostname);
-          }
-          break;
-        case DARWIN:
-          {
-            struct iocinfo_extra_darwin *dar;
+  if( str == NULL)  // short, which the caller finds
+    return hash;
+  o16 = len;
+  hash = env_hash_add( hash, &o16, sizeof( uint16_t));
+  return env_hash_add( hash, str, len);
+}
 
-            dar = env->extra;
-            file_string_write( 1, fptr, dar->user);
-            file_string_write( 1, fptr, dar->group);
-            file_string_write( 1, fptr, dar->hostname);
-          }
-          break;
-        case WINDOWS:
-          {
-            struct iocinfo_extra_windows *win;
 
-            win = env->extra;
-            file_string_write( 1, fptr, win->user);
-            file_string_write( 1, fptr, win->machine);
-          }
-          break;
-        }
+// returns 1 on failure, leaving the shard as it was
+static int env_share_alloc( struct env_share_shard *shard, int bits)
+{
+  uint32_t *hashes;
+  void **entries;
+
+  hashes = malloc( (1U << bits) * sizeof( uint32_t));
+  entries = calloc( 1U << bits, sizeof( void *));
+  if( (hashes == NULL) || (entries == NULL) )
+    {
+      free( hashes);
+      free( entries);
+      return 1;
     }
-  fclose( fptr);
+  shard->hashes = hashes;
+  shard->entries = entries;
+  shard->size = 1U << bits;
+  shard->shift = 32 - bits;
 
   return 0;
 }
 
+static int env_share_init( void)
+{
+  struct env_share_shard *shard;
+  int i;
 
-///////////////////////////////////
+  for( i = 0; i < ENV_SHARE_SHARDS; i++)
+    {
+      shard = &(env_share.envs[i]);
+      pthread_mutex_init( &(shard->lock), NULL);
+      shard->number = 0;
+      if( env_share_alloc( shard, ENV_SHARE_MIN_BITS) )
+        return 1;
+    }
 
-static int event_process( char *ioc_name, uint32_t timestamp, uint8_t event,
-                          struct iocinfo_ping iocping, struct iocinfo_env *env)
-{
-  event_write( ioc_name, timestamp, iocping.ip_address.s_addr,
-               iocping.user_msg, event);
+  return 0;
+}
+
+// multiplying spreads out the bits, as the shard was picked from them
+static uint32_t env_share_home( struct env_share_shard *shard, uint32_t hash)
+{
+  return (hash * 2654435769U) >> shard->shift;
+}
+
+static void env_share_place( struct env_share_shard *shard, uint32_t hash,
+                             void *entry)
+{
+  uint32_t pos, mask;
+
+  mask = shard->size - 1;
+  pos = env_share_home( shard, hash);
+  while( shard->entries[pos] != NULL)
+    pos = (pos + 1) & mask;
+  shard->hashes[pos] = hash;
+  shard->entries[pos] = entry;
+}
+
+// shard is locked; returns 1 if it's full and can't grow
+static int env_share_insert( struct env_share_shard *shard, uint32_t hash,
+                             void *entry)
+{
+  uint32_t *old_hashes;
+  void **old_entries;
+  uint32_t old_size, i;
+
+  if( 4 * (shard->number + 1) > 3 * shard->size)
+    {
+      old_hashes = shard->hashes;
+      old_entries = shard->entries;
+      old_size = shard->size;
+      if( !env_share_alloc( shard, 33 - shard->shift) )
+        {
+          for( i = 0; i < old_size; i++)
+            if( old_entries[i] != NULL)
+              env_share_place( shard, old_hashes[i], old_entries[i]);
+          free( old_hashes);
+          free( old_entries);
+        }
+      else if( shard->number + 1 == shard->size)  // keep one empty
+        return 1;
+    }
+
+  env_share_place( shard, hash, entry);
+  shard->number++;
+
+  return 0;
+}
+
+// shard is locked
+static void env_share_remove( struct env_share_shard *shard, uint32_t hash,
+                              void *entry)
+{
+  uint32_t i, j, k, mask;
+
+  mask = shard->size - 1;
+  i = env_share_home( shard, hash);
+  while( shard->entries[i] != entry)
+    {
+      if( shard->entries[i] == NULL)  // never got in
+        return;
+      i = (i + 1) & mask;
+    }
+
+  j = i;
+  while( 1)
+    {
+      j = (j + 1) & mask;
+      if( shard->entries[j] == NULL)
+        break;
+      // move back entries that would no longer be found past the hole
+      k = env_share_home( shard, shard->hashes[j]);
+      if( (i <= j) ? ((k <= i) || (k > j)) : ((k <= i) && (k > j)) )
+        {
+          shard->hashes[i] = shard->hashes[j];
+          shard->entries[i] = shard->entries[j];
+          i = j;
+        }
+    }
+  shard->entries[i] = NULL;
+  shard->number--;
+}
+
+static uint32_t env_share_number( struct env_share_shard *shards)
+{
+  uint32_t number;
+  int i;
+
+  number = 0;
+  for( i = 0; i < ENV_SHARE_SHARDS; i++)
+    {
+      pthread_mutex_lock( &(shards[i].lock));
+      number += shards[i].number;
+      pthread_mutex_unlock( &(shards[i].lock));
+    }
+  return number;
+}
+
+
+// copies a string from the source into the env's block
+static char *state_get_block_string( struct state_reader *sr, int bytes,
+                                     char **next)
+{
+  const unsigned char *bstr;
+  char *str;
+  int len;
+
+  if( (bstr = state_get_bytes( sr, bytes, &len)) == NULL)
+    return NULL;
+  str = *next;
+  memcpy( str, bstr, len);
+  str[len] = '\0';
+  *next += len + 1;
+
+  return str;
+}
+
+// a string in the source is the same as one in a shared env
+static int state_string_match( struct state_reader *sr, int bytes,
+                               const char *text)
+{
+  const unsigned char *bstr;
+  int len;
+
+  if( (bstr = state_get_bytes( sr, bytes, &len)) == NULL)
+    return 0;
+  return (strnlen( text, len + 1) == len) && !memcmp( bstr, text, len);
+}
+
+
+// The first pass over an env, from the count on, which finds its hash,
+// count, IOC type, and room for its strings without making anything.
+static uint32_t state_env_hash( struct state_reader *sr, int *extra_type,
+                                int *count, size_t *strings)
+{
+  const struct env_field *field;
+  const unsigned char *str;
+  uint32_t hash;
+  uint32_t o32;
+  uint16_t o16;
+  int len;
+  int i;
+
+  hash = 2166136261U;
+
+  *count = o16 = state_get_uint16( sr);
+  hash = env_hash_add( hash, &o16, sizeof( uint16_t));
+  *strings = 0;
+  for( i = 0; (i < *count) && !sr->error; i++)
+    {
+      str = state_get_bytes( sr, 1, &len);
+      hash = env_hash_string( hash, str, len);
+      *strings += len + 1;
+      str = state_get_bytes( sr, 2, &len);
+      hash = env_hash_string( hash, str, len);
+      *strings += len + 1;
+    }
+  if( *extra_type == -1)
+    *extra_type = state_get_uint16( sr);
+  o16 = *extra_type;
+  hash = env_hash_add( hash, &o16, sizeof( uint16_t));
+
+  for( field = env_extra_fields( *extra_type); 
+       (field->type != ENV_FIELD_END) && !sr->error; field++)
+    if( field->type == ENV_FIELD_STRING)
+      {
+        str = state_get_bytes( sr, 1, &len);
+        hash = env_hash_string( hash, str, len);
+        *strings += len + 1;
+      }
+    else
+      {
+        o32 = state_get_uint32( sr);
+        hash = env_hash_add( hash, &o32, sizeof( uint32_t));
+      }
+
+  return hash;
+}
+
+// the env in the source is the same as this shared one
+static int state_env_match( struct state_reader *sr, int extra_stream,
+                            int extra_type, struct iocinfo_env *env)
+{
+  const struct env_field *field;
+  char *extra;
+  int i;
+
+  if( (env->extra_type != extra_type) || 
+      (state_get_uint16( sr) != env->count) )
+    return 0;
+  for( i = 0; i < env->count; i++)
+    if( !state_string_match( sr, 1, env->key[i]) || 
+        !state_string_match( sr, 2, env->value[i]) )
+      return 0;
+  if( extra_stream)
+    state_get_uint16( sr);  // already checked
+
+  extra = env->extra;
+  for( field = env_extra_fields( env->extra_type); 
+       field->type != ENV_FIELD_END; field++)
+    if( field->type == ENV_FIELD_STRING)
+      {
+        if( !state_string_match( sr, 1,
+                                 *((char **) (extra + field->offset))) )
+          return 0;
+      }
+    else if( state_get_uint32( sr) != *((uint32_t *) (extra + field->offset)))
+      return 0;
+
+  return !sr->error;
+}
+
+// returns a new env read from the source, or NULL
+static struct iocinfo_env *state_env_make( struct state_reader *sr,
+                                           int extra_stream, int count,
+                                           int extra_type, size_t strings)
+{
+  const struct env_field *field;
+  struct iocinfo_env *env;
+  size_t head, extra_size;
+  char *extra;
+  char *next;
+  int i;
+
+  extra_size = env_extra_size( extra_type);
+  head = sizeof( struct iocinfo_env) + 2 * count * sizeof( char *) + 
+    extra_size;
+  if( (env = malloc( head + strings)) == NULL)
+    return NULL;
+  memset( env, 0, head);
+
+  // REF
+  sharedint_init( &(env->ref), 1);
+
+  env->count = count;
+  env->key = (char **) (env + 1);
+  env->value = env->key + count;
+  env->extra_type = extra_type;
+  env->extra = extra_size ? (env->value + count) : NULL;
+  env->shared = 1;
+  next = ((char *) env) + head;
+
+  state_get_uint16( sr);
+  for( i = 0; i < count; i++)
+    {
+      env->key[i] = state_get_block_string( sr, 1, &next);
+      env->value[i] = state_get_block_string( sr, 2, &next);
+    }
+  if( extra_stream)
+    state_get_uint16( sr);
+
+  extra = env->extra;
+  for( field = env_extra_fields( extra_type); 
+       field->type != ENV_FIELD_END; field++)
+    if( field->type == ENV_FIELD_STRING)
+      *((char **) (extra + field->offset)) = 
+        state_get_block_string( sr, 1, &next);
+    else
+      *((uint32_t *) (extra + field->offset)) = state_get_uint32( sr);
+
+  if( sr->error)
+    {
+      sharedint_uninit( &(env->ref));
+      free( env);
+      return NULL;
+    }
+  return env;
+}
+
+// The wire form is what iocdb_make_netbuffer_env() sends, after the
+// env flag: big endian, laid out like a state record's env.
+static unsigned char *env_wire_string( unsigned char *w, int bytes,
+                                       const char *text)
+{
+  uint16_t len;
+  uint16_t o16;
+
+  if( text == NULL)  // bad env, which won't be used
+    return w;
+  len = strlen( text);
+  if( bytes == 1)
+    *(w++) = len;
+  else
+    {
+      o16 = htons( len);
+      memcpy( w, &o16, sizeof( uint16_t));
+      w += sizeof( uint16_t);
+    }
+  memcpy( w, text, len);
+
+  return w + len;
+}
+
+static unsigned char *env_wire_uint( unsigned char *w, uint32_t value,
+                                     size_t size)
+{
+  uint32_t o32;
+  uint16_t o16;
+
+  if( size == sizeof( uint16_t))
+    {
+      o16 = htons( value);
+      memcpy( w, &o16, size);
+    }
+  else
+    {
+      o32 = htonl( value);
+      memcpy( w, &o32, size);
+    }
+
+  return w + size;
+}
+
+static size_t env_wire_length( const struct iocinfo_env *env)
+{
+  const struct env_field *field;
+  const char *extra;
+  size_t length;
+  int i;
+
+  length = 2 * sizeof( uint16_t);  // count and type
+  for( i = 0; i < env->count; i++)
+    length += 1 + strlen( env->key[i]) + 2 + strlen( env->value[i]);
+
+  extra = env->extra;
+  for( field = env_extra_fields( env->extra_type); 
+       field->type != ENV_FIELD_END; field++)
+    if( field->type == ENV_FIELD_UINT32)
+      length += sizeof( uint32_t);
+    else if( !field->hidden)
+      length += 1 + strlen( *((char **) (extra + field->offset)));
+
+  return length;
+}
+
+static void env_wire_fill( unsigned char *w, const struct iocinfo_env *env)
+{
+  const struct env_field *field;
+  const char *extra;
+  int i;
+
+  w = env_wire_uint( w, env->count, sizeof( uint16_t));
+  for( i = 0; i < env->count; i++)
+    {
+      w = env_wire_string( w, 1, env->key[i]);
+      w = env_wire_string( w, 2, env->value[i]);
+    }
+  w = env_wire_uint( w, env->extra_type, sizeof( uint16_t));
+
+  extra = env->extra;
+  for( field = env_extra_fields( env->extra_type); 
+       field->type != ENV_FIELD_END; field++)
+    if( field->type == ENV_FIELD_UINT32)
+      w = env_wire_uint( w, *((uint32_t *) (extra + field->offset)),
+                         sizeof( uint32_t));
+    else if( !field->hidden)
+      w = env_wire_string( w, 1, *((char **) (extra + field->offset)));
+}
+
+// only once nothing else can have the env
+static void env_wire_free( struct iocinfo_env *env)
+{
+  if( env->wire == NULL)
+    return;
+  __atomic_sub_fetch( &(env_share.wire_bytes), 
+                      sizeof( struct iocinfo_env_wire) + env->wire->length,
+                      __ATOMIC_RELAXED);
+  free( env->wire);
+}
+
+// Reads an env, from the count on, returning it with a reference for
+// the caller, or NULL if it's bad.  In a state record the IOC type
+// follows the variables, and extra_type is -1; an env message has it
+// in the header.
+static struct iocinfo_env *state_env_parse( struct state_reader *sr,
+                                            int extra_type)
+{
+  struct env_share_shard *shard;
+  struct state_reader skip, match;
+  struct iocinfo_env *env;
+  size_t strings;
+  int extra_stream;
+  int count;
+  uint32_t hash;
+  uint32_t pos, mask;
+
+  extra_stream = (extra_type == -1);
+
+  skip = *sr;
+  hash = state_env_hash( &skip, &extra_type, &count, &strings);
+  if( skip.error)
+    {
+      sr->error = 1;
+      return NULL;
+    }
+
+  shard = &(env_share.envs[ hash % ENV_SHARE_SHARDS]);
+  pthread_mutex_lock( &(shard->lock));
+  mask = shard->size - 1;
+  pos = env_share_home( shard, hash);
+  while( (env = shard->entries[pos]) != NULL)
+    {
+      match = *sr;
+      if( (shard->hashes[pos] == hash) && 
+          state_env_match( &match, extra_stream, extra_type, env) )
+        {
+          sharedint_alter( &(env->ref), 1);
+          pthread_mutex_unlock( &(shard->lock));
+          *sr = skip;
+          return env;
+        }
+      pos = (pos + 1) & mask;
+    }
+
+  // made while locked, so the same env can't get made twice
+  env = state_env_make( sr, extra_stream, count, extra_type, strings);
+  if( env == NULL)
+    sr->error = 1;
+  else
+    {
+      // if the table is full, it just doesn't get shared
+      env->share_hash = hash;
+      env_share_insert( shard, hash, env);
+    }
+  pthread_mutex_unlock( &(shard->lock));
+
+  return env;
+}
+
+// drops a reference to a shared env, taking it out of the table with
+// the last one, so a lookup can't find it on its way out; only what
+// might be the last one needs the shard locked
+static void env_share_put( struct iocinfo_env *env)
+{
+  struct env_share_shard *shard;
+
+  if( sharedint_drop_unless_last( &(env->ref)) )
+    return;
+
+  shard = &(env_share.envs[ env->share_hash % ENV_SHARE_SHARDS]);
+  pthread_mutex_lock( &(shard->lock));
+  if( sharedint_alter( &(env->ref), -1) > 0)
+    {
+      pthread_mutex_unlock( &(shard->lock));
+      return;
+    }
+  env_share_remove( shard, env->share_hash, env);
+  pthread_mutex_unlock( &(shard->lock));
+
+  env_wire_free( env);
+  sharedint_uninit( &(env->ref) );
+  free( env);
+}
+
+
+// returns new IOC entry, or NULL if record is bad
+static struct iocinfo *state_record_parse( const unsigned char *data,
+                                           size_t length)
+{
+  struct state_reader sr = { data, data + length, 0 };
+  struct iocinfo *ioc;
+  struct iocinfo_data *infodata;
+  uint8_t o8;
+
+  ioc = calloc( 1, sizeof( struct iocinfo));
+  infodata = calloc( 1, sizeof( struct iocinfo_data) );
+  if( (ioc == NULL) || (infodata == NULL) )
+    {
+      free( ioc);
+      free( infodata);
+      return NULL;
+    }
+  infodata->next = NULL;
+
+  state_get( &sr, &o8, sizeof(uint8_t));
+  if( (o8 == INSTANCE_UP) || (o8 == INSTANCE_MAYBE_UP) )
+    {
+      infodata->status = INSTANCE_MAYBE_UP;
+      ioc->data_up = infodata;
+    }
+  else // DOWN , UNTIMED_DOWN
+    {
+      infodata->status = INSTANCE_MAYBE_DOWN;
+      ioc->data_down = infodata;
+    }
+  state_get( &sr, &o8, sizeof(uint8_t)); // throw away
+  state_get( &sr, &o8, sizeof(uint8_t)); // throw away
+  state_get( &sr, &o8, sizeof(uint8_t)); // throw away
+
+  ioc->ioc_name = state_get_string( &sr, 1);
+  ioc->conflict_flag = 0;
+  ioc->timer_deadline = 0;
+
+  state_get( &sr, &(infodata->ping.period), sizeof(uint16_t));
+  state_get( &sr, &(infodata->ping.ip_address.s_addr), sizeof(uint32_t));
+  state_get( &sr, &(infodata->ping.origin_port), sizeof(uint16_t));
+  state_get( &sr, &(infodata->ping.incarnation), sizeof(uint32_t));
+  state_get( &sr, &(infodata->ping.boottime), sizeof(uint32_t));
+  state_get( &sr, &(infodata->ping.reply_port), sizeof(uint16_t));
+
+  // fill out fields
+  infodata->ping.heartbeat = 0;
+  infodata->ping.timestamp = 0;
+  infodata->ping.arrival = 0;
+  infodata->ping.user_msg = 0;
+
+  state_get( &sr, &o8, sizeof(uint8_t)); // env flag
+  if( o8 && !sr.error && config.state_lazy_env)
+    {
+      struct iocinfo_env *env;
+
+      env = infodata->env = calloc( 1, sizeof( struct iocinfo_env));
+      if( env == NULL)
+        goto Bad;
+
+      // REF
+      sharedint_init( &(env->ref), 1);
+
+      // kept as is, until something looks at it
+      env->raw_length = sr.end - sr.p;
+      if( (env->raw = malloc( env->raw_length + 1)) == NULL)
+        goto Bad;
+      memcpy( env->raw, sr.p, env->raw_length);
+    }
+  else if( o8 && !sr.error)
+    infodata->env = state_env_parse( &sr, -1);
+
+  if( !sr.error && (ioc->ioc_name != NULL) )
+    return ioc;
+
+ Bad:
+  delete_callback( ioc, NULL);
+  return NULL;
+}
+
+
+// returns new IOC entry from the IOC's state file, or NULL
+static struct iocinfo *state_file_read( int dir_fd, char *file_name)
+{
+  struct iocinfo *ioc;
+  struct stat st;
+  unsigned char *buffer;
+  ssize_t len;
+  int fd;
+
+  fd = openat( dir_fd, file_name, O_RDONLY | O_CLOEXEC);
+  if( fd == -1)
+    {
+      log_error_write(errno, "IOC state file read");
+      return NULL;
+    }
+  if( fstat( fd, &st) || ((buffer = malloc( st.st_size + 1)) == NULL) )
+    {
+      close( fd);
+      return NULL;
+    }
+  len = read( fd, buffer, st.st_size);
+  close( fd);
+
+  ioc = (len > 0) ? state_record_parse( buffer, len) : NULL;
+  free( buffer);
+  if( ioc == NULL)
+    log_write("IOC state file \"%s\" is bad, not loaded.\n", file_name);
+
+  return ioc;
+}
+
+// Records are parsed by a few threads at once, each taking a run of the
+// list, and then all put in the database together, which is much faster
+// than adding them one at a time.
+
+#define STATE_LOAD_THREADS (8)
+// not worth another thread for fewer than this
+#define STATE_LOAD_RUN (1024)
+
+// either a record in a map, or a state file name
+struct state_load_item
+{
+  const unsigned char *data;
+  uint32_t length;
+  char *file_name;
+  struct iocinfo *ioc;
+};
+
+struct state_load_run
+{
+  pthread_t thread;
+  struct state_load_item *items;
+  int number;
+  int dir_fd;
+};
+
+static void *state_load_worker( void *data)
+{
+  struct state_load_run *run;
+  struct state_load_item *item;
+  int i;
+
+  run = data;
+  for( i = 0; i < run->number; i++)
+    {
+      item = &(run->items[i]);
+      // nothing read is kept once stopping
+      if( __atomic_load_n( &(state_loading.stop), __ATOMIC_RELAXED) )
+        item->ioc = NULL;
+      else if( item->file_name != NULL)
+        item->ioc = state_file_read( run->dir_fd, item->file_name);
+      else
+        item->ioc = state_record_parse( item->data, item->length);
+      __atomic_add_fetch( &(state_loading.done), 1, __ATOMIC_RELAXED);
+    }
+
+  return NULL;
+}
+
+static void state_load_discard( void *entry)
+{
+  delete_callback( entry, NULL);
+}
+
+// returns number of IOCs loaded
+static int state_load_items( struct state_load_item *items, int number,
+                             int dir_fd)
+{
+  struct state_load_run runs[STATE_LOAD_THREADS];
+  void **keys, **values;
+  long cpus;
+  int threads, count;
+  int start, i;
+
+  cpus = sysconf( _SC_NPROCESSORS_ONLN);
+  threads = number / STATE_LOAD_RUN + 1;
+  if( threads > cpus)
+    threads = cpus;
+  if( threads > STATE_LOAD_THREADS)
+    threads = STATE_LOAD_THREADS;
+  if( threads < 1)
+    threads = 1;
+
+  start = 0;
+  for( i = 0; i < threads; i++)
+    {
+      runs[i].items = items + start;
+      runs[i].number = (number - start) / (threads - i);
+      runs[i].dir_fd = dir_fd;
+      start += runs[i].number;
+    }
+  // this thread takes the first run, and any that can't be started
+  for( i = 1; i < threads; i++)
+    if( pthread_create( &(runs[i].thread), NULL, state_load_worker,
+                        &(runs[i])) )
+      {
+        runs[i].thread = 0;
+        state_load_worker( &(runs[i]));
+      }
+  state_load_worker( &(runs[0]));
+  for( i = 1; i < threads; i++)
+    if( runs[i].thread)
+      pthread_join( runs[i].thread, NULL);
+
+  keys = malloc( number * sizeof( void *));
+  values = malloc( number * sizeof( void *));
+  if( (keys == NULL) || (values == NULL) )
+    {
+      free( keys);
+      free( values);
+      for( i = 0; i < number; i++)
+        if( items[i].ioc != NULL)
+          delete_callback( items[i].ioc, NULL);
+      return 0;
+    }
+  count = 0;
+  for( i = 0; i < number; i++)
+    if( items[i].ioc != NULL)
+      {
+        keys[count] = items[i].ioc->ioc_name;
+        values[count] = items[i].ioc;
+        count++;
+      }
+  count = db_bulk_load( state_log.ioc_db, count, keys, values, NULL,
+                        state_load_discard);
+  free( keys);
+  free( values);
+
+  return count;
+}
+
+// loads the older per-IOC state files, returning the number read
+static int state_files_read( void)
+{
+  DIR *dp = NULL;
+  struct dirent *dptr = NULL;
+  struct state_load_item *items, *new_items;
+  int size, names, number;
+  int i;
+
+  if((dp = opendir(config.state_dir)) == NULL)
+    {
+      log_error_write(errno, "Reading state directory");
+      return 0;
+    }
+
+  items = NULL;
+  size = number = 0;
+  while((dptr = readdir(dp)) != NULL)
+    {
+      if( dptr->d_name[0] == '.')
+        continue;
+
+      if( number == size)
+        {
+          size = size ? 2 * size : 1024;
+          new_items = realloc( items, size * sizeof( struct state_load_item));
+          if( new_items == NULL)
+            break;
+          items = new_items;
+        }
+      items[number].file_name = strdup( dptr->d_name);
+      if( items[number].file_name != NULL)
+        number++;
+    }
+
+  names = number;
+  __atomic_add_fetch( &(state_loading.total), names, __ATOMIC_RELAXED);
+  number = state_load_items( items, names, dirfd( dp));
+  closedir( dp);
+
+  for( i = 0; i < names; i++)
+    free( items[i].file_name);
+  free( items);
+
+  return number;
+}
+
+
+// Maps a whole file of the state directory, returning NULL if it isn't
+// there or is shorter than its header.
+static const unsigned char *state_map( char *name, size_t header_size,
+                                       size_t *map_length)
+{
+  struct stat st;
+  char *filename;
+  void *map;
+  int fd;
+
+  filename = make_file_path( config.state_dir, name);
+  fd = open( filename, O_RDONLY | O_CLOEXEC);
+  free( filename);
+  if( fd == -1)
+    return NULL;
+
+  if( fstat( fd, &st) || (st.st_size < header_size) )
+    {
+      close( fd);
+      return NULL;
+    }
+  *map_length = st.st_size;
+  map = mmap( NULL, *map_length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close( fd);
+  if( map == MAP_FAILED)
+    {
+      log_error_write(errno, "State file map");
+      return NULL;
+    }
+  // read straight through once
+  madvise( map, *map_length, MADV_SEQUENTIAL);
+
+  return map;
+}
+
+// returns number of IOCs loaded
+static int state_snapshot_read( const unsigned char *map, size_t map_length)
+{
+  struct state_load_item *items;
+  const unsigned char *p, *end_p;
+  uint32_t length;
+  int pass, number;
+
+  // first pass counts the records, the second lists them
+  items = NULL;
+  end_p = map + map_length;
+  for( pass = 0; pass < 2; pass++)
+    {
+      number = 0;
+      p = map + sizeof( struct state_snapshot_header);
+      while( (end_p - p) >= sizeof( uint32_t))
+        {
+          memcpy( &length, p, sizeof( uint32_t));
+          p += sizeof( uint32_t);
+          if( (end_p - p) < length)
+            {
+              if( pass)
+                log_write("State snapshot is cut short.\n");
+              break;
+            }
+          if( pass)
+            {
+              items[number].data = p;
+              items[number].length = length;
+              items[number].file_name = NULL;
+            }
+          number++;
+          p += length;
+        }
+      if( !pass &&
+          ((items = malloc( (number + 1) * sizeof( struct state_load_item)))
+           == NULL) )
+        return 0;
+    }
+
+  __atomic_add_fetch( &(state_loading.total), number, __ATOMIC_RELAXED);
+  number = state_load_items( items, number, -1);
+  free( items);
+
+  return number;
+}
+
+
+static uint32_t state_log_checksum( const unsigned char *data, uint32_t length)
+{
+  uint32_t hash;
+
+  // FNV-1a
+  hash = 2166136261U;
+  while( length--)
+    {
+      hash ^= *data++;
+      hash *= 16777619U;
+    }
+  return hash;
+}
+
+static void *state_log_replace( void *entry, void *data)
+{
+  delete_callback( entry, NULL);
+  return data;
+}
+
+// status records carry no info, so only the status of what's there changes
+static void state_log_status( void *entry, void *data)
+{
+  struct iocinfo *ioc;
+  struct iocinfo_data *infodata;
+  uint8_t status;
+
+  ioc = entry;
+  status = *((uint8_t *) data);
+
+  infodata = (ioc->data_up != NULL) ? ioc->data_up : ioc->data_down;
+  ioc->data_up = ioc->data_down = NULL;
+  if( (status == INSTANCE_UP) || (status == INSTANCE_MAYBE_UP) )
+    {
+      infodata->status = INSTANCE_MAYBE_UP;
+      ioc->data_up = infodata;
+    }
+  else
+    {
+      infodata->status = INSTANCE_MAYBE_DOWN;
+      ioc->data_down = infodata;
+    }
+}
+
+// Applies log records to the database, returning where the good part of
+// the log ends.
+static size_t state_log_replay( const unsigned char *map, size_t map_length,
+                                int *number)
+{
+  const unsigned char *p, *end_p, *body;
+  struct iocinfo *ioc;
+  uint32_t length, checksum;
+  uint8_t status;
+  char name[256];
+
+  *number = 0;
+  p = map + sizeof( struct state_log_header);
+  end_p = map + map_length;
+  while( (end_p - p) >= STATE_LOG_RECORD_HEAD)
+    {
+      memcpy( &length, p, sizeof( uint32_t));
+      memcpy( &checksum, p + sizeof( uint32_t), sizeof( uint32_t));
+      body = p + STATE_LOG_RECORD_HEAD;
+      if( ((end_p - body) < length) || (length < 2) ||
+          (state_log_checksum( body, length) != checksum) )
+        break;
+
+      switch( body[0])
+        {
+        case STATE_LOG_INFO:
+          if( (ioc = state_record_parse( body + 1, length - 1)) != NULL)
+            db_add( state_log.ioc_db, ioc->ioc_name, load_callback,
+                    state_log_replace, ioc);
+          break;
+        case STATE_LOG_STATUS:
+          // status, then name
+          if( (length >= 3) && (length == 3 + body[2]) )
+            {
+              status = body[1];
+              memcpy( name, body + 3, body[2]);
+              name[body[2]] = '\0';
+              db_find( state_log.ioc_db, name, state_log_status, &status);
+            }
+          break;
+        case STATE_LOG_REMOVE:
+          if( length == 2 + body[1])
+            {
+              memcpy( name, body + 2, body[1]);
+              name[body[1]] = '\0';
+              db_delete( state_log.ioc_db, name, delete_callback, NULL);
+            }
+          break;
+        }
+      (*number)++;
+      p = body + length;
+    }
+
+  return p - map;
+}
+
+// starts an empty log, replacing the old one only when ready
+static int state_log_reset( uint32_t generation)
+{
+  struct state_log_header header;
+  char *temp_name, *final_name;
+  int fd;
+
+  temp_name = make_file_path( config.state_dir, STATE_LOG_TEMP);
+  final_name = make_file_path( config.state_dir, STATE_LOG_NAME);
+  if( (temp_name == NULL) || (final_name == NULL) )
+    {
+      free( temp_name);
+      free( final_name);
+      return -1;
+    }
+
+  memset( &header, 0, sizeof( header));
+  memcpy( header.magic, STATE_LOG_MAGIC, 8);
+  header.generation = generation;
+
+  fd = open( temp_name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+             0666);
+  if( (fd == -1) || 
+      (write( fd, &header, sizeof( header)) != sizeof( header)) ||
+      fdatasync( fd) || rename( temp_name, final_name) )
+    {
+      log_error_write(errno, "State log start");
+      if( fd != -1)
+        {
+          close( fd);
+          unlink( temp_name);
+        }
+      free( temp_name);
+      free( final_name);
+      return -1;
+    }
+  free( temp_name);
+  free( final_name);
+
+  if( state_log.fd != -1)
+    close( state_log.fd);
+  state_log.fd = fd;
+  state_log.generation = generation;
+  state_log.size = sizeof( header);
+
+  return 0;
+}
+
+// carries on with the log that was replayed, dropping any torn end
+static int state_log_continue( uint32_t generation, size_t size)
+{
+  char *filename;
+
+  filename = make_file_path( config.state_dir, STATE_LOG_NAME);
+  state_log.fd = open( filename, O_WRONLY | O_APPEND | O_CLOEXEC);
+  free( filename);
+  if( (state_log.fd == -1) || ftruncate( state_log.fd, size))
+    {
+      if( state_log.fd != -1)
+        close( state_log.fd);
+      state_log.fd = -1;
+      return -1;
+    }
+  state_log.generation = generation;
+  state_log.size = size;
+
+  return 0;
+}
+
+// A heartbeat put the IOC in the live database before its state was
+// loaded.  What the heartbeats said stands, but an instance that was
+// already known keeps its env until it is read again, and other known
+// instances go behind as down ones.
+static void *state_merge_callback( void *entry, void *data)
+{
+  struct iocinfo *ioc, *loaded;
+  struct iocinfo_data *iocdata, *next, *match, **tail;
+  int i;
+
+  ioc = entry;
+  loaded = data;
+
+  tail = &(ioc->data_down);
+  while( *tail != NULL)
+    tail = &((*tail)->next);
+
+  for( i = 0; i < 2; i++)
+    {
+      iocdata = i ? loaded->data_down : loaded->data_up;
+      while( iocdata != NULL)
+        {
+          next = iocdata->next;
+
+          match = ioc->data_up;
+          while( (match != NULL) &&
+                 !check_ping_id_match( &(match->ping), &(iocdata->ping)) )
+            match = match->next;
+          if( match == NULL)
+            {
+              match = ioc->data_down;
+              while( (match != NULL) && 
+                     !check_ping_id_match( &(match->ping), &(iocdata->ping)) )
+                match = match->next;
+            }
+
+          if( match == NULL)
+            {
+              iocdata->status = INSTANCE_MAYBE_DOWN;
+              iocdata->next = NULL;
+              *tail = iocdata;
+              tail = &(iocdata->next);
+            }
+          else
+            {
+              if( (match->env == NULL) &&
+                  (match->ping.reply_port == iocdata->ping.reply_port) )
+                {
+                  match->env = iocdata->env;
+                  iocdata->env = NULL;
+                }
+              free_iocenv( iocdata->env);
+              free( iocdata);
+            }
+
+          iocdata = next;
+        }
+    }
+  loaded->data_up = loaded->data_down = NULL;
+  delete_callback( loaded, NULL);
+
+  return NULL;
+}
+
+struct state_merge_list
+{
+  int number;
+  void **keys;
+  void **values;
+};
+
+static void state_merge_list_callback( void *entry, void *data)
+{
+  struct state_merge_list *list;
+  struct iocinfo *ioc;
+
+  ioc = entry;
+  list = data;
+  list->keys[list->number] = ioc->ioc_name;
+  list->values[list->number] = ioc;
+  list->number++;
+}
+
+// moves everything loaded into the live database, returning how many
+// were there already
+static int state_merge( struct tree_db *ioc_db, struct tree_db *live_db)
+{
+  struct state_merge_list list;
+  int number;
+
+  number = db_count( ioc_db);
+  list.number = 0;
+  list.keys = malloc( (number + 1) * sizeof( void *));
+  list.values = malloc( (number + 1) * sizeof( void *));
+  if( (list.keys == NULL) || (list.values == NULL) )
+    {
+      free( list.keys);
+      free( list.values);
+      log_write("Out of memory for moving loaded state, not used.\n");
+      db_destroy( ioc_db, destroy_callback, NULL);
+      return 0;
+    }
+  db_walk( ioc_db, state_merge_list_callback, &list);
+  number = list.number - 
+    db_bulk_load( live_db, list.number, list.keys, list.values,
+                  state_merge_callback, state_load_discard);
+  // names are copied by the live database
+  db_destroy( ioc_db, NULL, NULL);
+  free( list.keys);
+  free( list.values);
+
+  return number;
+}
+
+static int state_files_load( void)
+{
+  struct state_snapshot_header snap_header;
+  struct state_log_header log_header;
+  struct timespec start, end;
+  const unsigned char *map;
+  size_t map_length;
+  size_t log_end;
+  uint32_t generation;
+  int snapshot_number, log_number, file_number, merge_number;
+  int snapshot_flag;
+
+  clock_gettime( CLOCK_MONOTONIC, &start);
+
+  // straight into the live one if there's no room for another
+  state_log.ioc_db = ioc_db_create();
+  if( state_log.ioc_db == NULL)
+    state_log.ioc_db = state_loading.ioc_db;
+  netbuffer_init( &(state_log.pending), 65536);
+
+  snapshot_number = log_number = file_number = 0;
+  snapshot_flag = 0;
+  generation = 0;
+  map = state_map( STATE_SNAPSHOT_NAME, sizeof( snap_header), &map_length);
+  if( map != NULL)
+    {
+      memcpy( &snap_header, map, sizeof( snap_header));
+      if( memcmp( snap_header.magic, STATE_SNAPSHOT_MAGIC, 8))
+        log_write("State snapshot has wrong format, not used.\n");
+      else
+        {
+          snapshot_number = state_snapshot_read( map, map_length);
+          generation = snap_header.log_generation;
+          snapshot_flag = 1;
+        }
+      munmap( (void *) map, map_length);
+    }
+  if( !snapshot_flag)
+    file_number = state_files_read();
+
+  // stopped part way, so nothing is written and the next start reads
+  // the same state
+  if( __atomic_load_n( &(state_loading.stop), __ATOMIC_RELAXED) )
+    {
+      if( state_log.ioc_db != state_loading.ioc_db)
+        db_destroy( state_log.ioc_db, destroy_callback, NULL);
+      state_log.ioc_db = NULL;
+      log_write("State loading stopped for shutdown.\n");
+
+      pthread_mutex_lock( &(state_loading.lock));
+      state_loading.flag = 0;
+      pthread_cond_broadcast( &(state_loading.done_cond));
+      pthread_mutex_unlock( &(state_loading.lock));
+      return -1;
+    }
+
+  log_end = 0;
+  map = state_map( STATE_LOG_NAME, sizeof( log_header), &map_length);
+  if( map != NULL)
+    {
+      memcpy( &log_header, map, sizeof( log_header));
+      // an older log was already folded into the snapshot
+      if( !memcmp( log_header.magic, STATE_LOG_MAGIC, 8) &&
+          (log_header.generation > generation) )
+        {
+          log_end = state_log_replay( map, map_length, &log_number);
+          generation = log_header.generation;
+          if( log_end < map_length)
+            log_write("State log has a bad end, %u bytes dropped.\n",
+                      (unsigned int) (map_length - log_end));
+        }
+      munmap( (void *) map, map_length);
+    }
+
+  if( !log_end || state_log_continue( generation, log_end))
+    {
+      if( state_log_reset( generation + 1))
+        log_write("No state log, state changes won't be kept.\n");
+    }
+
+  merge_number = 0;
+  if( state_log.ioc_db != state_loading.ioc_db)
+    {
+      merge_number = state_merge( state_log.ioc_db, state_loading.ioc_db);
+      state_log.ioc_db = state_loading.ioc_db;
+    }
+  db_changed();
+
+  clock_gettime( CLOCK_MONOTONIC, &end);
+  log_write("Loaded %d IOCs from state snapshot, %d from state files, and "
+            "%d state log records in %.3f s.\n", snapshot_number, file_number,
+            log_number,
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  if( merge_number > 0)
+    log_write("%d IOCs sent heartbeats before their state was loaded.\n",
+              merge_number);
+
+  pthread_mutex_lock( &(state_loading.lock));
+  state_loading.flag = 0;
+  pthread_cond_broadcast( &(state_loading.done_cond));
+  pthread_mutex_unlock( &(state_loading.lock));
+
+  // moves the IOCs from the state files over
+  if( file_number)
+    persist_snapshot();
+
+  return 0;
+}
+
+
+struct snapshot_walk
+{
+  FILE *fptr;
+  struct netbuffer_struct nb;
+  uint32_t count;
+  int error;
+};
+
+static void snapshot_callback( void *entry, void *data)
+{
+  struct snapshot_walk *sw;
+  struct iocinfo *ioc;
+  struct iocinfo_data *iocdata;
+  uint32_t length;
+
+  ioc = entry;
+  sw = data;
+
+  // what the IOC's state file would have
+  iocdata = (ioc->data_up != NULL) ? ioc->data_up : ioc->data_down;
+  if( (iocdata == NULL) || sw->error)
+    return;
+
+  netbuffer_clear( &(sw->nb));
+  state_record_build( &(sw->nb), ioc->ioc_name, iocdata->status,
+                      &(iocdata->ping), iocdata->env);
+  length = netbuffer_size( &(sw->nb));
+  if( (fwrite( &length, sizeof(uint32_t), 1, sw->fptr) != 1) ||
+      (fwrite( netbuffer_data( &(sw->nb)), 1, length, sw->fptr) != length) )
+    sw->error = 1;
+  sw->count++;
+}
+
+// writes whole database to the snapshot, replacing it only when done
+static int state_snapshot_write( struct tree_db *ioc_db, 
+                                 uint32_t log_generation)
+{
+  struct state_snapshot_header header;
+  struct snapshot_walk sw;
+  struct timespec ts, start, end;
+  char *temp_name, *final_name;
+
+  clock_gettime( CLOCK_MONOTONIC, &start);
+  clock_gettime( CLOCK_REALTIME, &ts);
+
+  temp_name = make_file_path( config.state_dir, STATE_SNAPSHOT_TEMP);
+  final_name = make_file_path( config.state_dir, STATE_SNAPSHOT_NAME);
+  if( (temp_name == NULL) || (final_name == NULL) )
+    {
+      free( temp_name);
+      free( final_name);
+      return -1;
+    }
+
+  sw.fptr = fopen( temp_name, "w");
+  if( sw.fptr == NULL)
+    {
+      log_error_write(errno, "State snapshot write");
+      free( temp_name);
+      free( final_name);
+      return -1;
+    }
+  setvbuf( sw.fptr, NULL, _IOFBF, 1 << 20);
+  netbuffer_init( &(sw.nb), 4096);
+  sw.count = 0;
+  sw.error = 0;
+
+  memset( &header, 0, sizeof( header));
+  memcpy( header.magic, STATE_SNAPSHOT_MAGIC, 8);
+  header.log_generation = log_generation;
+  header.time_sec = ts.tv_sec;
+  header.time_nsec = ts.tv_nsec;
+  if( fwrite( &header, sizeof( header), 1, sw.fptr) != 1)
+    sw.error = 1;
+
+  db_walk( ioc_db, snapshot_callback, &sw);
+
+  // count goes in at the end
+  header.count = sw.count;
+  if( fseek( sw.fptr, 0, SEEK_SET) ||
+      (fwrite( &header, sizeof( header), 1, sw.fptr) != 1) ||
+      fflush( sw.fptr) || fsync( fileno( sw.fptr)) )
+    sw.error = 1;
+  if( fclose( sw.fptr))
+    sw.error = 1;
+  netbuffer_deinit( &(sw.nb));
+
+  if( sw.error || rename( temp_name, final_name))
+    {
+      log_error_write(errno, "State snapshot write");
+      unlink( temp_name);
+      free( temp_name);
+      free( final_name);
+      return -1;
+    }
+  free( temp_name);
+  free( final_name);
+
+  clock_gettime( CLOCK_MONOTONIC, &end);
+  log_write("Wrote state snapshot of %u IOCs in %.3f s.\n", sw.count,
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+  return 0;
+}
+
+
+// Writes out and syncs what has been added to the log.  If that fails,
+// the log is cut back to the last record that made it, so later ones
+// aren't appended after a torn one and lost on replay, and the log is
+// marked as behind until a snapshot is written.
+static void state_log_commit( void)
+{
+  int size;
+
+  size = netbuffer_size( &(state_log.pending));
+  if( !size)
+    return;
+
+  if( state_log.fd != -1)
+    {
+      if( (write( state_log.fd, netbuffer_data( &(state_log.pending)), size)
+           != size) || fdatasync( state_log.fd) )
+        {
+          log_error_write(errno, "State log write");
+          if( ftruncate( state_log.fd, state_log.size))
+            log_error_write(errno, "State log truncate");
+          state_log.behind = 1;
+        }
+      else
+        state_log.size += size;
+    }
+  netbuffer_clear( &(state_log.pending));
+  __atomic_add_fetch( &(state_log.commits), 1, __ATOMIC_RELAXED);
+}
+
+// msec until what's in the log has to be committed
+static int state_log_due( void)
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts);
+  return config.state_commit_interval -
+    ((ts.tv_sec - state_log.pending_since.tv_sec) * 1000 +
+     (ts.tv_nsec - state_log.pending_since.tv_nsec) / 1000000);
+}
+
+// folds the log into a new snapshot
+static void state_log_compact( void)
+{
+  state_log_commit();
+  if( state_log.ioc_db == NULL)  // loading was stopped
+    return;
+  if( !state_snapshot_write( state_log.ioc_db, state_log.generation) &&
+      !state_log_reset( state_log.generation + 1) )
+    state_log.behind = 0;
+}
+
+// returns offset of record, type is put in after the length and checksum
+static int state_log_begin( uint8_t type)
+{
+  struct netbuffer_struct *nb;
+  uint32_t zero = 0;
+  int start;
+
+  nb = &(state_log.pending);
+  if( !netbuffer_size( nb))
+    clock_gettime( CLOCK_MONOTONIC, &(state_log.pending_since));
+  start = netbuffer_size( nb);
+  state_put( nb, &zero, sizeof(uint32_t));
+  state_put( nb, &zero, sizeof(uint32_t));
+  state_put( nb, &type, sizeof(uint8_t));
+
+  return start;
+}
+
+static void state_log_end( int start)
+{
+  unsigned char *record;
+  uint32_t length, checksum;
+
+  record = netbuffer_data( &(state_log.pending)) + start;
+  length = netbuffer_size( &(state_log.pending)) - start -
+    STATE_LOG_RECORD_HEAD;
+  checksum = state_log_checksum( record + STATE_LOG_RECORD_HEAD, length);
+  memcpy( record, &length, sizeof(uint32_t));
+  memcpy( record + sizeof(uint32_t), &checksum, sizeof(uint32_t));
+  __atomic_add_fetch( &(state_log.records), 1, __ATOMIC_RELAXED);
+}
+
+
+static int state_write( char *ioc_name, uint8_t status)
+{
+  int start;
+
+  start = state_log_begin( STATE_LOG_STATUS);
+  state_put( &(state_log.pending), &status, sizeof(uint8_t));
+  state_put_string( &(state_log.pending), 1, ioc_name);
+  state_log_end( start);
+
+  return 0;
+}
+
+static int state_file_remove( char *ioc_name)
+{
+  char *filename;
+  int start;
+
+  start = state_log_begin( STATE_LOG_REMOVE);
+  state_put_string( &(state_log.pending), 1, ioc_name);
+  state_log_end( start);
+
+  // so an older state file can't bring it back
+  filename = make_file_path( config.state_dir, ioc_name);
+  if( unlink( filename) && (errno != ENOENT) )
+    log_error_write(errno, "IOC state remove");
+  free(filename);
+
+  return 0;
+}
+
+
+static int state_info_write( char *ioc_name, uint8_t status, 
+                      struct iocinfo_ping *ping, struct iocinfo_env *env)
+{
+  int start;
+
+  start = state_log_begin( STATE_LOG_INFO);
+  state_record_build( &(state_log.pending), ioc_name, status, ping, env);
+  state_log_end( start);
+
+  return 0;
+}
+
+
+///////////////////////////////////
+
+static int event_process( char *ioc_name, uint32_t timestamp, uint8_t event,
+                          struct iocinfo_ping iocping, struct iocinfo_env *env)
+{
+  event_write( ioc_name, timestamp, iocping.ip_address.s_addr,
+               iocping.user_msg, event);
 
   // send data from ping, not the pointer, which might change!!!!!!
 
-  /* NOTIFY */
-  notifydb_report_event(ioc_name, iocping, env, event, timestamp);
+  /* NOTIFY */
+  notifydb_report_event(ioc_name, iocping, env, event, timestamp);
+
+  return 0;
+}
+
+
+/////////////////////////////
+
+
+// An env loaded from state can be left as the bytes of its state record
+// (state_lazy_env), as most aren't looked at before the IOC sends a new
+// one.  It is read into the usual fields the first time it is attached.
+// Once raw is NULL it stays that way, so only then does this lock.
+
+static pthread_mutex_t env_raw_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The fields are those of a shared env, which this one keeps a
+// reference to.
+static void env_materialize( struct iocinfo_env *env)
+{
+  struct state_reader sr = { NULL, NULL, 0, 0 };
+  struct iocinfo_env *fields;
+
+  if( __atomic_load_n( &(env->raw), __ATOMIC_ACQUIRE) == NULL)
+    return;
+
+  pthread_mutex_lock( &env_raw_lock);
+  if( env->raw != NULL)
+    {
+      sr.p = env->raw;
+      sr.end = env->raw + env->raw_length;
+      fields = state_env_parse( &sr, -1);
+      if( fields == NULL)
+        log_write("Environment from state is bad, dropped.\n");
+      else
+        {
+          env->count = fields->count;
+          env->key = fields->key;
+          env->value = fields->value;
+          env->extra_type = fields->extra_type;
+          env->extra = fields->extra;
+          env->fields = fields;
+        }
+      free( env->raw);
+      __atomic_store_n( &(env->raw), NULL, __ATOMIC_RELEASE);
+    }
+  pthread_mutex_unlock( &env_raw_lock);
+}
+
+// puts the env as its state record bytes if it hasn't been read yet,
+// returning 1 if it did
+static int env_raw_put( struct netbuffer_struct *nb, struct iocinfo_env *env)
+{
+  int done;
+
+  if( __atomic_load_n( &(env->raw), __ATOMIC_ACQUIRE) == NULL)
+    return 0;
+
+  pthread_mutex_lock( &env_raw_lock);
+  done = (env->raw != NULL);
+  if( done)
+    state_put( nb, env->raw, env->raw_length);
+  pthread_mutex_unlock( &env_raw_lock);
+
+  return done;
+}
+
+// Returns the env as sent to clients, making it the first time if the
+// cache has room, or NULL if the fields have to be sent.  It stays until
+// the shared env goes, and one read from state uses its shared env's.
+const struct iocinfo_env_wire *iocdb_env_wire( struct iocinfo_env *env)
+{
+  struct iocinfo_env_wire *wire, *made;
+  size_t size;
+
+  if( __atomic_load_n( &(env->raw), __ATOMIC_ACQUIRE) != NULL)
+    return NULL;
+  if( !env->shared && ((env = env->fields) == NULL) )
+    return NULL;
+
+  if( (wire = __atomic_load_n( &(env->wire), __ATOMIC_ACQUIRE)) != NULL)
+    return wire;
+
+  size = sizeof( struct iocinfo_env_wire) + env_wire_length( env);
+  if( __atomic_add_fetch( &(env_share.wire_bytes), size, __ATOMIC_RELAXED) >
+      ((uint64_t) config.env_wire_cache) * 1024)
+    {
+      __atomic_sub_fetch( &(env_share.wire_bytes), size, __ATOMIC_RELAXED);
+      return NULL;
+    }
+  if( (made = malloc( size)) == NULL)
+    {
+      __atomic_sub_fetch( &(env_share.wire_bytes), size, __ATOMIC_RELAXED);
+      return NULL;
+    }
+  made->length = size - sizeof( struct iocinfo_env_wire);
+  made->data = (unsigned char *) (made + 1);
+  env_wire_fill( made->data, env);
+
+  // if another sender made it first, that one is used
+  if( !__atomic_compare_exchange_n( &(env->wire), &wire, made, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) )
+    {
+      __atomic_sub_fetch( &(env_share.wire_bytes), size, __ATOMIC_RELAXED);
+      free( made);
+      return wire;
+    }
+  return made;
+}
+
+struct iocinfo_env *attach_iocenv(struct iocinfo_env *env)
+{
+  if( env == NULL)
+    return NULL;
+
+  env_materialize( env);
+  sharedint_alter( &(env->ref), 1);
+  return env;
+}
+
+static void free_iocenv(struct iocinfo_env *env)
+{
+  if( env == NULL)
+    return;
+
+  if( env->shared)
+    {
+      env_share_put( env);
+      return;
+    }
+
+  if( sharedint_alter( &(env->ref), -1) > 0)
+    return;
+
+  sharedint_uninit( &(env->ref) );
+
+  // one loaded from state, left unread or now using a shared one
+  free( env->raw);
+  free_iocenv( env->fields);
+  free(env);
+}
+
+/////////////////////////////
+
+// Persistence stage.  State changes, event files and event notifications
+// are queued here by whoever made the change, often with the database
+// locked, and a single thread does them in order afterwards.  As all of
+// them go through here, a later write for an IOC never gets beaten by
+// an earlier one.  The queue holds a reference on any env.
+
+enum persist_types { PERSIST_STATE, PERSIST_STATE_INFO, PERSIST_EVENT,
+                     PERSIST_REMOVE, PERSIST_SNAPSHOT };
+
+struct persist_op
+{
+  int type;
+  char *ioc_name;
+  uint8_t status;
+  uint8_t event;
+  uint32_t timestamp;
+  struct iocinfo_ping ping;
+  struct iocinfo_env *env;
+
+  struct persist_op *next;
+};
+
+struct 
+{
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  pthread_cond_t drained;
+  struct persist_op *head;
+  struct persist_op *tail;
+  uint32_t depth;    // includes what the thread is working on
+  uint32_t depth_max;
+  uint64_t done;
+} persist = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+              PTHREAD_COND_INITIALIZER };
+
+
+static struct persist_op *persist_op_create( int type, char *ioc_name)
+{
+  struct persist_op *op;
+
+  op = calloc( 1, sizeof( struct persist_op));
+  if( op == NULL)
+    return NULL;
+  op->type = type;
+  op->ioc_name = strdup( ioc_name);
+  if( op->ioc_name == NULL)
+    {
+      free( op);
+      return NULL;
+    }
+
+  return op;
+}
+
+static void persist_op_add( struct persist_op *op)
+{
+  if( op == NULL)
+    {
+      log_write("Out of memory for state and event writing.\n");
+      return;
+    }
+
+  op->next = NULL;
+  pthread_mutex_lock( &(persist.lock));
+  if( persist.tail == NULL)
+    persist.head = op;
+  else
+    persist.tail->next = op;
+  persist.tail = op;
+  persist.depth++;
+  if( persist.depth > persist.depth_max)
+    persist.depth_max = persist.depth;
+  pthread_cond_signal( &(persist.ready));
+  pthread_mutex_unlock( &(persist.lock));
+}
+
+static void persist_state( char *ioc_name, uint8_t status)
+{
+  struct persist_op *op;
+
+  if( (op = persist_op_create( PERSIST_STATE, ioc_name)) != NULL)
+    op->status = status;
+  persist_op_add( op);
+}
+
+static void persist_state_info( char *ioc_name, uint8_t status, 
+                                struct iocinfo_ping *ping,
+                                struct iocinfo_env *env)
+{
+  struct persist_op *op;
+
+  if( (op = persist_op_create( PERSIST_STATE_INFO, ioc_name)) != NULL)
+    {
+      op->status = status;
+      op->ping = *ping;
+      op->env = attach_iocenv( env);
+    }
+  persist_op_add( op);
+}
+
+static void persist_event( char *ioc_name, uint32_t timestamp, uint8_t event,
+                           struct iocinfo_ping ping, struct iocinfo_env *env)
+{
+  struct persist_op *op;
+
+  if( (op = persist_op_create( PERSIST_EVENT, ioc_name)) != NULL)
+    {
+      op->timestamp = timestamp;
+      op->event = event;
+      op->ping = ping;
+      op->env = attach_iocenv( env);
+    }
+  persist_op_add( op);
+}
 
-  return 0;
+static void persist_remove( char *ioc_name)
+{
+  persist_op_add( persist_op_create( PERSIST_REMOVE, ioc_name));
 }
 
+// in line with the state log, so the log can be started over after it
+static void persist_snapshot( void)
+{
+  struct persist_op *op;
 
-/////////////////////////////
+  if( (op = calloc( 1, sizeof( struct persist_op))) != NULL)
+    op->type = PERSIST_SNAPSHOT;
+  persist_op_add( op);
+}
 
-static struct iocinfo_extra_vxworks *parse_vxworks_info( char *string)
+static void *persist_thread( void *data)
 {
-  struct iocinfo_extra_vxworks *vw;
+  struct persist_op *list, *op;
+  struct timespec ts;
+  uint32_t number;
+  int due;
 
-  // this first case does not need to goto error
-  if( (vw = malloc( sizeof( struct iocinfo_extra_vxworks)) ) == NULL)
-    return NULL;
+  // anything queued meanwhile waits, as the log isn't open yet
+  if( state_loading.ioc_db != NULL)
+    state_files_load();
 
-  vw->bootdev = NULL;
-  vw->unitnum = 0;
-  vw->procnum = 0;
-  vw->boothost_name = NULL;
-  vw->bootfile = NULL;
-  vw->address = NULL;
-  vw->backplane_address = NULL;
-  vw->boothost_address = NULL;
-  vw->gateway_address = NULL;
-  vw->boothost_username = NULL;
-  vw->boothost_password = NULL;
-  vw->flags = 0;
-  vw->target_name = NULL;
-  vw->startup_script = NULL;
-  vw->other = NULL;
-
-  vw->bootdev = buffer_string_grab( &string);
-  vw->unitnum = ntohl( *((uint32_t *) string) );
-  string += 4;
-  vw->procnum = ntohl( *((uint32_t *) string) );
-  string += 4;
-  vw->boothost_name = buffer_string_grab( &string);
-  vw->bootfile = buffer_string_grab( &string);
-  vw->address = buffer_string_grab( &string);
-  vw->backplane_address = buffer_string_grab( &string);
-  vw->boothost_address = buffer_string_grab( &string);
-  vw->gateway_address = buffer_string_grab( &string);
-  vw->boothost_username = buffer_string_grab( &string);
-  vw->boothost_password = buffer_string_grab( &string);
-  vw->flags = ntohl( *((uint32_t *) string) );
-  string += 4;
-  vw->target_name = buffer_string_grab( &string);
-  vw->startup_script = buffer_string_grab( &string);
-  vw->other = buffer_string_grab( &string);
-
-  if( (vw->bootdev == NULL) || (vw->boothost_name == NULL) || 
-      (vw->bootfile == NULL) || (vw->address == NULL) || 
-      (vw->backplane_address == NULL) || (vw->boothost_address == NULL) || 
-      (vw->gateway_address == NULL) || (vw->boothost_username == NULL) || 
-      (vw->boothost_password == NULL) || (vw->target_name == NULL) || 
-      (vw->startup_script == NULL) || (vw->other == NULL) )
-    {
-      free(vw->bootdev);
-      free(vw->boothost_name);
-      free(vw->bootfile);
-      free(vw->address);
-      free(vw->backplane_address);
-      free(vw->boothost_address);
-      free(vw->gateway_address);
-      free(vw->boothost_username);
-      free(vw->boothost_password);
-      free(vw->target_name);
-      free(vw->startup_script);
-      free(vw->other);
-      free(vw);
+  while( 1)
+    {
+      pthread_mutex_lock( &(persist.lock));
+      while( persist.head == NULL)
+        {
+          if( !netbuffer_size( &(state_log.pending)))
+            pthread_cond_wait( &(persist.ready), &(persist.lock));
+          else
+            {
+              // wakes to commit the log if nothing else comes first
+              if( (due = state_log_due()) <= 0)
+                break;
+              clock_gettime( CLOCK_REALTIME, &ts);
+              ts.tv_sec += due / 1000;
+              ts.tv_nsec += (due % 1000) * 1000000;
+              if( ts.tv_nsec >= 1000000000)
+                {
+                  ts.tv_sec++;
+                  ts.tv_nsec -= 1000000000;
+                }
+              pthread_cond_timedwait( &(persist.ready), &(persist.lock), &ts);
+            }
+        }
+      list = persist.head;
+      persist.head = persist.tail = NULL;
+      pthread_mutex_unlock( &(persist.lock));
 
-      return NULL;
-    }
+      number = 0;
+      while( list != NULL)
+        {
+          op = list;
+          list = op->next;
 
-  return vw;
-}
+          switch( op->type)
+            {
+            case PERSIST_STATE:
+              state_write( op->ioc_name, op->status);
+              break;
+            case PERSIST_STATE_INFO:
+              state_info_write( op->ioc_name, op->status, &(op->ping),
+                                op->env);
+              break;
+            case PERSIST_EVENT:
+              event_process( op->ioc_name, op->timestamp, op->event,
+                             op->ping, op->env);
+              break;
+            case PERSIST_REMOVE:
+              state_file_remove( op->ioc_name);
+              event_file_remove( op->ioc_name);
+              break;
+            case PERSIST_SNAPSHOT:
+              state_log_compact();
+              break;
+            }
 
+          free_iocenv( op->env);
+          free( op->ioc_name);
+          free( op);
+          number++;
+        }
+      // event file lines are held until the batch is done
+      event_file_sync();
+
+      if( netbuffer_size( &(state_log.pending)) && (state_log_due() <= 0) )
+        state_log_commit();
+      // after a failed commit, tried again with each batch until it works
+      if( state_log.behind || (state_log.size > STATE_LOG_COMPACT_SIZE) )
+        state_log_compact();
+
+      pthread_mutex_lock( &(persist.lock));
+      persist.depth -= number;
+      persist.done += number;
+      if( !persist.depth)
+        pthread_cond_broadcast( &(persist.drained));
+      pthread_mutex_unlock( &(persist.lock));
+    }
 
+  return NULL;
+}
 
-struct iocinfo_env *attach_iocenv(struct iocinfo_env *env)
+// waits for everything queued to be written
+static void persist_flush( void)
 {
-  if( env == NULL)
-    return NULL;
-
-  sharedint_alter( &(env->ref), 1);
-  return env;
+  pthread_mutex_lock( &(persist.lock));
+  while( persist.depth)
+    pthread_cond_wait( &(persist.drained), &(persist.lock));
+  pthread_mutex_unlock( &(persist.lock));
 }
 
-static void free_iocenv(struct iocinfo_env *env)
-{
-  int i;
 
-  if( env == NULL)
-    return;
+/////////////////////////////
 
-  if( sharedint_alter( &(env->ref), -1) > 0)
-    return;
+// Arms the IOC's timer if this heartbeat's deadline is sooner than the
+// one already armed.  Later deadlines are left alone, and are picked up
+// when the armed timer goes off, so most heartbeats don't touch the
+// wheel.  Record has to be locked.
+static void timeout_arm( struct iocinfo *ioc, uint32_t deadline)
+{
+  char *name;
 
-  sharedint_uninit( &(env->ref) );
+  if( ioc->timer_deadline && 
+      ((int32_t) (deadline - ioc->timer_deadline) >= 0) )
+    return;
 
-  for( i = 0; i < env->count; i++)
+  name = strdup( ioc->ioc_name);
+  if( (name == NULL) || timerwheel_add( &timers, deadline, name) )
     {
-      free( env->key[i]);
-      free( env->value[i]);
+      free( name);
+      return;
     }
-  free( env->key);
-  free( env->value);
-  switch( env->extra_type)
-    {
-    case VXWORKS:
-      {
-        struct iocinfo_extra_vxworks *vw;
+  ioc->timer_deadline = deadline;
+}
 
-        vw = (struct iocinfo_extra_vxworks *) env->extra;
-
-        free(vw->bootdev);
-        free(vw->boothost_name);
-        free(vw->bootfile);
-        free(vw->address);
-        free(vw->backplane_address);
-        free(vw->boothost_address);
-        free(vw->gateway_address);
-        free(vw->boothost_username);
-        free(vw->boothost_password);
-        free(vw->target_name);
-        free(vw->startup_script);
-        free(vw->other);
-        free(vw);
-      }
-      break;
-    case LINUX:
-      {
-        struct iocinfo_extra_linux *lnx;
-          
-        lnx = (struct iocinfo_extra_linux *) env->extra;
-        
-        free( lnx->user);
-        free( lnx->group);
-        free( lnx->hostname);
-        free( lnx);
-      }
-      break;
-    case DARWIN:
-      {
-        struct iocinfo_extra_darwin *dwn;
-        
-        dwn = (struct iocinfo_extra_darwin *) env->extra;
-        
-        free( dwn->user);
-        free( dwn->group);
-        free( dwn->hostname);
-        free( dwn);
-      }
-      break;
-    case WINDOWS:
-      {
-        struct iocinfo_extra_windows *win;
-        
-        win = (struct iocinfo_extra_windows *) env->extra;
-        
-        free( win->user);
-        free( win->machine);
-        free( win);
-      }
-      break;
-    }
-  free(env);
+// FAIL ,  add 1 to allow some slop for final heartbeat
+static uint32_t ping_deadline( struct iocinfo_ping *ping)
+{
+  return ping->arrival + config.fail_number_heartbeats * ping->period + 1;
 }
 
-/////////////////////////////
 
+static void ioc_visible_get( struct iocinfo *ioc, struct ioc_visible *vis)
+{
+  struct iocinfo_data *iocdata;
+
+  iocdata = get_overall_status_timeval( ioc, &(vis->status), 
+                                        &(vis->time_value));
+  vis->ip_address = iocdata->ping.ip_address.s_addr;
+  vis->user_msg = iocdata->ping.user_msg;
+  vis->env = iocdata->env;
+}
+
+// Bumps the generation if the IOC looks different to clients than it
+// did before, so the heartbeats that change nothing leave it alone.
+static void ioc_visible_check( struct iocinfo *ioc, 
+                               const struct ioc_visible *before)
+{
+  struct ioc_visible after;
+
+  ioc_visible_get( ioc, &after);
+  if( (after.status != before->status) ||
+      (after.time_value != before->time_value) ||
+      (after.ip_address != before->ip_address) ||
+      (after.user_msg != before->user_msg) ||
+      (after.env != before->env) )
+    db_changed();
+}
 
 static void *new_ping_callback( void *data)
 {
@@ -612,6 +2563,7 @@ static void *new_ping_callback( void *data)
 
   ioc->ioc_name = strdup(pci->ioc_name);
   ioc->conflict_flag = 0;
+  ioc->timer_deadline = 0;
   
   ioc->data_up = calloc( 1, sizeof( struct iocinfo_data));
   ioc->data_up->next = NULL;
@@ -620,7 +2572,10 @@ static void *new_ping_callback( void *data)
 
   ioc->data_down = NULL;
 
+  timeout_arm( ioc, ping_deadline( &(pci->ping)));
+
   pci->status = ioc->data_up->status = INSTANCE_UP;
+  db_changed();
 
   // suppress read flag
   if( pci->ioc_flags & 2)
@@ -648,12 +2603,20 @@ static void existing_ping_callback( void *entry, void *data)
   struct iocinfo_data *curr, *prev;
 
   struct ping_callback_info *pci;
+  struct ioc_visible before;
 
   int found_flag = 0;
 
   ioc = entry;
   pci = data;
 
+  ioc_visible_get( ioc, &before);
+
+  // With several heartbeat receivers, packets from one IOC can be
+  // handled by different threads.  The record lock serializes this
+  // callback, so the heartbeat comparisons below still throw out
+  // anything older than what has already been accepted.
+
   pci->event = NONE;
   pci->read_flag = 0;
   if( ioc->data_up != NULL)
@@ -776,11 +2739,17 @@ static void existing_ping_callback( void *entry, void *data)
       if(!(pci->ioc_flags & 2) )
         pci->read_flag = 1;
     }
+  // a read dropped as the fetch queue was full is asked for again
+  if( iocdata->read_again && !(pci->ioc_flags & 2) )
+    pci->read_flag = 1;
+  iocdata->read_again = 0;
   if( (pci->ping.user_msg != iocdata->ping.user_msg) &&
       (pci->event == NONE) )
     pci->event = MESSAGE;
 
   iocdata->ping = pci->ping;
+  timeout_arm( ioc, ping_deadline( &(iocdata->ping)));
+  ioc_visible_check( ioc, &before);
 
   // existing data not replaced
   return;
@@ -829,10 +2798,26 @@ static void update_env_callback(void *entry, void *data)
     {
       free_iocenv( iocdata->env);
       iocdata->env = ues->env;
+      db_changed();
     }
 
 }
 
+// marks the instance whose env read was dropped
+static void read_dropped_callback( void *entry, void *data)
+{
+  struct iocinfo *ioc;
+  struct iocinfo_data *iocdata;
+
+  ioc = entry;
+  for( iocdata = ioc->data_up; iocdata != NULL; iocdata = iocdata->next)
+    if( check_ping_id_match( &(iocdata->ping), data) )
+      {
+        iocdata->read_again = 1;
+        break;
+      }
+}
+
 static int delete_callback( void *entry, void *data)
 {
   struct iocinfo *ioc;
@@ -957,7 +2942,8 @@ static void timeout_init(void *ioc_entry, void *data)
       if( iocdata->status == INSTANCE_MAYBE_DOWN) 
         {
           iocdata->status = INSTANCE_UNTIMED_DOWN;
-          state_write( ioc->ioc_name, iocdata->status);
+          persist_state( ioc->ioc_name, iocdata->status);
+          db_changed();
         }
       iocdata = iocdata->next;
     }
@@ -1010,12 +2996,16 @@ static void timeout_checker(void *ioc_entry, void *data)
   struct timeout_data *td;
   struct iocinfo *ioc;
   struct iocinfo_data *iocdata, **iocptr, **iocothpos;
+  struct ioc_visible before;
 
   int conflict_flag;
+  uint32_t deadline, next;
   
   td = data;
   ioc = ioc_entry;
 
+  ioc_visible_get( ioc, &before);
+
   /* debug_db_print( ioc); */
 
 
@@ -1024,9 +3014,9 @@ static void timeout_checker(void *ioc_entry, void *data)
   iocothpos = &(ioc->data_down);
   while( iocdata != NULL)
     {
-      // FAIL ,  add 1 to allow some slop for final heartbeat
-      if( (td->currtime - iocdata->ping.timestamp) >= 
-            (config.fail_number_heartbeats * iocdata->ping.period + 1) )
+      // no arrival time means it hasn't been heard from since startup
+      if( !iocdata->ping.arrival ||
+          ((int32_t) (td->currmono - ping_deadline( &(iocdata->ping))) >= 0) )
         {
           if( iocdata->status == INSTANCE_UP)
             iocdata->status = INSTANCE_DOWN;
@@ -1036,12 +3026,12 @@ static void timeout_checker(void *ioc_entry, void *data)
           // if it's the first entry....
           if(ioc->data_up == iocdata)
             {
-              state_write( ioc->ioc_name, iocdata->status);
+              persist_state( ioc->ioc_name, iocdata->status);
 
               // only write state change down if no conflict 
               if( !ioc->conflict_flag)
                 {
-                  event_process( ioc->ioc_name, td->currtime, FAIL, 
+                  persist_event( ioc->ioc_name, td->currtime, FAIL, 
                                  iocdata->ping, iocdata->env);
                 }
             }
@@ -1082,16 +3072,17 @@ static void timeout_checker(void *ioc_entry, void *data)
         {
           ioc->conflict_flag = 0;
               
-          event_process( ioc->ioc_name, td->currtime, CONFLICT_STOP, 
+          persist_event( ioc->ioc_name, td->currtime, CONFLICT_STOP, 
                          ioc->data_up->ping, ioc->data_up->env);
 
           // to make sure last written item was the last running ioc
           if( ioc->data_up != NULL)
-            state_info_write( ioc->ioc_name, ioc->data_up->status, 
-                              &(ioc->data_up->ping), ioc->data_up->env);
+            persist_state_info( ioc->ioc_name, ioc->data_up->status, 
+                                &(ioc->data_up->ping), ioc->data_up->env);
           else
-            state_info_write( ioc->ioc_name, ioc->data_down->status, 
-                              &(ioc->data_down->ping), ioc->data_down->env);
+            persist_state_info( ioc->ioc_name, ioc->data_down->status, 
+                                &(ioc->data_down->ping), 
+                                ioc->data_down->env);
         }
     }
   else
@@ -1100,7 +3091,7 @@ static void timeout_checker(void *ioc_entry, void *data)
         {
           ioc->conflict_flag = 1;
 
-          event_process( ioc->ioc_name, td->currtime, CONFLICT_START, 
+          persist_event( ioc->ioc_name, td->currtime, CONFLICT_START, 
                          ioc->data_up->ping, ioc->data_up->env);
         }
     }
@@ -1127,7 +3118,53 @@ static void timeout_checker(void *ioc_entry, void *data)
 
       iocdata = *iocptr;
     }
+  ioc_visible_check( ioc, &before);
+
+  // arm for the next time anything here can change
+  ioc->timer_deadline = 0;
+  next = 0;
+  for( iocdata = ioc->data_up; iocdata != NULL; iocdata = iocdata->next)
+    {
+      deadline = ping_deadline( &(iocdata->ping));
+      if( !next || ((int32_t) (deadline - next) < 0) )
+        next = deadline;
+    }
+  iocdata = (ioc->data_up != NULL) ? ioc->data_down : ioc->data_down->next;
+  for( ; iocdata != NULL; iocdata = iocdata->next)
+    {
+      deadline = td->currmono + (iocdata->ping.timestamp + 
+                                 config.instance_retain_time + 1 - 
+                                 td->currtime);
+      if( !next || ((int32_t) (deadline - next) < 0) )
+        next = deadline;
+    }
+  if( next)
+    timeout_arm( ioc, next);
+}
+
+// timer went off, but it only counts if it's still the one armed
+static void timeout_due(void *ioc_entry, void *data)
+{
+  struct timeout_data *td;
+  struct iocinfo *ioc;
+
+  td = data;
+  ioc = ioc_entry;
 
+  if( ioc->timer_deadline != td->deadline)
+    return;
+  timeout_checker( ioc, td);
+}
+
+static void timeout_expired( void *name, uint32_t deadline, void *data)
+{
+  struct timeout_data *td;
+
+  td = data;
+  td->deadline = deadline;
+  // IOC could have been deleted
+  db_find( db.ioc_db, name, timeout_due, td);
+  free( name);
 }
 
 
@@ -1281,12 +3318,23 @@ struct get_ioc_info_struct
 
   struct iocinfo_ping ping;
   uint8_t status;
+
+  struct envfetch_request fetch;
+
+  // fetch queue
+  unsigned int hash;
+  struct timespec queued;
+  struct get_ioc_info_struct *next;  // queue order
+  struct get_ioc_info_struct *chain; // same hash bucket, newest first
+  // once taken off the queue, until a worker is done with it
+  struct get_ioc_info_struct *active_chain;
+  struct get_ioc_info_struct *held;  // later ones for the IOC, in order
 };
 
 
-// needs to free all data
+// the caller frees the request
 // if it bombs out, go to Events, as they MUST be processed
-static void *get_ioc_info( void *data)
+static void get_ioc_info( void *data)
 {
   struct get_ioc_info_struct *gii;
 
@@ -1298,233 +3346,472 @@ static void *get_ioc_info( void *data)
 
   if( gii->read_flag)
     {  
-      int ioc_sockfd;
-      struct sockaddr_in ioc_addr;
-      int result;
-
-#define PACKET_BUFFER (10001)
-
       uint16_t version;
-      uint32_t length;
       uint16_t ioc_type;
 
-      uint8_t len8;
-      uint16_t len16;
-
-      char data_buffer[PACKET_BUFFER];
-
-      int len, addlen;
-
+      struct state_reader sr;
       char *p;
-      int i;
   
 
       struct update_env_struct ues;
 
   
-      ioc_sockfd = socket(AF_INET, SOCK_STREAM, 0);
-
-      bzero( &ioc_addr, sizeof(ioc_addr) );
-      ioc_addr.sin_family = AF_INET;
-      ioc_addr.sin_port = htons(gii->ping.reply_port);
-      ioc_addr.sin_addr = gii->ping.ip_address;
-                  
-      result = connect(ioc_sockfd, (struct sockaddr *)&ioc_addr, 
-                       sizeof(ioc_addr) );
-      if( result == -1)
+      // the read was already done by the fetch engine
+      switch( gii->fetch.result)
         {
-          char addr_str[16];
-
-          log_write("get_ioc_info: can't connect to %s (%s@%d).\n",
-                    gii->ioc_name, 
-                    address_to_string( addr_str, gii->ping.ip_address.s_addr),
-                    gii->ping.reply_port );
-          close( ioc_sockfd);
+        case ENVFETCH_OK:
+          break;
+        case ENVFETCH_CONNECT:
+          {
+            char addr_str[16];
 
+            log_write("get_ioc_info: can't connect to %s (%s@%d).\n",
+                      gii->ioc_name, 
+                      address_to_string( addr_str, 
+                                         gii->ping.ip_address.s_addr),
+                      gii->ping.reply_port );
+          }
           goto ReadFail;
-        }
-
-      len = 0;
-      while( (addlen = read( ioc_sockfd, data_buffer + len, 
-                             PACKET_BUFFER - len)) != 0)
-        len += addlen;
-      close( ioc_sockfd);
-      
-      // 10 is the minimum length
-      if( len < 10)
-        {
+        case ENVFETCH_TIMEOUT:
+          log_write("get_ioc_info: Timed out reading from %s.\n",
+                    gii->ioc_name );
+          goto ReadFail;
+        case ENVFETCH_SHORT:
           log_write("get_ioc_info: Message too small from %s.\n",
                     gii->ioc_name );
           goto ReadFail;
+        case ENVFETCH_LENGTH:
+          log_write("get_ioc_info: Message length from "
+                    "%s doesn't match internal value.\n", gii->ioc_name );
+          goto ReadFail;
+        default:
+          log_write("get_ioc_info: Can't allocate memory.\n" );
+          goto ReadFail;
         }
 
-      p = data_buffer;
+      p = gii->fetch.buffer;
       version = ntohs( *((uint16_t *) p));
       p += 2;
       ioc_type = ntohs( *((uint16_t *) p));
       p += 2;
-      length = ntohl( *((uint32_t *) p));
+      // length already checked
       p += 4;
 
-      if((version < MIN_PROTOCOL_VERSION) && (version > MAX_PROTOCOL_VERSION))
+      if((version < MIN_PROTOCOL_VERSION) || (version > MAX_PROTOCOL_VERSION))
         {
           log_write("get_ioc_info: Unsupported message format "
                     "V%d from %s.\n", version, gii->ioc_name );
           goto ReadFail;
         }
-      if(len != length)
-        {
-          log_write("get_ioc_info: Message length from "
-                    "%s doesn't match internal value.\n", gii->ioc_name );
-          goto ReadFail;
-        }
 
-      env = malloc( sizeof( struct iocinfo_env));
+      // the rest of the message is the env, read with bounds checks
+      sr.p = (unsigned char *) p;
+      sr.end = (unsigned char *) gii->fetch.buffer + gii->fetch.length;
+      sr.error = 0;
+      sr.network = 1;
+      if( (ioc_type < VXWORKS) || (ioc_type > WINDOWS) )
+        ioc_type = GENERIC;
+      env = state_env_parse( &sr, ioc_type);
       if( env == NULL)
         {
-          log_write("get_ioc_info: Can't allocate memory.\n" );
+          log_write("get_ioc_info: Bad environment from %s.\n",
+                    gii->ioc_name );
           goto ReadFail;
         }
       // value is 2 because the database will get it, then it goes to
       // the loggers and notifiers
-      sharedint_init( &(env->ref), 2);
+      sharedint_alter( &(env->ref), 1);
 
-      env->count = ntohs( *((uint16_t *) p));
-      p += 2;
-      
-      env->key = malloc( env->count * sizeof( char *) );
-      env->value = malloc( env->count * sizeof( char *) );
+      ues.ping = &(gii->ping);
+      ues.env = env;
+      // env pointer gets "taken" here, but is accessible for events later
+      // as it was initialized with 2 holds, one removed later in function
+      db_find( db.ioc_db, gii->ioc_name, update_env_callback, &ues);
       
-      if( (env->key == NULL) || (env->value == NULL) )
+    ReadFail:
+      // At this point, either env will be filled or will be NULL
+      // both are fine for this purpose
+
+      // dump information to log file
+      ioc_log_info( gii->info_lock_ptr, gii->ioc_name, &(gii->ping), env);
+
+      persist_state_info( gii->ioc_name, gii->status, &(gii->ping), env);
+
+      if( gii->event != NONE)
+        persist_event( gii->ioc_name, clock_now(), gii->event,
+                       gii->ping, env);
+    }
+  else
+    {
+      if( gii->event != NONE)
         {
-          log_write("get_ioc_info: Can't allocate memory.\n" );
-          free( env->key);
-          free( env->value);
-          free( env);
-          env = NULL;
-          
-          goto ReadFail;
-        }
-      
-      /* FIX ME! */
-      /* need to check each strdup for success! */
+          env = retrieve_ioc_env( gii->ioc_name);
+          // load the env information
+
+          persist_event( gii->ioc_name, clock_now(), gii->event,
+                         gii->ping, env);
       
-      for( i = 0; i < env->count; i++)
-        {
-          len8 = *((uint8_t *) (p++));
-          env->key[i] = strndup(p, len8);
-          p += len8;
-          
-          len16 = ntohs(*((uint16_t *) p));
-          p += 2;
-          env->value[i] = strndup(p, len16);
-          p += len16;
+          if( gii->event == RECOVER)
+            persist_state( gii->ioc_name, gii->status);
         }
+    }
+
+
+  // remove local hold on env, as second lock held by db
+  free_iocenv(env);
+}
+
+
+//////////////////////////////////////////
+
+// Env reads and event processing go through a bounded queue.  The
+// fetch engine (envfetch.c) takes requests off it as it has connections
+// free, and finished requests are passed to a small pool of worker
+// threads, which parse the env and do the file writing and events.
+// Requests without a read go straight to the workers, in order.
+// Requests for one IOC are done one at a time, in the order they came:
+// one taken off the queue while an earlier one for the IOC is still
+// being read or worked on is held until that one is done, so an event
+// or state write can't get ahead of one before it.  Held requests still
+// count against the queue size.  A request for an IOC is merged into the newest one still waiting for
+// that IOC if they are for the same instance and at most one of them
+// has an event, as events can't be lost.  If the queue is full, plain
+// env reads are dropped, while requests with events are queued past the
+// limit, so the heartbeat receivers never wait on slow env reads.  The
+// instance of a dropped read is marked, and its next heartbeat asks for
+// the read again.
+
+struct 
+{
+  pthread_mutex_t lock;
+  pthread_cond_t done_ready;
+
+  int size;
+  int depth;
+  struct get_ioc_info_struct *head;
+  struct get_ioc_info_struct *tail;
+
+  int bucket_mask;
+  struct get_ioc_info_struct **buckets;
+  // taken off the queue and not done yet, at most one for each IOC
+  struct get_ioc_info_struct **active;
+
+  // held reads that can go now, taken ahead of the queue
+  struct get_ioc_info_struct *ready_head;
+  struct get_ioc_info_struct *ready_tail;
+
+  // ready for the workers
+  struct get_ioc_info_struct *done_head;
+  struct get_ioc_info_struct *done_tail;
+
+  // only fetch counters are used
+  struct iocdb_stats stats;
+} fetch_queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+
+static void fetch_queue_add( struct get_ioc_info_struct *gii)
+{
+  struct get_ioc_info_struct *pending;
+  int bucket;
+  int wake;
+
+  gii->hash = db_string_hash( gii->ioc_name);
+  bucket = gii->hash & fetch_queue.bucket_mask;
+
+  pthread_mutex_lock( &(fetch_queue.lock));
+
+  pending = fetch_queue.buckets[bucket];
+  while( (pending != NULL) && ((pending->hash != gii->hash) ||
+                               strcmp( pending->ioc_name, gii->ioc_name)) )
+    pending = pending->chain;
+  if( (pending != NULL) && 
+      check_ping_id_match( &(pending->ping), &(gii->ping)) &&
+      ((pending->event == NONE) || (gii->event == NONE)) )
+    {
+      if( gii->read_flag)
+        pending->read_flag = 1;
+      if( gii->event != NONE)
+        pending->event = gii->event;
+      pending->ping = gii->ping;
+      pending->status = gii->status;
+      fetch_queue.stats.fetch_merged++;
+      pthread_mutex_unlock( &(fetch_queue.lock));
+
+      free( gii->ioc_name);
+      free( gii);
+      return;
+    }
 
-      env->extra_type = GENERIC;
-      env->extra = NULL;
-      switch(ioc_type)
+  if( fetch_queue.depth >= fetch_queue.size)
+    {
+      if( gii->event == NONE)
         {
-        case 1: // VXWORKS
-          env->extra = (void *) parse_vxworks_info( p);
-          if( env->extra != NULL)
-            env->extra_type = VXWORKS;
-          break;
-        case 2:
-          {
-            struct iocinfo_extra_linux *lnx;
-              
-            if( (lnx = malloc( sizeof( struct iocinfo_extra_linux)) ) == NULL)
-              goto ReadFail;
-            env->extra_type = LINUX;
-            env->extra = (void *) lnx;
-              
-            lnx->user = buffer_string_grab( &p);
-            lnx->group = buffer_string_grab( &p);
-            lnx->hostname = buffer_string_grab( &p);
-          }
-          break;
-        case 3:
-          {
-            struct iocinfo_extra_darwin *dar;
-              
-            if((dar = malloc( sizeof( struct iocinfo_extra_darwin)) ) == NULL)
-              goto ReadFail;
-            env->extra_type = DARWIN;
-            env->extra = (void *) dar;
-              
-            dar->user = buffer_string_grab( &p);
-            dar->group = buffer_string_grab( &p);
-            dar->hostname = buffer_string_grab( &p);
-          }
-          break;
-        case 4:
-          {
-            struct iocinfo_extra_windows *win;
-              
-            if((win = malloc( sizeof( struct iocinfo_extra_windows)) ) == NULL)
-              goto ReadFail;
-            env->extra_type = WINDOWS;
-            env->extra = (void *) win;
-              
-            win->user = buffer_string_grab( &p);
-            win->machine = buffer_string_grab( &p);
-          }
-          break;
+          fetch_queue.stats.fetch_dropped++;
+          pthread_mutex_unlock( &(fetch_queue.lock));
+
+          // its env was cleared for the read, so it gets asked for again
+          if( db.ioc_db != NULL)
+            db_find( db.ioc_db, gii->ioc_name, read_dropped_callback,
+                     &(gii->ping));
+
+          free( gii->ioc_name);
+          free( gii);
+          return;
         }
 
-      ues.ping = &(gii->ping);
-      ues.env = env;
-      // env pointer gets "taken" here, but is accessible for events later
-      // as it was initialized with 2 holds, one removed later in function
-      db_find( db.ioc_db, gii->ioc_name, update_env_callback, &ues);
-      
-    ReadFail:
-      // At this point, either env will be filled or will be NULL
-      // both are fine for this purpose
+      fetch_queue.stats.fetch_overflows++;
+    }
+
+  // engine only needs waking when it might have seen an empty queue
+  wake = (fetch_queue.head == NULL);
+
+  clock_gettime( CLOCK_MONOTONIC, &(gii->queued));
+  gii->next = NULL;
+  if( fetch_queue.tail == NULL)
+    fetch_queue.head = gii;
+  else
+    fetch_queue.tail->next = gii;
+  fetch_queue.tail = gii;
+  gii->chain = fetch_queue.buckets[bucket];
+  fetch_queue.buckets[bucket] = gii;
+
+  fetch_queue.depth++;
+  if( fetch_queue.depth > fetch_queue.stats.fetch_depth_max)
+    fetch_queue.stats.fetch_depth_max = fetch_queue.depth;
+  fetch_queue.stats.fetch_queued++;
+
+  pthread_mutex_unlock( &(fetch_queue.lock));
+
+  if( wake)
+    envfetch_wake();
+}
+
+
+// lock must be held
+static void fetch_done_add( struct get_ioc_info_struct *gii)
+{
+  gii->next = NULL;
+  if( fetch_queue.done_tail == NULL)
+    fetch_queue.done_head = gii;
+  else
+    fetch_queue.done_tail->next = gii;
+  fetch_queue.done_tail = gii;
+
+  pthread_cond_signal( &(fetch_queue.done_ready));
+}
+
+
+// Makes the request the active one for its IOC, returning 0, or if
+// there already is one, holds it behind that one and returns 1.  Lock
+// must be held.
+static int fetch_active_hold( struct get_ioc_info_struct *gii)
+{
+  struct get_ioc_info_struct *active;
+  struct get_ioc_info_struct **pp;
+
+  active = fetch_queue.active[gii->hash & fetch_queue.bucket_mask];
+  while( (active != NULL) && ((active->hash != gii->hash) ||
+                              strcmp( active->ioc_name, gii->ioc_name)) )
+    active = active->active_chain;
+
+  gii->next = NULL;
+  if( active != NULL)
+    {
+      pp = &(active->held);
+      while( *pp != NULL)
+        pp = &((*pp)->next);
+      *pp = gii;
+      return 1;
+    }
+
+  gii->held = NULL;
+  gii->active_chain = fetch_queue.active[gii->hash & fetch_queue.bucket_mask];
+  fetch_queue.active[gii->hash & fetch_queue.bucket_mask] = gii;
+  fetch_queue.depth--;
+  return 0;
+}
+
+// Ends the request being the active one for its IOC, passing that on to
+// the first one held behind it, and returns 1 if that one is a read the
+// fetch engine has to be woken for.  Lock must be held.
+static int fetch_active_done( struct get_ioc_info_struct *gii)
+{
+  struct get_ioc_info_struct *next;
+  struct get_ioc_info_struct **pp;
 
-      // dump information to log file
-      ioc_log_info( gii->info_lock_ptr, gii->ioc_name, &(gii->ping), env);
+  pp = &(fetch_queue.active[gii->hash & fetch_queue.bucket_mask]);
+  while( *pp != gii)
+    pp = &((*pp)->active_chain);
+  *pp = gii->active_chain;
 
-      state_info_write( gii->ioc_name, gii->status, &(gii->ping), env);
+  if( (next = gii->held) == NULL)
+    return 0;
 
-      if( gii->event != NONE)
-        event_process( gii->ioc_name, (uint32_t) time(NULL), gii->event,
-                       gii->ping, env);
+  next->held = next->next;
+  next->next = NULL;
+  next->active_chain = fetch_queue.active[next->hash & 
+                                          fetch_queue.bucket_mask];
+  fetch_queue.active[next->hash & fetch_queue.bucket_mask] = next;
+  fetch_queue.depth--;
+
+  if( !next->read_flag)
+    {
+      fetch_done_add( next);
+      return 0;
     }
+  if( fetch_queue.ready_tail == NULL)
+    fetch_queue.ready_head = next;
   else
-    {
-      if( gii->event != NONE)
-        {
-          env = retrieve_ioc_env( gii->ioc_name);
-          // load the env information
+    fetch_queue.ready_tail->next = next;
+  fetch_queue.ready_tail = next;
+  return 1;
+}
 
-          event_process( gii->ioc_name, (uint32_t) time(NULL), gii->event,
-                         gii->ping, env);
-      
-          if( gii->event == RECOVER)
-            state_write( gii->ioc_name, gii->status);
-        }
+// source for the fetch engine, which runs in its thread
+static struct envfetch_request *fetch_queue_take( void)
+{
+  struct get_ioc_info_struct *gii;
+  struct get_ioc_info_struct **pp;
+  struct timespec now;
+  uint64_t wait;
+
+  pthread_mutex_lock( &(fetch_queue.lock));
+  if( (gii = fetch_queue.ready_head) != NULL)
+    {
+      fetch_queue.ready_head = gii->next;
+      if( fetch_queue.ready_head == NULL)
+        fetch_queue.ready_tail = NULL;
     }
+  else
+    while( (gii = fetch_queue.head) != NULL)
+      {
+        fetch_queue.head = gii->next;
+        if( fetch_queue.head == NULL)
+          fetch_queue.tail = NULL;
+
+        pp = &(fetch_queue.buckets[gii->hash & fetch_queue.bucket_mask]);
+        while( *pp != gii)
+          pp = &((*pp)->chain);
+        *pp = gii->chain;
+
+        clock_gettime( CLOCK_MONOTONIC, &now);
+        wait = (now.tv_sec - gii->queued.tv_sec) * 1000000 + 
+          (now.tv_nsec - gii->queued.tv_nsec) / 1000;
+        fetch_queue.stats.fetch_wait_total += wait;
+        if( wait > fetch_queue.stats.fetch_wait_max)
+          fetch_queue.stats.fetch_wait_max = wait;
+
+        if( fetch_active_hold( gii))
+          continue;
+        if( gii->read_flag)
+          break;
+        fetch_done_add( gii);
+      }
+  pthread_mutex_unlock( &(fetch_queue.lock));
 
+  if( gii == NULL)
+    return NULL;
 
-  // remove local hold on env, as second lock held by db
-  free_iocenv(env);
+  gii->fetch.address = gii->ping.ip_address;
+  gii->fetch.port = gii->ping.reply_port;
+  return &(gii->fetch);
+}
 
-  free(gii->ioc_name);
-  free(data);
+
+// finish for the fetch engine
+static void fetch_queue_finish( struct envfetch_request *request)
+{
+  struct get_ioc_info_struct *gii;
+
+  gii = (struct get_ioc_info_struct *) 
+    ((char *) request - offsetof( struct get_ioc_info_struct, fetch));
+
+  pthread_mutex_lock( &(fetch_queue.lock));
+  fetch_done_add( gii);
+  pthread_mutex_unlock( &(fetch_queue.lock));
+}
+
+
+static void *fetch_worker( void *data)
+{
+  struct get_ioc_info_struct *gii;
+  int wake;
+
+  while( 1)
+    {
+      pthread_mutex_lock( &(fetch_queue.lock));
+      while( fetch_queue.done_head == NULL)
+        pthread_cond_wait( &(fetch_queue.done_ready), &(fetch_queue.lock));
+      gii = fetch_queue.done_head;
+      fetch_queue.done_head = gii->next;
+      if( fetch_queue.done_head == NULL)
+        fetch_queue.done_tail = NULL;
+      pthread_mutex_unlock( &(fetch_queue.lock));
+
+      get_ioc_info( gii);
+
+      pthread_mutex_lock( &(fetch_queue.lock));
+      fetch_queue.stats.fetch_done++;
+      wake = fetch_active_done( gii);
+      pthread_mutex_unlock( &(fetch_queue.lock));
+      if( wake)
+        envfetch_wake();
+
+      free( gii->fetch.buffer);
+      free( gii->ioc_name);
+      free( gii);
+    }
 
   return NULL;
 }
 
 
+static int fetch_queue_start( int threads, int size)
+{
+  pthread_t thread;
+  pthread_attr_t attr;
+  int buckets;
+  int i;
+
+  // power of two, at least as many as the queue holds
+  buckets = 1;
+  while( buckets < size)
+    buckets <<= 1;
+
+  fetch_queue.buckets = calloc( buckets, 
+                                sizeof( struct get_ioc_info_struct *));
+  fetch_queue.active = calloc( buckets, 
+                               sizeof( struct get_ioc_info_struct *));
+  if( (fetch_queue.buckets == NULL) || (fetch_queue.active == NULL) )
+    return 1;
+  fetch_queue.bucket_mask = buckets - 1;
+  fetch_queue.size = size;
+
+  if( envfetch_start( config.env_fetch_connections, config.env_fetch_timeout,
+                      fetch_queue_take, fetch_queue_finish) )
+    return 1;
+
+  for( i = 0; i < threads; i++)
+    {
+      pthread_attr_init(&attr);
+      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+      pthread_create(&thread, &attr, fetch_worker, NULL );
+      pthread_attr_destroy( &attr);
+    }
+
+  return 0;
+}
+
+
 // return whether an env update is needed
 static int packet_insert( char *ioc_name, struct iocinfo_ping ping, 
-                          uint16_t ioc_flags, char *read_flag, 
-                          uint8_t *status, int *event )
+                          uint16_t ioc_flags, uint32_t ioc_id, char *id_hit,
+                          char *read_flag, uint8_t *status, int *event )
 {
   struct ping_callback_info pci;
 
+  *id_hit = 0;
+
   if( db.ioc_db == NULL)
     return 0;
 
@@ -1532,8 +3819,12 @@ static int packet_insert( char *ioc_name, struct iocinfo_ping ping,
   pci.ping = ping;
   pci.ioc_flags = ioc_flags;
 
-  // db_find does not lock whole tree, while db_add does
-  if( !db_find( db.ioc_db, ioc_name, existing_ping_callback, &pci ))
+  // a good record id skips the name search, else fall back to the name
+  if( ioc_id && db_find_id( db.ioc_db, ioc_id, ioc_name, 
+                            existing_ping_callback, &pci) )
+    *id_hit = 1;
+  // db_find does not lock the IOC's shard, while db_add does
+  else if( !db_find( db.ioc_db, ioc_name, existing_ping_callback, &pci ))
     if( db_add( db.ioc_db, ioc_name, new_ping_callback, 
                 existing_ping_callback_stub, &pci) )
       return 0; // unresolvable problem, don't process anymore
@@ -1550,50 +3841,41 @@ static int packet_insert( char *ioc_name, struct iocinfo_ping ping,
 
 
 
-static void ioc_process_packet( struct in_addr ip_address, uint16_t origin_port,
-                                char *data_buffer, int data_length, 
-                                pthread_mutex_t *info_lock)
+// returns 1 if the packet is a valid heartbeat, and fills out hp
+static int ioc_parse_packet( struct in_addr ip_address, uint16_t origin_port,
+                             char *data_buffer, int data_length, 
+                             struct timespec *received,
+                             struct heartbeat_packet *hp)
 {
-  char ioc_name[64];
-
   char address_string[16];
 
-  struct iocinfo_ping ping;
   uint32_t ioc_timestamp;
-  uint16_t ioc_flags;
-
-  char read_flag;
-  uint8_t status;
-  int event;
 
   uint16_t version;
 
   char *p;
 
-  if( db.ioc_db == NULL)
-    return;
-
-  address_to_string( address_string, (uint32_t) ip_address.s_addr);
-
   // 28 is length of static fields, minimum iocname is 1 char //
-  //    plus 1 null termination --> 30
+  //    plus 1 null termination --> 30 (v6 is checked below)
   if( (data_length < 30) || (data_buffer[data_length-1] != '\0') )
     {
+      address_to_string( address_string, (uint32_t) ip_address.s_addr);
       if( data_length < 30)
         log_write("(%s) Bad packet length: %d\n", address_string, data_length);
       else
         log_write("(%s) Packet not null terminated\n", address_string);
 
-      return;
+      return 0;
     }
 
   // check packet for magic number
   p = data_buffer;
   if( ntohl( *((uint32_t *) p)) != 0x12345678)
     {
+      address_to_string( address_string, (uint32_t) ip_address.s_addr);
       log_write("(%s) Bad magic number: %d\n", address_string, 
                 ntohl( *((uint32_t *) p)));
-      return;
+      return 0;
     }
   p += 4;
 
@@ -1602,70 +3884,177 @@ static void ioc_process_packet( struct in_addr ip_address, uint16_t origin_port,
   if( (version < MIN_PROTOCOL_VERSION) || 
       (version > MAX_PROTOCOL_VERSION) )
     {
+      address_to_string( address_string, (uint32_t) ip_address.s_addr);
       log_write("(%s) Bad version: %d\n", address_string, version);
-      return;
+      return 0;
     }
   p += 2;
+  if( (version >= 6) && (data_length < 34) )
+    {
+      address_to_string( address_string, (uint32_t) ip_address.s_addr);
+      log_write("(%s) Bad packet length: %d\n", address_string, data_length);
+      return 0;
+    }
 
-  ping.timestamp = time(NULL);
-  ping.ip_address = ip_address;
-  ping.origin_port =  origin_port;
-  ping.protocol_version = version;
+  // wall clock time for reporting, monotonic time for fail checks
+  hp->ping.timestamp = received->tv_sec;
+  hp->ping.arrival = clock_mono_from_wall( received);
+  hp->ping.ip_address = ip_address;
+  hp->ping.origin_port =  origin_port;
+  hp->ping.protocol_version = version;
 
   // back to reading buffer
 
-  ping.incarnation = ntohl( *((uint32_t *) p)) + 631152000;
+  hp->ping.incarnation = ntohl( *((uint32_t *) p)) + 631152000;
   p += 4;
   ioc_timestamp = ntohl( *((uint32_t *) p)) + 631152000;
   p += 4;
-  ping.heartbeat = ntohl( *((uint32_t *) p));
+  hp->ping.heartbeat = ntohl( *((uint32_t *) p));
   p += 4;
   if( version >= 5)
     {
-      ping.period = ntohs( *((uint16_t *) p));
+      hp->ping.period = ntohs( *((uint16_t *) p));
       p += 2;
     }
   else
-    ping.period = 15; // default period
-  ioc_flags = ntohs( *((uint16_t *) p));
+    hp->ping.period = 15; // default period
+  hp->ioc_flags = ntohs( *((uint16_t *) p));
   p += 2;
-  ping.reply_port = ntohs( *((uint16_t *) p));
+  hp->ping.reply_port = ntohs( *((uint16_t *) p));
   p += 2;
-  ping.user_msg = ntohl( *((uint32_t *) p));
+  hp->ping.user_msg = ntohl( *((uint32_t *) p));
   p += 4;
+  if( version >= 6)
+    {
+      hp->ioc_id = ntohl( *((uint32_t *) p));
+      p += 4;
+    }
+  else
+    hp->ioc_id = 0;
 
-  strncpy( ioc_name, p, 63);
-  ioc_name[63] = '\0';
+  strncpy( hp->ioc_name, p, 63);
+  hp->ioc_name[63] = '\0';
 
   // this weirdness is because the IOC time might be different
   // so we use the time difference, and apply locally
-  ping.boottime = ping.timestamp - (ioc_timestamp - ping.incarnation);
-      
-  if( packet_insert( ioc_name, ping, ioc_flags, &read_flag, &status, &event ) )
+  hp->ping.boottime = hp->ping.timestamp - 
+    (ioc_timestamp - hp->ping.incarnation);
+
+  return 1;
+}
+
+
+// Version 6 IOCs are told their record id, which they then put in
+// their heartbeats.  The reply goes back to where the heartbeat came
+// from, and is (all network order):
+//   uint32 magic (0x12345678), uint16 version (6), uint16 type (1),
+//   uint32 incarnation (as IOC sent it), uint32 record id,
+//   IOC name (null terminated)
+static int heartbeat_id_send( int sockfd, struct heartbeat_packet *hp, 
+                              uint32_t ioc_id)
+{
+  struct sockaddr_in ioc_addr;
+  char buffer[20 + 64];
+  char *p;
+
+  p = buffer;
+  *((uint32_t *) p) = htonl( 0x12345678);
+  p += 4;
+  *((uint16_t *) p) = htons( 6);
+  p += 2;
+  *((uint16_t *) p) = htons( 1);
+  p += 2;
+  *((uint32_t *) p) = htonl( hp->ping.incarnation - 631152000);
+  p += 4;
+  *((uint32_t *) p) = htonl( ioc_id);
+  p += 4;
+  p = stpcpy( p, hp->ioc_name) + 1;
+
+  bzero( &ioc_addr, sizeof(ioc_addr) );
+  ioc_addr.sin_family = AF_INET;
+  ioc_addr.sin_port = htons(hp->ping.origin_port);
+  ioc_addr.sin_addr = hp->ping.ip_address;
+
+  if( sendto( sockfd, buffer, p - buffer, 0, (struct sockaddr *) &ioc_addr,
+              sizeof( ioc_addr)) == -1)
+    return 0;
+  return 1;
+}
+
+
+// returns ID_HIT if the record id was used, ID_SENT if one was sent
+enum { ID_NONE, ID_HIT, ID_SENT };
+
+static int ioc_process_packet( struct heartbeat_packet *hp,
+                               pthread_mutex_t *info_lock, int sockfd)
+{
+  char read_flag;
+  uint8_t status;
+  int event;
+  char id_hit;
+  uint32_t ioc_id;
+  int update;
+  int ret;
+
+  if( db.ioc_db == NULL)
+    return ID_NONE;
+
+  update = packet_insert( hp->ioc_name, hp->ping, hp->ioc_flags, hp->ioc_id,
+                       &id_hit, &read_flag, &status, &event );
+
+  if( id_hit)
+    ret = ID_HIT;
+  else
     {
-      pthread_t thread;
-      pthread_attr_t attr;
+      // new IOC, or old id isn't good anymore
+      if( (hp->ping.protocol_version >= 6) &&
+          ((ioc_id = db_key_id( db.ioc_db, hp->ioc_name)) != 0) &&
+          heartbeat_id_send( sockfd, hp, ioc_id) )
+        ret = ID_SENT;
+      else
+        ret = ID_NONE;
+    }
 
+  if( update)
+    {
       struct get_ioc_info_struct *gii;
 
       gii = malloc( sizeof( struct get_ioc_info_struct) );
 
-      gii->ioc_name = strdup(ioc_name);
+      gii->ioc_name = strdup(hp->ioc_name);
       gii->info_lock_ptr = info_lock;
       gii->read_flag = read_flag;
       gii->event = event;
-      gii->ping = ping;
+      gii->ping = hp->ping;
       gii->status = status;
+      gii->fetch.buffer = NULL;
       
-      pthread_attr_init(&attr);
-      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-      pthread_create(&thread, &attr, get_ioc_info, (void *) gii );
-      pthread_attr_destroy( &attr);
+      fetch_queue_add( gii);
     }
 
+  return ret;
 }
 
 
+static void heartbeat_stats_add( int count, int batch_size)
+{
+  pthread_mutex_lock( &(hb_stats.lock));
+  hb_stats.stats.heartbeat_calls++;
+  hb_stats.stats.heartbeat_packets += count;
+  if( count == batch_size)
+    hb_stats.stats.heartbeat_full_batches++;
+  if( count > hb_stats.stats.heartbeat_largest_batch)
+    hb_stats.stats.heartbeat_largest_batch = count;
+  pthread_mutex_unlock( &(hb_stats.lock));
+}
+
+static void heartbeat_id_stats_add( int id_hits, int ids_sent)
+{
+  pthread_mutex_lock( &(hb_stats.lock));
+  hb_stats.stats.heartbeat_id_hits += id_hits;
+  hb_stats.stats.heartbeat_ids_sent += ids_sent;
+  pthread_mutex_unlock( &(hb_stats.lock));
+}
 
 
 struct process_heartbeat_struct
@@ -1674,55 +4063,193 @@ struct process_heartbeat_struct
 };
 
 
+#define HEARTBEAT_BUFFER (256)  // packet can't be over 200
+// room for a receive timestamp
+#define HEARTBEAT_CONTROL (CMSG_SPACE( sizeof( struct timespec)))
+
+// Pulls up to heartbeat_batch_size datagrams per recvmmsg() call, parses
+// them all, then inserts them into the database in arrival order.
 static void *process_heartbeat( void *data)
 {
   int sockfd;
 
-  // info file lock
-  pthread_mutex_t info_lock;
+  int batch_size;
+  int count;
+  int i, j;
+  int id_hits, ids_sent;
 
-  int data_length;
-  char data_buffer[256];  // packet can't be over 200
+  struct mmsghdr *msgs;
+  struct iovec *iovecs;
+  struct sockaddr_in *r_addrs;
+  char *buffers;
+  char *controls;
+  struct heartbeat_packet *packets;
 
-  struct sockaddr_in r_addr;
-  socklen_t r_len;
+  struct timespec batch_time;
+  struct timespec *received;
+  struct cmsghdr *cmsg;
 
   sockfd = ( (struct process_heartbeat_struct *) data)->socket;
   free(data);
 
-  pthread_mutex_init(&info_lock, NULL);
+  batch_size = config.heartbeat_batch_size;
+  msgs = calloc( batch_size, sizeof( struct mmsghdr));
+  iovecs = calloc( batch_size, sizeof( struct iovec));
+  r_addrs = calloc( batch_size, sizeof( struct sockaddr_in));
+  buffers = malloc( batch_size * HEARTBEAT_BUFFER * sizeof( char));
+  controls = malloc( batch_size * HEARTBEAT_CONTROL * sizeof( char));
+  packets = malloc( batch_size * sizeof( struct heartbeat_packet));
+  if( (msgs == NULL) || (iovecs == NULL) || (r_addrs == NULL) || 
+      (buffers == NULL) || (controls == NULL) || (packets == NULL) )
+    {
+      log_write("process_heartbeat: Can't allocate memory.\n" );
+      return NULL;
+    }
+
+  for( i = 0; i < batch_size; i++)
+    {
+      iovecs[i].iov_base = buffers + i * HEARTBEAT_BUFFER;
+      iovecs[i].iov_len = HEARTBEAT_BUFFER;
+      msgs[i].msg_hdr.msg_iov = &(iovecs[i]);
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &(r_addrs[i]);
+      msgs[i].msg_hdr.msg_control = controls + i * HEARTBEAT_CONTROL;
+    }
 
   while(1 )
     {
-      r_len = sizeof( struct sockaddr_in);
-      data_length = 
-        recvfrom( sockfd, (void *) data_buffer, 256 * sizeof( char), 
-                  0, (struct sockaddr *) &r_addr, &r_len);
+      for( i = 0; i < batch_size; i++)
+        {
+          msgs[i].msg_hdr.msg_namelen = sizeof( struct sockaddr_in);
+          msgs[i].msg_hdr.msg_controllen = HEARTBEAT_CONTROL;
+        }
+
+      // block for the first datagram, then take whatever else is queued
+      count = recvmmsg( sockfd, msgs, batch_size, MSG_WAITFORONE, NULL);
+      if( count < 0)
+        {
+          if( errno != EINTR)
+            log_error_write(errno, "UDP recvmmsg");
+          continue;
+        }
+
+      heartbeat_stats_add( count, batch_size);
+
+      // packets are stamped with the kernel's receive time, so sitting
+      // in the socket queue doesn't make them look late
+      clock_update();
+      clock_gettime( CLOCK_REALTIME, &batch_time);
+
+      j = 0;
+      for( i = 0; i < count; i++)
+        {
+          received = &batch_time;
+          for( cmsg = CMSG_FIRSTHDR( &(msgs[i].msg_hdr)); cmsg != NULL;
+               cmsg = CMSG_NXTHDR( &(msgs[i].msg_hdr), cmsg) )
+            if( (cmsg->cmsg_level == SOL_SOCKET) && 
+                (cmsg->cmsg_type == SCM_TIMESTAMPNS) )
+              received = (struct timespec *) CMSG_DATA( cmsg);
+
+          if( ioc_parse_packet( r_addrs[i].sin_addr, 
+                                ntohs(r_addrs[i].sin_port),
+                                buffers + i * HEARTBEAT_BUFFER, 
+                                msgs[i].msg_len, received, &(packets[j]) ) )
+            j++;
+        }
 
-      ioc_process_packet( r_addr.sin_addr, ntohs(r_addr.sin_port),
-                          data_buffer, data_length, &info_lock);
+      id_hits = 0;
+      ids_sent = 0;
+      for( i = 0; i < j; i++)
+        switch( ioc_process_packet( &(packets[i]), &info_lock, sockfd) )
+          {
+          case ID_HIT:
+            id_hits++;
+            break;
+          case ID_SENT:
+            ids_sent++;
+            break;
+          }
+      if( id_hits || ids_sent)
+        heartbeat_id_stats_add( id_hits, ids_sent);
     }
 
   return NULL;
 }
 
 
+// waits the given microseconds, returning 1 if told to stop
+static int monitor_sleep( long usec)
+{
+  struct timespec ts;
+  int stop;
+
+  clock_gettime( CLOCK_REALTIME, &ts);
+  ts.tv_sec += usec / 1000000;
+  ts.tv_nsec += (usec % 1000000) * 1000;
+  if( ts.tv_nsec >= 1000000000)
+    {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+
+  pthread_mutex_lock( &(monitor.lock));
+  while( !monitor.stop &&
+         (pthread_cond_timedwait( &(monitor.wake), &(monitor.lock), &ts) !=
+          ETIMEDOUT) )
+    ;
+  stop = monitor.stop;
+  pthread_mutex_unlock( &(monitor.lock));
+
+  return stop;
+}
+
+// After the startup pass over everything, only IOCs whose timers go
+// off get checked, once a second.
 static void *monitor_data( void *data)
 {
   struct timeout_data td;
+  struct timespec ts;
+  uint32_t next_snapshot;
 
+  // the startup pass has to see the loaded IOCs, unless stopped first
+  pthread_mutex_lock( &(state_loading.lock));
+  while( state_loading.flag && !state_loading.stop)
+    pthread_cond_wait( &(state_loading.done_cond), &(state_loading.lock));
+  pthread_mutex_unlock( &(state_loading.lock));
 
-  sleep(config.fail_check_period);
+  if( monitor_sleep( config.fail_check_period * 1000000L) )
+    return NULL;
 
-  td.currtime = time(NULL);  // not really needed
+  clock_update();
+  td.currtime = clock_now();  // not really needed
+  td.currmono = clock_mono();
   db_walk( db.ioc_db, timeout_init, &td );
 
+  // arms timers for everything loaded from state
+  clock_update();
+  td.currtime = clock_now();
+  td.currmono = clock_mono();
+  db_walk( db.ioc_db, timeout_checker, &td );
+
+  next_snapshot = td.currmono + config.state_snapshot_period;
   while(1)
     {
-      td.currtime = time(NULL);
-      db_walk( db.ioc_db, timeout_checker, &td );
+      // wake just after the next second starts
+      clock_gettime( CLOCK_MONOTONIC, &ts);
+      if( monitor_sleep( (1000000000 - ts.tv_nsec) / 1000 + 1000) )
+        break;
+
+      clock_update();
+      td.currtime = clock_now();
+      td.currmono = clock_mono();
+      timerwheel_expire( &timers, td.currmono, timeout_expired, &td);
 
-      sleep(5);
+      if( config.state_snapshot_period &&
+          ((int32_t) (td.currmono - next_snapshot) >= 0) )
+        {
+          persist_snapshot();
+          next_snapshot = td.currmono + config.state_snapshot_period;
+        }
     }
 
 
@@ -1734,36 +4261,35 @@ static void *monitor_data( void *data)
 // External functions 
 //////////////////////////////////////
 
-int iocdb_start(void)
+// bind a UDP socket for receiving heartbeats from IOCs
+// reuseport is set when several receivers share the port
+static int heartbeat_socket_open( int reuseport)
 {
   int sockfd;
   int flag;
 
   struct sockaddr_in ip_addr;
-  struct process_heartbeat_struct *phs;
-
-  pthread_t thread;
-  pthread_attr_t attr;
-
-  ///////////////////
-
-  db.ioc_db = db_create( (void * (*)(void *)) strdup, free,
-                         (int (*)(const void *, const void *)) strcmp, 1);
-
-  if( db.ioc_db != NULL)
-    state_files_load();
 
-  //////////////////
-
-   // bind UDP socket for receiving packets from IOCs, then start thread
   sockfd = socket(AF_INET, SOCK_DGRAM, 0);
   flag = 1;
   if( setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &flag, 
                  sizeof(flag)) == -1) 
     {
       log_error_write(errno, "UDP setsockopt");
-      return 1;
+      close( sockfd);
+      return -1;
     }
+  if( reuseport && (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &flag, 
+                               sizeof(flag)) == -1) )
+    {
+      log_error_write(errno, "UDP setsockopt SO_REUSEPORT");
+      close( sockfd);
+      return -1;
+    }
+  // not fatal, as the receive time is used without it
+  if( setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &flag, 
+                 sizeof(flag)) == -1) 
+    log_error_write(errno, "UDP setsockopt SO_TIMESTAMPNS");
   //  fcntl(hb_udp_sockfd, F_SETFL, fcntl(hb_udp_sockfd, F_GETFL) | O_NONBLOCK);
   bzero( &ip_addr, sizeof(ip_addr) );
   ip_addr.sin_family = AF_INET;
@@ -1772,24 +4298,100 @@ int iocdb_start(void)
   if( bind(sockfd, (struct sockaddr *) &ip_addr, sizeof( ip_addr) ))
     {
       log_error_write(errno, "UDP bind");
+      close( sockfd);
+      return -1;
+    }
+
+  return sockfd;
+}
+
+
+int iocdb_start(void)
+{
+  int sockfd;
+  int receivers;
+  int i;
+
+  struct process_heartbeat_struct *phs;
+
+  pthread_t thread;
+  pthread_attr_t attr;
+
+  ///////////////////
+
+  // a little over an hour of one second ticks, which covers the
+  // deadlines of any normal heartbeat period
+  if( timerwheel_init( &timers, 12, clock_mono()) )
+    {
+      log_write("Can't create IOC timer wheel.\n");
       return 1;
     }
 
-  phs = malloc( sizeof( struct process_heartbeat_struct) );
-  phs->socket = sockfd;
-         
+  if( env_share_init() )
+    {
+      log_write("Can't create shared environment tables.\n");
+      return 1;
+    }
+
+  db.ioc_db = ioc_db_create();
+
+  // state is loaded by this thread before anything is written
+  state_loading.ioc_db = db.ioc_db;
+  state_loading.flag = (db.ioc_db != NULL);
   pthread_attr_init(&attr);
-  //  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-  pthread_create(&thread, &attr, process_heartbeat, (void *) phs );
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_create(&thread, &attr, persist_thread, NULL );
   pthread_attr_destroy( &attr);
 
+  if( fetch_queue_start( config.env_fetch_threads, config.env_fetch_queue_size))
+    {
+      log_write("Can't start environment fetch queue.\n");
+      return 1;
+    }
+
+  //////////////////
+
+  // Each receiver thread gets its own socket on the heartbeat port, and
+  // the kernel spreads the IOCs across them by source address.
+  receivers = config.heartbeat_receivers;
+  for( i = 0; i < receivers; i++)
+    {
+      sockfd = heartbeat_socket_open( receivers > 1);
+      if( sockfd == -1)
+        {
+          if( i == 0)
+            {
+              if( receivers == 1)
+                return 1;
+              // SO_REUSEPORT not available, so just use one receiver
+              log_write("Falling back to a single heartbeat receiver.\n");
+              receivers = 1;
+              i = -1;
+              continue;
+            }
+          log_write("Only %d heartbeat receivers started.\n", i);
+          receivers = i;
+          break;
+        }
+
+      phs = malloc( sizeof( struct process_heartbeat_struct) );
+      phs->socket = sockfd;
+         
+      pthread_attr_init(&attr);
+      //  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+      pthread_create(&thread, &attr, process_heartbeat, (void *) phs );
+      pthread_attr_destroy( &attr);
+    }
+  // what is really running, for the stats
+  config.heartbeat_receivers = receivers;
+
   //////////////////////////
 
   // startes the thread with the monitoring process
 
   pthread_attr_init(&attr);
-  //  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-  pthread_create(&thread, &attr, monitor_data, NULL );
+  monitor.running = 
+    !pthread_create( &(monitor.thread), &attr, monitor_data, NULL );
   pthread_attr_destroy( &attr);
 
   return 0;
@@ -1803,9 +4405,25 @@ void iocdb_stop(void)
   if( db.ioc_db == NULL)
     return;
 
+  // no timers go off from here on
+  pthread_mutex_lock( &(monitor.lock));
+  monitor.stop = 1;
+  pthread_cond_broadcast( &(monitor.wake));
+  pthread_mutex_unlock( &(monitor.lock));
+  // a state load still going is given up, and the monitor stops waiting
+  pthread_mutex_lock( &(state_loading.lock));
+  __atomic_store_n( &(state_loading.stop), 1, __ATOMIC_RELAXED);
+  pthread_cond_broadcast( &(state_loading.done_cond));
+  pthread_mutex_unlock( &(state_loading.lock));
+  if( monitor.running)
+    pthread_join( monitor.thread, NULL);
+
   ioc_db = db.ioc_db;
   db.ioc_db = NULL;  // stops any more access
   sleep(1); // time for working threads to finish (or not)
+  // the last snapshot leaves nothing to replay
+  persist_snapshot();
+  persist_flush();
   db_destroy( ioc_db, destroy_callback, NULL);
 }
 
@@ -1815,6 +4433,57 @@ int iocdb_number_iocs(void)
   return db_count( db.ioc_db);
 }
 
+// A list of all IOCs made after reading this holds every change it
+// counts, so while it's the same, the list is too.
+uint32_t iocdb_generation(void)
+{
+  return __atomic_load_n( &(db.generation), __ATOMIC_ACQUIRE);
+}
+
+void iocdb_stats_get( struct iocdb_stats *stats)
+{
+  struct envfetch_stats envstats;
+
+  pthread_mutex_lock( &(hb_stats.lock));
+  *stats = hb_stats.stats;
+  pthread_mutex_unlock( &(hb_stats.lock));
+
+  pthread_mutex_lock( &(fetch_queue.lock));
+  stats->fetch_queued = fetch_queue.stats.fetch_queued;
+  stats->fetch_merged = fetch_queue.stats.fetch_merged;
+  stats->fetch_dropped = fetch_queue.stats.fetch_dropped;
+  stats->fetch_overflows = fetch_queue.stats.fetch_overflows;
+  stats->fetch_done = fetch_queue.stats.fetch_done;
+  stats->fetch_wait_total = fetch_queue.stats.fetch_wait_total;
+  stats->fetch_wait_max = fetch_queue.stats.fetch_wait_max;
+  stats->fetch_depth = fetch_queue.depth;
+  stats->fetch_depth_max = fetch_queue.stats.fetch_depth_max;
+  pthread_mutex_unlock( &(fetch_queue.lock));
+
+  envfetch_stats_get( &envstats);
+  stats->fetch_connections = envstats.active;
+  stats->fetch_connections_max = envstats.active_max;
+  stats->fetch_reads = envstats.started;
+  stats->fetch_read_failures = envstats.failures;
+  stats->fetch_read_timeouts = envstats.timeouts;
+
+  stats->timers = timerwheel_number( &timers);
+
+  stats->env_shared = env_share_number( env_share.envs);
+  stats->env_wire_bytes = __atomic_load_n( &(env_share.wire_bytes),
+                                           __ATOMIC_RELAXED);
+
+  pthread_mutex_lock( &(persist.lock));
+  stats->persist_done = persist.done;
+  stats->persist_depth = persist.depth;
+  stats->persist_depth_max = persist.depth_max;
+  pthread_mutex_unlock( &(persist.lock));
+  stats->state_log_records = __atomic_load_n( &(state_log.records),
+                                              __ATOMIC_RELAXED);
+  stats->state_log_commits = __atomic_load_n( &(state_log.commits),
+                                              __ATOMIC_RELAXED);
+}
+
 int iocdb_missing(void)
 {
   if( db.ioc_db == NULL)
@@ -1824,18 +4493,36 @@ int iocdb_missing(void)
 
 
 
+// returns 1 while state is still being loaded at startup, with how
+// many records have been read out of how many
+int iocdb_loading( uint32_t *done, uint32_t *total)
+{
+  int flag;
+
+  pthread_mutex_lock( &(state_loading.lock));
+  flag = state_loading.flag;
+  pthread_mutex_unlock( &(state_loading.lock));
+  if( done != NULL)
+    *done = __atomic_load_n( &(state_loading.done), __ATOMIC_RELAXED);
+  if( total != NULL)
+    *total = __atomic_load_n( &(state_loading.total), __ATOMIC_RELAXED);
+
+  return flag;
+}
+
+// not done while loading, as the loaded state would bring it back
 int iocdb_remove( char *ioc_name, int files_flag)
 {
   int ret;
 
-  if( db.ioc_db == NULL)
+  if( (db.ioc_db == NULL) || iocdb_loading( NULL, NULL))
     return 0;
   ret = db_delete( db.ioc_db, ioc_name, delete_callback, NULL);
+  if( ret)
+    db_changed();
+  // after anything still queued for it
   if( ret && files_flag)
-    {
-      state_file_remove( ioc_name);
-      event_file_remove( ioc_name);
-    }
+    persist_remove( ioc_name);
 
   return ret;
 }
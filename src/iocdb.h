@@ -72,10 +72,18 @@ struct iocinfo_ping
   uint32_t incarnation; // boot time sent by IOC
   uint32_t boottime;    // boot time, computed to daemon's perspective
   uint32_t timestamp;   // time ping received by daemon
+  uint32_t arrival;     // same, but monotonic, 0 if not heard since start
   uint16_t reply_port;
   uint32_t user_msg;
 };
 
+// an env as sent to clients, from the count on
+struct iocinfo_env_wire
+{
+  uint32_t length;
+  unsigned char *data;  // follows this in the same block
+};
+
 struct iocinfo_env
 {
   struct sharedint_struct ref;
@@ -86,6 +94,19 @@ struct iocinfo_env
 
   uint16_t extra_type;
   void *extra;
+
+  // made the first time a shared env is sent, if the cache has room
+  struct iocinfo_env_wire *wire;  // atomic
+
+  // state record bytes from the count on, if the fields aren't read yet
+  unsigned char *raw;
+  uint32_t raw_length;
+  // shared env holding the fields, once raw is read
+  struct iocinfo_env *fields;
+
+  // in the table of shared envs, which only these are
+  int shared;
+  uint32_t share_hash;
 };
 
 enum instance_statuses { INSTANCE_UP, INSTANCE_DOWN, INSTANCE_UNTIMED_DOWN,
@@ -98,6 +119,7 @@ struct iocinfo_data
 
   struct iocinfo_ping ping;
   struct iocinfo_env *env;
+  uint8_t read_again;  // env read was dropped, next heartbeat asks again
 
   struct iocinfo_data *next;
 };
@@ -106,6 +128,7 @@ struct iocinfo
 {
   char *ioc_name;
   int conflict_flag;
+  uint32_t timer_deadline;  // monotonic, 0 if no timer
 
   struct iocinfo_data *data_up;
   struct iocinfo_data *data_down;
@@ -168,12 +191,60 @@ struct access_detail_db_struct
 
 /////////////////////////////////
 
+struct iocdb_stats
+{
+  // heartbeat receiving
+  uint64_t heartbeat_calls;   // number of receive system calls
+  uint64_t heartbeat_packets; // datagrams received
+  uint64_t heartbeat_full_batches;
+  uint32_t heartbeat_largest_batch;
+  uint64_t heartbeat_id_hits;   // v6 packets found by record id
+  uint64_t heartbeat_ids_sent;  // record ids sent to v6 IOCs
+
+  // environment fetch queue, wait times in microseconds
+  uint64_t fetch_queued;      // requests put on the queue
+  uint64_t fetch_merged;      // requests merged into a waiting one
+  uint64_t fetch_dropped;     // env reads dropped as queue was full
+  uint64_t fetch_overflows;   // event requests queued past the limit
+  uint64_t fetch_done;
+  uint64_t fetch_wait_total;
+  uint64_t fetch_wait_max;
+  uint32_t fetch_depth;
+  uint32_t fetch_depth_max;
+
+  // environment reads
+  uint32_t fetch_connections;
+  uint32_t fetch_connections_max;
+  uint64_t fetch_reads;
+  uint64_t fetch_read_failures;
+  uint64_t fetch_read_timeouts;
+
+  // failure detection
+  uint32_t timers;   // armed timers, including stale ones
+
+  // different envs, each shared by all that have it
+  uint32_t env_shared;
+  uint64_t env_wire_bytes;  // kept in the form sent to clients
+
+  // state and event writing
+  uint64_t persist_done;
+  uint32_t persist_depth;
+  uint32_t persist_depth_max;
+  uint64_t state_log_records;
+  uint64_t state_log_commits;
+};
+
+/////////////////////////////////
+
 
 int iocdb_start(void);
 void iocdb_stop(void);
 
 int iocdb_missing(void);
+int iocdb_loading( uint32_t *done, uint32_t *total);
 int iocdb_number_iocs(void);
+uint32_t iocdb_generation(void);
+void iocdb_stats_get( struct iocdb_stats *stats);
 
 int iocdb_remove( char *ioc_name, int files_flag);
 
@@ -186,6 +257,8 @@ struct access_info_db_struct *iocdb_info_get_multi(int number,
 struct access_info_db_struct *iocdb_info_get_single( char *ioc_name);
 void iocdb_info_release(struct access_info_db_struct *info_db);
 
+const struct iocinfo_env_wire *iocdb_env_wire( struct iocinfo_env *env);
+
 struct access_detail_db_struct *iocdb_get_debug(char *ioc_name);
 void iocdb_debug_release(struct access_detail_db_struct *adds);
 
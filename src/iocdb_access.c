@@ -9,23 +9,58 @@
 
 
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <pthread.h>
 
+#include "alived.h"
 #include "iocdb.h"
 #include "iocdb_access.h"
 #include "utility.h"
 #include "gentypes.h"
+#include "logging.h"
+
+// just some config strings
+extern struct alived_config config;
+
+// The list of all IOCs, as sent to clients.  It's the same until the
+// database generation changes, so it's only built once for each one,
+// and clients sending it at the same time share it.
+struct ioclist_reply
+{
+  int users;  // the cache is one, under the cache lock
+  struct netbuffer_struct nbuff;
+};
+
+static struct
+{
+  // held while building, so others wait for it instead of building too
+  pthread_mutex_t lock;
+  uint32_t generation;
+  struct ioclist_reply *reply;
+  uint64_t requests;
+  uint64_t builds;
+} ioclist_cache = { PTHREAD_MUTEX_INITIALIZER };
 
 void iocdb_make_netbuffer_env( struct netbuffer_struct *nbuff,
                                struct iocinfo_env *env)
 {
+  const struct iocinfo_env_wire *wire;
   int i;
 
   netbuffer_add_uint8( nbuff, env == NULL ? 0 : 1 );
   if( env == NULL)
     return;
+
+  // kept after the first time, unless the cache is full
+  if( (wire = iocdb_env_wire( env)) != NULL)
+    {
+      netbuffer_add_string( nbuff, (char *) wire->data, wire->length);
+      return;
+    }
   
   netbuffer_add_uint16( nbuff, env->count);
   for( i = 0; i < env->count; i++)
@@ -90,44 +125,108 @@ void iocdb_make_netbuffer_env( struct netbuffer_struct *nbuff,
       
 }
 
-static void ioclist_send_and_clean( int socket,
-                                    struct access_info_db_struct *aids)
+static void ioclist_build( struct netbuffer_struct *nbuff,
+                           struct access_info_db_struct *aids)
 {
   struct access_info_struct *ais;
 
-  struct netbuffer_struct nbuff;
-  
   int i;
   
-  netbuffer_init( &nbuff, 256);
-  
-  netbuffer_add_uint16( &nbuff, aids->number);
+  netbuffer_add_uint16( nbuff, aids->number);
   for( i = 0; i < aids->number; i++)
     {
       ais = &(aids->infos[i]);
 
       // write ioc name
-      netbuffer_string_write( 1, &nbuff, ais->ioc_name);
-      netbuffer_add_uint8( &nbuff, ais->overall_status);
-      netbuffer_add_uint32( &nbuff, ais->time_value);
-      netbuffer_add_uint32( &nbuff, ais->ping.ip_address.s_addr);
-      netbuffer_add_uint32( &nbuff, ais->ping.user_msg);
+      netbuffer_string_write( 1, nbuff, ais->ioc_name);
+      netbuffer_add_uint8( nbuff, ais->overall_status);
+      netbuffer_add_uint32( nbuff, ais->time_value);
+      netbuffer_add_uint32( nbuff, ais->ping.ip_address.s_addr);
+      netbuffer_add_uint32( nbuff, ais->ping.user_msg);
 
-      iocdb_make_netbuffer_env( &nbuff, ais->env);
+      iocdb_make_netbuffer_env( nbuff, ais->env);
     }
 
+  iocdb_info_release(aids);
+}
+
+static void ioclist_send_and_clean( int socket,
+                                    struct access_info_db_struct *aids)
+{
+  struct netbuffer_struct nbuff;
+  
+  netbuffer_init( &nbuff, 256);
+  ioclist_build( &nbuff, aids);
   socket_writer( socket, netbuffer_data(&nbuff), netbuffer_size(&nbuff));
   netbuffer_deinit( &nbuff);
-  
-  iocdb_info_release(aids);
+}
+
+// must have the cache lock
+static void ioclist_reply_put( struct ioclist_reply *reply)
+{
+  if( --(reply->users) == 0)
+    {
+      netbuffer_deinit( &(reply->nbuff));
+      free( reply);
+    }
+}
+
+// returns the full list for the current generation, or NULL
+static struct ioclist_reply *ioclist_reply_get( void)
+{
+  struct ioclist_reply *reply;
+  uint32_t generation;
+
+  pthread_mutex_lock( &(ioclist_cache.lock));
+  ioclist_cache.requests++;
+  // read before the list is made, so any change after makes it rebuild
+  generation = iocdb_generation();
+  if( (ioclist_cache.reply == NULL) || 
+      (ioclist_cache.generation != generation) )
+    {
+      if( (reply = malloc( sizeof( struct ioclist_reply))) == NULL)
+        {
+          pthread_mutex_unlock( &(ioclist_cache.lock));
+          return NULL;
+        }
+      reply->users = 1;
+      netbuffer_init( &(reply->nbuff), 256);
+      ioclist_build( &(reply->nbuff), iocdb_info_get_all());
+      ioclist_cache.builds++;
+
+      if( ioclist_cache.reply != NULL)
+        ioclist_reply_put( ioclist_cache.reply);
+      ioclist_cache.reply = reply;
+      ioclist_cache.generation = generation;
+    }
+  reply = ioclist_cache.reply;
+  reply->users++;
+  pthread_mutex_unlock( &(ioclist_cache.lock));
+
+  return reply;
 }
 
 void iocdb_socket_send_all( int socket)
 {
+  struct ioclist_reply *reply;
+
   if( iocdb_missing())
     return;
 
-  ioclist_send_and_clean( socket, iocdb_info_get_all() );
+  // IOCs being loaded don't change the generation until the end
+  if( iocdb_loading( NULL, NULL) || ((reply = ioclist_reply_get()) == NULL) )
+    {
+      ioclist_send_and_clean( socket, iocdb_info_get_all() );
+      return;
+    }
+
+  // written without the lock, so a slow client doesn't hold others up
+  socket_writer( socket, netbuffer_data( &(reply->nbuff)),
+                 netbuffer_size( &(reply->nbuff)));
+
+  pthread_mutex_lock( &(ioclist_cache.lock));
+  ioclist_reply_put( reply);
+  pthread_mutex_unlock( &(ioclist_cache.lock));
 }
 
 void iocdb_socket_send_multi( int socket, int number, char **ioc_names)
@@ -147,6 +246,29 @@ void iocdb_socket_send_single( int socket, char *ioc_name)
   ioclist_send_and_clean( socket, iocdb_info_get_single(ioc_name));
 }
 
+// Lets clients tell a partial list from startup apart from a full one:
+// loading flag, state records read, records to read (0 if not known
+// yet), and IOCs in the database so far.
+void iocdb_socket_send_loading( int socket)
+{
+  struct netbuffer_struct nbuff;
+  uint32_t done, total;
+  int flag;
+
+  if( iocdb_missing())
+    return;
+
+  flag = iocdb_loading( &done, &total);
+
+  netbuffer_init( &nbuff, 16);
+  netbuffer_add_uint8( &nbuff, flag);
+  netbuffer_add_uint32( &nbuff, done);
+  netbuffer_add_uint32( &nbuff, total);
+  netbuffer_add_uint32( &nbuff, iocdb_number_iocs());
+  socket_writer( socket, netbuffer_data(&nbuff), netbuffer_size(&nbuff));
+  netbuffer_deinit( &nbuff);
+}
+
 
 
 ///////////////////////////////////////
@@ -173,6 +295,124 @@ void iocdb_socket_send_control_list( int socket)
 }
 
 
+void iocdb_socket_send_control_stats( int socket)
+{
+  struct iocdb_stats stats;
+  struct rusage usage;
+  uint64_t event_hits, event_misses;
+  uint64_t list_requests, list_builds;
+  uint32_t load_done, load_total;
+  int loading;
+
+  char buffer[4096];
+  int cnt;
+
+  iocdb_stats_get( &stats);
+  event_file_stats( &event_hits, &event_misses);
+  pthread_mutex_lock( &(ioclist_cache.lock));
+  list_requests = ioclist_cache.requests;
+  list_builds = ioclist_cache.builds;
+  pthread_mutex_unlock( &(ioclist_cache.lock));
+  loading = iocdb_loading( &load_done, &load_total);
+  // whole process, so benchmarks can get cost per packet
+  getrusage( RUSAGE_SELF, &usage);
+
+  cnt = snprintf( buffer, 4096,
+                  "%d IOCs\n"
+                  "state loading = %s\n"
+                  "state records loaded = %u of %u\n"
+                  "cpu time (s) = %.3f\n"
+                  "database shards = %d\n"
+                  "heartbeat receivers = %d\n"
+                  "heartbeat batch size = %d\n"
+                  "heartbeat receive calls = %llu\n"
+                  "heartbeat packets = %llu\n"
+                  "heartbeat packets per call = %.2f\n"
+                  "heartbeat full batches = %llu\n"
+                  "heartbeat largest batch = %u\n"
+                  "heartbeat found by record id = %llu\n"
+                  "heartbeat record ids sent = %llu\n"
+                  "env fetch threads = %d\n"
+                  "env fetch queue size = %d\n"
+                  "env fetch queue depth = %u\n"
+                  "env fetch queue largest depth = %u\n"
+                  "env fetch requests queued = %llu\n"
+                  "env fetch requests merged = %llu\n"
+                  "env fetch requests dropped = %llu\n"
+                  "env fetch events over queue size = %llu\n"
+                  "env fetch requests done = %llu\n"
+                  "env fetch average wait (ms) = %.3f\n"
+                  "env fetch longest wait (ms) = %.3f\n"
+                  "env fetch connections = %d\n"
+                  "env fetch timeout (s) = %d\n"
+                  "env fetch active connections = %u\n"
+                  "env fetch most active connections = %u\n"
+                  "env fetch reads started = %llu\n"
+                  "env fetch reads failed = %llu\n"
+                  "env fetch reads timed out = %llu\n"
+                  "fail timers armed = %u\n"
+                  "shared envs = %u\n"
+                  "env wire cache size (kB) = %u\n"
+                  "env wire cache used (kB) = %llu\n"
+                  "database generation = %u\n"
+                  "full list requests = %llu\n"
+                  "full list builds = %llu\n"
+                  "state and event writes done = %llu\n"
+                  "state and event writes waiting = %u\n"
+                  "state and event writes most waiting = %u\n"
+                  "state log records = %llu\n"
+                  "state log commits = %llu\n"
+                  "event file cache size = %d\n"
+                  "event file cache hits = %llu\n"
+                  "event file cache misses = %llu\n",
+                  iocdb_number_iocs(),
+                  loading ? "yes" : "no", load_done, load_total,
+                  usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                  usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+                  config.database_shards,
+                  config.heartbeat_receivers,
+                  config.heartbeat_batch_size,
+                  (unsigned long long) stats.heartbeat_calls,
+                  (unsigned long long) stats.heartbeat_packets,
+                  stats.heartbeat_calls ? 
+                  ((double) stats.heartbeat_packets) / stats.heartbeat_calls :
+                  0.0,
+                  (unsigned long long) stats.heartbeat_full_batches,
+                  stats.heartbeat_largest_batch,
+                  (unsigned long long) stats.heartbeat_id_hits,
+                  (unsigned long long) stats.heartbeat_ids_sent,
+                  config.env_fetch_threads, config.env_fetch_queue_size,
+                  stats.fetch_depth, stats.fetch_depth_max,
+                  (unsigned long long) stats.fetch_queued,
+                  (unsigned long long) stats.fetch_merged,
+                  (unsigned long long) stats.fetch_dropped,
+                  (unsigned long long) stats.fetch_overflows,
+                  (unsigned long long) stats.fetch_done,
+                  (stats.fetch_queued > stats.fetch_depth) ?
+                  stats.fetch_wait_total / 1000.0 / 
+                  (stats.fetch_queued - stats.fetch_depth) : 0.0,
+                  stats.fetch_wait_max / 1000.0,
+                  config.env_fetch_connections, config.env_fetch_timeout,
+                  stats.fetch_connections, stats.fetch_connections_max,
+                  (unsigned long long) stats.fetch_reads,
+                  (unsigned long long) stats.fetch_read_failures,
+                  (unsigned long long) stats.fetch_read_timeouts,
+                  stats.timers,
+                  stats.env_shared,
+                  config.env_wire_cache,
+                  (unsigned long long) stats.env_wire_bytes / 1024,
+                  iocdb_generation(),
+                  (unsigned long long) list_requests,
+                  (unsigned long long) list_builds,
+                  (unsigned long long) stats.persist_done,
+                  stats.persist_depth, stats.persist_depth_max,
+                  (unsigned long long) stats.state_log_records,
+                  (unsigned long long) stats.state_log_commits,
+                  config.event_file_cache,
+                  (unsigned long long) event_hits,
+                  (unsigned long long) event_misses);
+  send( socket, buffer, cnt + 1, 0);
+}
 
 
 static void send_ioc_control( struct access_info_struct *ais, int socket)
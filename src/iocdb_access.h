@@ -19,9 +19,11 @@ void iocdb_make_netbuffer_env( struct netbuffer_struct *nbuff,
 void iocdb_socket_send_all( int socket);
 void iocdb_socket_send_multi( int socket, int number, char **ioc_names);
 void iocdb_socket_send_single( int socket, char *ioc_name);
+void iocdb_socket_send_loading( int socket);
 
 
 void iocdb_socket_send_control_list( int socket);
+void iocdb_socket_send_control_stats( int socket);
 int iocdb_socket_send_control_ioc( int socket, char *ioc_name);
 
 void iocdb_socket_send_debug( int socket, char *ioc_name);
@@ -41,9 +41,35 @@
 
    The top element is simply a pointer holder, is always present,
    and only 'left' is used in the code. It should be used for nothing else.
+
+   The database can be split into shards, each being its own tree with
+   its own lock, with the shard picked by a hash of the key.  Operations
+   on a single key only lock that key's shard.  Operations that need the
+   whole database either go shard by shard (db_walk, db_walk_delete) or
+   lock all shards in index order and merge them to keep key order
+   (db_walk_init, db_multi_find, db_multi_find_init).  Only readers ever
+   hold more than one shard lock.
+
+   Nodes come from chunks owned by each shard, and hold their record
+   lock, and the key too if it is small enough (see db_inline_keys).
+   A record can move to a different node when deleting, so anything
+   pointing at a node's key is only good while the shard is locked.
+
+   Each shard can also keep a hash index of its nodes (see
+   db_hash_index), so that lookups of a single key skip the tree.  The
+   tree is still kept for anything needing key order.
 */
 
 
+#define TREE_NODE_CHUNK (64)
+
+struct tree_node_chunk
+{
+  struct tree_node_chunk *next;
+  struct tree_node nodes[TREE_NODE_CHUNK];
+};
+
+
 // used for making a linked list of keys of nodes to delete
 struct key_link
 {
@@ -57,6 +83,7 @@ struct key_link
 void db_ps( struct tree_db *db, char *filename)
 {
   FILE *fptr;
+  int i;
 
   void tree_print_branch( struct tree_node *node)
   {
@@ -81,21 +108,6 @@ void db_ps( struct tree_db *db, char *filename)
         "/inch {72 mul} def\n"
         "/adv 0.9 inch def\n"
         "/span 10.5 inch def\n"
-        "/btree "
-        , fptr);
-
-  worm_lock_reader(&(db->worm_mutex));
-
-  fprintf( fptr, "[");
-  tree_print_branch( db->tree->left);
-  fprintf( fptr, "]");
-
-  worm_unlock_reader(&(db->worm_mutex));
-
-  fputs(
-        " def\n"
-        "/Helvetica findfont 8 scalefont setfont\n"
-        "0.5 inch 5.5 inch translate\n"
         "/printtree { 3 dict begin /lvl exch def /lspan "
         "span lvl {2 div} repeat def\n"
         "/ladv adv lvl mul def\n"
@@ -108,11 +120,31 @@ void db_ps( struct tree_db *db, char *filename)
         "lvl 1 add printtree\n"
         "grestore show } if\n"
         "end } def\n"
-        "0 0 moveto\n"
-        "btree 1 printtree\n"
-        "showpage\n"
         , fptr);
 
+  // one page per shard
+  for( i = 0; i < db->shard_number; i++)
+    {
+      fputs( "/btree ", fptr);
+
+      worm_lock_reader(&(db->shards[i].worm_mutex));
+
+      fprintf( fptr, "[");
+      tree_print_branch( db->shards[i].tree->left);
+      fprintf( fptr, "]");
+
+      worm_unlock_reader(&(db->shards[i].worm_mutex));
+
+      fputs(
+            " def\n"
+            "/Helvetica findfont 8 scalefont setfont\n"
+            "0.5 inch 5.5 inch translate\n"
+            "0 0 moveto\n"
+            "btree 1 printtree\n"
+            "showpage\n"
+            , fptr);
+    }
+
   fclose(fptr);
 
 }
@@ -136,7 +168,8 @@ struct tree_node *tree_create( void)
   return idb;
 }
 
-static void tree_destroy( struct tree_db *db, 
+// nodes themselves are freed with their shard's chunks
+static void tree_destroy( struct tree_db *db, struct tree_node *tree,
                           void (* values_func)( void *, void *), void *arg )
 {
   void tree_destroy_helper( struct tree_node *node)
@@ -146,15 +179,100 @@ static void tree_destroy( struct tree_db *db,
     tree_destroy_helper( node->left);
     tree_destroy_helper( node->right);
 
-    db->key_release( node->key);
+    if( node->key != node->key_inline)
+      db->key_release( node->key);
     if( values_func != NULL)
       values_func( (void *) node->values, arg);
-    free( node);
   }
 
-  tree_destroy_helper( db->tree->left);
+  tree_destroy_helper( tree->left);
       
-  free( db->tree);
+  free( tree);
+}
+
+
+// Nodes are carved out of chunks, and go on the shard's free list when
+// deleted, linked by left.  Record locks are set up once, when the chunk
+// is, and stay until the shard goes away.  Only done with shard writer
+// lock held.
+
+static struct tree_node *shard_node_alloc( struct tree_shard *shard)
+{
+  struct tree_node_chunk *chunk;
+  struct tree_node *node;
+  int i;
+
+  if( shard->node_free == NULL)
+    {
+      chunk = malloc( sizeof( struct tree_node_chunk));
+      if( chunk == NULL)
+        return NULL;
+      chunk->next = shard->node_chunks;
+      shard->node_chunks = chunk;
+      // handed out in address order
+      for( i = TREE_NODE_CHUNK - 1; i >= 0; i--)
+        {
+          pthread_mutex_init( &(chunk->nodes[i].rec_mutex), NULL);
+          chunk->nodes[i].left = shard->node_free;
+          shard->node_free = &(chunk->nodes[i]);
+        }
+    }
+
+  node = shard->node_free;
+  shard->node_free = node->left;
+
+  return node;
+}
+
+static void shard_node_free( struct tree_shard *shard, struct tree_node *node)
+{
+  node->key = NULL;
+  node->values = NULL;
+  node->right = NULL;
+  node->left = shard->node_free;
+  shard->node_free = node;
+}
+
+static void shard_nodes_destroy( struct tree_shard *shard)
+{
+  struct tree_node_chunk *chunk;
+  int i;
+
+  while( shard->node_chunks != NULL)
+    {
+      chunk = shard->node_chunks;
+      shard->node_chunks = chunk->next;
+      for( i = 0; i < TREE_NODE_CHUNK; i++)
+        pthread_mutex_destroy( &(chunk->nodes[i].rec_mutex));
+      free( chunk);
+    }
+  shard->node_free = NULL;
+}
+
+
+// returns 1 on failure
+static int node_key_set( struct tree_db *db, struct tree_node *node,
+                         void *key)
+{
+  size_t size;
+
+  if( (db->key_size != NULL) &&
+      ((size = db->key_size( key)) <= TREE_KEY_INLINE) )
+    {
+      memcpy( node->key_inline, key, size);
+      node->key = node->key_inline;
+      return 0;
+    }
+
+  node->key = db->key_copy( key);
+  return (node->key == NULL);
+}
+
+static void node_key_release( struct tree_db *db, struct tree_node *node)
+{
+  if( node->key != node->key_inline)
+    db->key_release( node->key);
+  node->key = NULL;
 }
 
 
@@ -211,6 +329,247 @@ struct tree_node *node_fix_up( struct tree_node *n)
 
 
 
+// Record ids let a record be found without searching the tree, by
+// indexing a shard's slot table directly.  The id holds both the shard
+// and the slot, with 0 never used.  A slot follows its record when
+// deleting moves the record to a different node.
+
+static void shard_slot_get( struct tree_db *db, struct tree_shard *shard,
+                            struct tree_node *node)
+{
+  uint32_t slot;
+
+  if( shard->free_number)
+    {
+      shard->free_number--;
+      slot = shard->free_slots[shard->free_number];
+    }
+  else
+    {
+      if( shard->slot_next == shard->slot_size)
+        {
+          struct tree_node **slots;
+          uint32_t *free_slots;
+          uint32_t size;
+
+          size = shard->slot_size ? 2 * shard->slot_size : 64;
+          slots = realloc( shard->slots, size * sizeof( struct tree_node *));
+          if( slots == NULL)
+            {
+              node->id = 0;
+              return;
+            }
+          shard->slots = slots;
+          free_slots = realloc( shard->free_slots, size * sizeof( uint32_t));
+          if( free_slots == NULL)
+            {
+              node->id = 0;
+              return;
+            }
+          shard->free_slots = free_slots;
+          shard->slot_size = size;
+        }
+      slot = shard->slot_next;
+      shard->slot_next++;
+    }
+
+  shard->slots[slot] = node;
+  node->id = slot * db->shard_number + shard->index + 1;
+}
+
+static void shard_slot_set( struct tree_db *db, struct tree_shard *shard,
+                            struct tree_node *node)
+{
+  if( node->id)
+    shard->slots[(node->id - 1) / db->shard_number] = node;
+}
+
+static void shard_slot_release( struct tree_db *db, struct tree_shard *shard,
+                                struct tree_node *node)
+{
+  uint32_t slot;
+
+  if( !node->id)
+    return;
+
+  slot = (node->id - 1) / db->shard_number;
+  shard->slots[slot] = NULL;
+  shard->free_slots[shard->free_number] = slot;
+  shard->free_number++;
+  node->id = 0;
+}
+
+
+// The hash index uses linear probing, and deletes by shifting entries
+// back, so there are no tombstones.  It is kept at most half full.  If
+// it can't grow, the shard drops it and goes back to using the tree.
+// Changed only with shard writer lock held.
+
+#define TREE_INDEX_MIN_BITS (6)
+
+// multiplying spreads out the bits, as the shard was picked from them
+static uint32_t shard_index_home( struct tree_shard *shard, uint32_t hash)
+{
+  return (hash * 2654435769U) >> shard->index_shift;
+}
+
+static void shard_index_insert( struct tree_shard *shard,
+                                struct tree_node *node)
+{
+  uint32_t pos, mask;
+
+  mask = shard->index_size - 1;
+  pos = shard_index_home( shard, node->hash);
+  while( shard->index_table[pos].node != NULL)
+    pos = (pos + 1) & mask;
+  shard->index_table[pos].hash = node->hash;
+  shard->index_table[pos].node = node;
+}
+
+// returns 1 on failure
+static int shard_index_resize( struct tree_shard *shard, int bits)
+{
+  struct tree_index_entry *old_table;
+  uint32_t old_size, i;
+
+  old_table = shard->index_table;
+  old_size = shard->index_size;
+
+  shard->index_table = calloc( 1U << bits, sizeof( struct tree_index_entry));
+  if( shard->index_table == NULL)
+    {
+      free( old_table);
+      shard->index_size = 0;
+      shard->index_number = 0;
+      return 1;
+    }
+  shard->index_size = 1U << bits;
+  shard->index_shift = 32 - bits;
+
+  for( i = 0; i < old_size; i++)
+    if( old_table[i].node != NULL)
+      shard_index_insert( shard, old_table[i].node);
+  free( old_table);
+
+  return 0;
+}
+
+static void shard_index_add( struct tree_db *db, struct tree_shard *shard,
+                             struct tree_node *node)
+{
+  if( shard->index_table == NULL)
+    return;
+
+  if( 2 * (shard->index_number + 1) > shard->index_size)
+    if( shard_index_resize( shard, 33 - shard->index_shift) )
+      return;
+
+  node->hash = db->key_hash( node->key);
+  shard_index_insert( shard, node);
+  shard->index_number++;
+}
+
+static uint32_t shard_index_pos( struct tree_shard *shard,
+                                 struct tree_node *node)
+{
+  uint32_t pos, mask;
+
+  mask = shard->index_size - 1;
+  pos = shard_index_home( shard, node->hash);
+  while( shard->index_table[pos].node != node)
+    pos = (pos + 1) & mask;
+
+  return pos;
+}
+
+static void shard_index_remove( struct tree_shard *shard,
+                                struct tree_node *node)
+{
+  struct tree_index_entry *table;
+  uint32_t i, j, k, mask;
+
+  if( shard->index_table == NULL)
+    return;
+
+  table = shard->index_table;
+  mask = shard->index_size - 1;
+  i = shard_index_pos( shard, node);
+  j = i;
+  while( 1)
+    {
+      j = (j + 1) & mask;
+      if( table[j].node == NULL)
+        break;
+      // move back entries that would no longer be found past the hole
+      k = shard_index_home( shard, table[j].hash);
+      if( (i <= j) ? ((k <= i) || (k > j)) : ((k <= i) && (k > j)) )
+        {
+          table[i] = table[j];
+          i = j;
+        }
+    }
+  table[i].node = NULL;
+  shard->index_number--;
+}
+
+// record moved from one node to another
+static void shard_index_move( struct tree_shard *shard,
+                              struct tree_node *from, struct tree_node *to)
+{
+  if( shard->index_table == NULL)
+    return;
+
+  to->hash = from->hash;
+  shard->index_table[ shard_index_pos( shard, from) ].node = to;
+}
+
+static struct tree_node *shard_node_find( struct tree_db *db,
+                                          struct tree_shard *shard,
+                                          void *key, uint32_t hash)
+{
+  struct tree_index_entry *entry;
+  struct tree_node *node;
+  uint32_t pos, mask;
+  int comp;
+
+  if( shard->index_table != NULL)
+    {
+      mask = shard->index_size - 1;
+      pos = shard_index_home( shard, hash);
+      while( (entry = &(shard->index_table[pos]))->node != NULL)
+        {
+          if( (entry->hash == hash) &&
+              !db->key_compare( key, entry->node->key) )
+            return entry->node;
+          pos = (pos + 1) & mask;
+        }
+      return NULL;
+    }
+
+  node = shard->tree->left;
+  while( node != NULL)
+    {
+      comp = db->key_compare( key, node->key);
+      if( !comp )
+        return node;
+      node = (comp < 0) ? node->left : node->right;
+    }
+
+  return NULL;
+}
+
+static void node_apply( struct tree_db *db, struct tree_node *node,
+                        void (* func)( void *, void *), void *arg )
+{
+  if(db->record_lock_flag)
+    pthread_mutex_lock(&(node->rec_mutex));
+  if( func != NULL)
+    func( node->values, arg);
+  if(db->record_lock_flag)
+    pthread_mutex_unlock(&(node->rec_mutex));
+}
+
+
 // returns 1 on success
 static int tree_find( struct tree_db *db, struct tree_node *node, void *key, 
                       void (* func)( void *, void *), void *arg )
@@ -223,11 +582,11 @@ static int tree_find( struct tree_db *db, struct tree_node *node, void *key,
       if( !comp )
         {
           if(db->record_lock_flag)
-            pthread_mutex_lock(node->rec_mutex);
+            pthread_mutex_lock(&(node->rec_mutex));
           if( func != NULL)
             func( node->values, arg);
           if(db->record_lock_flag)
-            pthread_mutex_unlock(node->rec_mutex);
+            pthread_mutex_unlock(&(node->rec_mutex));
           return 1;
         }
       if( comp < 0)
@@ -241,7 +600,8 @@ static int tree_find( struct tree_db *db, struct tree_node *node, void *key,
 
 
 static struct tree_node *tree_add_recursive
-( struct tree_db *db, struct tree_node *node, void *key, char *new_flag, 
+( struct tree_db *db, struct tree_shard *shard, struct tree_node *node, 
+  void *key, char *new_flag, 
   void *(* new_func)( void *), void *(* existing_func)( void *, void *), 
   void *arg)
 {
@@ -253,29 +613,30 @@ static struct tree_node *tree_add_recursive
     {
       // create entry
 
-      nptr = calloc( 1, sizeof( struct tree_node) );
-      nptr->key = db->key_copy( key);
+      nptr = shard_node_alloc( shard);
+      if( nptr == NULL)
+        return NULL;
+      if( node_key_set( db, nptr, key))
+        {
+          shard_node_free( shard, nptr);
+          return NULL;
+        }
       nptr->color = RED;
       nptr->left = NULL;
       nptr->right = NULL;
+      shard_slot_get( db, shard, nptr);
+      shard_index_add( db, shard, nptr);
 
       *new_flag = 1;
 
-      if(!db->record_lock_flag)
-        nptr->rec_mutex = NULL;
-      else
-        {
-          nptr->rec_mutex = malloc( sizeof(pthread_mutex_t));
-
-          // locking not REALLY needed here, as it's not part of DB yet
-          pthread_mutex_init(nptr->rec_mutex, NULL);
-          pthread_mutex_lock(nptr->rec_mutex);
-        }
+      // locking not REALLY needed here, as it's not part of DB yet
+      if(db->record_lock_flag)
+        pthread_mutex_lock(&(nptr->rec_mutex));
       
       nptr->values = new_func( arg);
 
       if(db->record_lock_flag)
-        pthread_mutex_unlock(nptr->rec_mutex);
+        pthread_mutex_unlock(&(nptr->rec_mutex));
 
       return nptr;
     }
@@ -290,7 +651,7 @@ static struct tree_node *tree_add_recursive
       // find should have eliminated this happening, 
       // but it could due to race condition
       if(db->record_lock_flag)
-        pthread_mutex_lock(node->rec_mutex);
+        pthread_mutex_lock(&(node->rec_mutex));
 
       // allow for reallocating the data, which shows up by non-NULL return
       r = existing_func( node->values, arg);
@@ -298,12 +659,12 @@ static struct tree_node *tree_add_recursive
         node->values = r;
       
       if(db->record_lock_flag)
-        pthread_mutex_unlock(node->rec_mutex);
+        pthread_mutex_unlock(&(node->rec_mutex));
       return node;
     }
 
-  nptr = tree_add_recursive( db, comp < 0 ? node->left : node->right, key, 
-                             new_flag, new_func, existing_func, arg );
+  nptr = tree_add_recursive( db, shard, comp < 0 ? node->left : node->right,
+                             key, new_flag, new_func, existing_func, arg );
   if( nptr == NULL)
     return NULL;
   if( comp < 0)
@@ -350,10 +711,10 @@ static void tree_multi_find( struct tree_db *db, struct tree_node *node,
   if( match)  // duplicates will disappear at this point
     {
       if(db->record_lock_flag)
-        pthread_mutex_lock(node->rec_mutex);
+        pthread_mutex_lock(&(node->rec_mutex));
       func( node->values, arg);
       if(db->record_lock_flag)
-        pthread_mutex_unlock(node->rec_mutex);
+        pthread_mutex_unlock(&(node->rec_mutex));
       index++;
     }  
   if( (index < number) && (node->right != NULL) )
@@ -369,10 +730,10 @@ static void tree_walk( struct tree_node *node, void (* func)( void *, void *),
     tree_walk( node->left, func, arg, record_lock_flag);
     
   if(record_lock_flag)
-    pthread_mutex_lock(node->rec_mutex);
+    pthread_mutex_lock(&(node->rec_mutex));
   func( node->values, arg);
   if(record_lock_flag)
-    pthread_mutex_unlock(node->rec_mutex);
+    pthread_mutex_unlock(&(node->rec_mutex));
     
   if( node->right != NULL)
     tree_walk( node->right, func, arg, record_lock_flag);
@@ -380,40 +741,115 @@ static void tree_walk( struct tree_node *node, void (* func)( void *, void *),
 
 
 
-static void tree_walk_delete( struct tree_node *node,
+
+// Walks all shards at once in key order, always taking the smallest
+// key among the shards next.  Trees are walked with explicit stacks,
+// which are deep enough for any LLRB tree that fits in memory.
+#define TREE_MAX_DEPTH (128)
+
+struct tree_iter
+{
+  int depth;
+  struct tree_node *stack[TREE_MAX_DEPTH];
+};
+
+static void tree_iter_push( struct tree_iter *iter, struct tree_node *node)
+{
+  while( node != NULL)
+    {
+      iter->stack[iter->depth] = node;
+      iter->depth++;
+      node = node->left;
+    }
+}
+
+static void shards_walk_merged( struct tree_db *db,
+                                void (* func)( void *, void *), void *arg)
+{
+  struct tree_iter *iters;
+  struct tree_node *node;
+  int i, min;
+
+  if( db->shard_number == 1)
+    {
+      if( db->shards[0].tree->left != NULL)
+        tree_walk( db->shards[0].tree->left, func, arg, db->record_lock_flag);
+      return;
+    }
+
+  iters = calloc( db->shard_number, sizeof( struct tree_iter) );
+  if( iters == NULL)
+    return;
+  for( i = 0; i < db->shard_number; i++)
+    tree_iter_push( &(iters[i]), db->shards[i].tree->left);
+
+  while( 1)
+    {
+      min = -1;
+      for( i = 0; i < db->shard_number; i++)
+        {
+          if( !iters[i].depth)
+            continue;
+          if( (min == -1) ||
+              (db->key_compare( iters[i].stack[iters[i].depth - 1]->key,
+                                iters[min].stack[iters[min].depth - 1]->key)
+               < 0) )
+            min = i;
+        }
+      if( min == -1)
+        break;
+
+      iters[min].depth--;
+      node = iters[min].stack[iters[min].depth];
+      tree_iter_push( &(iters[min]), node->right);
+
+      if(db->record_lock_flag)
+        pthread_mutex_lock(&(node->rec_mutex));
+      func( node->values, arg);
+      if(db->record_lock_flag)
+        pthread_mutex_unlock(&(node->rec_mutex));
+    }
+
+  free( iters);
+}
+
+
+static void tree_walk_delete( struct tree_db *db, struct tree_node *node,
                               int (* func)( void *, void *),
                               void *arg, int record_lock_flag,
                               struct key_link **deleted_list)
 {
   if( node->left != NULL)
-    tree_walk_delete( node->left, func, arg, record_lock_flag, deleted_list);
+    tree_walk_delete( db, node->left, func, arg, record_lock_flag,
+                      deleted_list);
     
   if(record_lock_flag)
-    pthread_mutex_lock(node->rec_mutex);
+    pthread_mutex_lock(&(node->rec_mutex));
   if( func( node->values, arg) )
     {
       struct key_link *new_key;
 
       new_key = malloc( sizeof(struct key_link) );
-      // we are using the node's key, as it can't change since everything
-      // is locked.  After we find the node to delete, we ignore it.
-      // No need to make a copy of key.
-      new_key->key = node->key;
+      // Deleting one record can move another to a different node, taking
+      // its key along, so a node's key can't be held onto.
+      new_key->key = db->key_copy( node->key);
 
       new_key->next = *deleted_list;
       *deleted_list = new_key;
     }
   if(record_lock_flag)
-    pthread_mutex_unlock(node->rec_mutex);
+    pthread_mutex_unlock(&(node->rec_mutex));
     
   if( node->right != NULL)
-    tree_walk_delete( node->right, func, arg, record_lock_flag, deleted_list);
+    tree_walk_delete( db, node->right, func, arg, record_lock_flag,
+                      deleted_list);
 }
 
 
 
 // func returns 1 if deleted, 0 if not deleted
 static struct tree_node *tree_delete( struct tree_db *db, 
+                                      struct tree_shard *shard,
                                       struct tree_node *node, void *key, 
                                       int (* func)( void *, void *), void *arg,
                                       int *success)
@@ -441,26 +877,31 @@ static struct tree_node *tree_delete( struct tree_db *db,
     return n;
   }
 
-  struct tree_node *node_grab_delete_min(struct tree_node *n, void **key,
-                                         void **values)
+  // the smallest record moves up to dest, taking its slot along
+  struct tree_node *node_grab_delete_min(struct tree_node *n,
+                                         struct tree_node *dest)
   {
     if( n->left == NULL)
       {
         // grab information
-        *key = n->key;
-        *values = n->values;
-
-        if( n->rec_mutex != NULL)
+        if( n->key == n->key_inline)
           {
-            pthread_mutex_destroy( n->rec_mutex);
-            free( n->rec_mutex);
+            memcpy( dest->key_inline, n->key_inline, TREE_KEY_INLINE);
+            dest->key = dest->key_inline;
           }
-        free(n);
+        else
+          dest->key = n->key;
+        dest->values = n->values;
+        dest->id = n->id;
+        shard_slot_set( db, shard, dest);
+        shard_index_move( shard, n, dest);
+
+        shard_node_free( shard, n);
         return NULL;
       }
     if( !node_is_red(n->left) && !node_is_red(n->left->left) )
       n = node_move_red_left(n);
-    n->left = node_grab_delete_min(n->left, key, values);
+    n->left = node_grab_delete_min(n->left, dest);
     return node_fix_up(n);
   }
 
@@ -477,7 +918,8 @@ static struct tree_node *tree_delete( struct tree_db *db,
     {
       if( !node_is_red(node->left) && !node_is_red(node->left->left) )
         node = node_move_red_left(node);
-      node->left = tree_delete(db, node->left, key, func, arg, success);
+      node->left = tree_delete(db, shard, node->left, key, func, arg, 
+                               success);
     }
   else
     {
@@ -492,13 +934,10 @@ static struct tree_node *tree_delete( struct tree_db *db,
           if( (func != NULL) && !func( (void *) node->values, arg) )  
             return node_fix_up(node);
           
-          db->key_release( node->key);
-          if( node->rec_mutex != NULL)
-            {
-              pthread_mutex_destroy( node->rec_mutex);
-              free( node->rec_mutex);
-            }
-          free( node);
+          node_key_release( db, node);
+          shard_slot_release( db, shard, node);
+          shard_index_remove( shard, node);
+          shard_node_free( shard, node);
 
           *success = 1;
 
@@ -512,15 +951,17 @@ static struct tree_node *tree_delete( struct tree_db *db,
         {
           if( (func != NULL) && !func( (void *) node->values, arg) )  // not deleted
             return node_fix_up(node);
-          db->key_release( node->key);
+          node_key_release( db, node);
+          shard_slot_release( db, shard, node);
+          shard_index_remove( shard, node);
 
           *success = 1;
 
-          node->right = node_grab_delete_min(node->right, &(node->key), 
-                                             &(node->values));
+          node->right = node_grab_delete_min(node->right, node);
         }
       else 
-        node->right = tree_delete(db, node->right, key, func, arg, success);
+        node->right = tree_delete(db, shard, node->right, key, func, arg, 
+                                  success);
     }
   return node_fix_up(node);
 }
@@ -529,65 +970,418 @@ static struct tree_node *tree_delete( struct tree_db *db,
 // These functions below are really just to coordinate locking
 
 
+// FNV-1a, for using strings as keys in sharded databases
+unsigned int db_string_hash( const void *key)
+{
+  const unsigned char *p;
+  unsigned int hash;
+
+  hash = 2166136261U;
+  for( p = key; *p != '\0'; p++)
+    {
+      hash ^= *p;
+      hash *= 16777619U;
+    }
+
+  return hash;
+}
+
+
+size_t db_string_size( const void *key)
+{
+  return strlen( key) + 1;
+}
+
+
+static struct tree_shard *db_shard( struct tree_db *db, const void *key)
+{
+  if( db->shard_number == 1)
+    return db->shards;
+  return &(db->shards[ db->key_hash( key) % db->shard_number ]);
+}
+
+// same, but also gives hash for the index, hashing at most once
+static struct tree_shard *db_shard_hash( struct tree_db *db, const void *key,
+                                         uint32_t *hash)
+{
+  if( (db->shard_number == 1) && (db->shards[0].index_table == NULL) )
+    {
+      *hash = 0;
+      return db->shards;
+    }
+  *hash = db->key_hash( key);
+  return &(db->shards[ *hash % db->shard_number ]);
+}
+
+// shards are always locked in index order
+static void db_lock_all_readers( struct tree_db *db)
+{
+  int i;
+
+  for( i = 0; i < db->shard_number; i++)
+    worm_lock_reader(&(db->shards[i].worm_mutex));
+}
+
+static void db_unlock_all_readers( struct tree_db *db)
+{
+  int i;
+
+  for( i = db->shard_number - 1; i >= 0; i--)
+    worm_unlock_reader(&(db->shards[i].worm_mutex));
+}
+
+static int db_number( struct tree_db *db)
+{
+  int i, number;
+
+  number = 0;
+  for( i = 0; i < db->shard_number; i++)
+    number += db->shards[i].number;
+
+  return number;
+}
+
+
 // if just seeing if in db, can pass a NULL function
-int db_find( struct tree_db *db, void *key, void (* func)( void *, void *), 
+int db_find( struct tree_db *db, void *key, void (* func)( void *, void *),
              void *arg)
 {
-  int ret;
+  struct tree_shard *shard;
+  struct tree_node *node;
+  uint32_t hash;
+
+  shard = db_shard_hash( db, key, &hash);
+  if( shard->tree->left == NULL)
+    return 0;
+
+  worm_lock_reader(&(shard->worm_mutex));
+  node = shard_node_find( db, shard, key, hash);
+  if( node != NULL)
+    node_apply( db, node, func, arg);
+  worm_unlock_reader(&(shard->worm_mutex));
+
+  return (node != NULL);
+}
+
+// Finds by record id, but the key still has to match, so a stale id
+// just fails.  Returns 1 on success.
+int db_find_id( struct tree_db *db, uint32_t id, void *key,
+                void (* func)( void *, void *), void *arg)
+{
+  struct tree_shard *shard;
+  struct tree_node *node;
+  uint32_t slot;
+  int ret = 0;
 
-  if( db->tree->left == NULL)
+  if( !id)
     return 0;
+  shard = &(db->shards[ (id - 1) % db->shard_number ]);
+  slot = (id - 1) / db->shard_number;
 
-  worm_lock_reader(&(db->worm_mutex));
-  ret = tree_find( db, db->tree->left, key, func, arg);
-  worm_unlock_reader(&(db->worm_mutex));
+  worm_lock_reader(&(shard->worm_mutex));
+  if( (slot < shard->slot_next) && ((node = shard->slots[slot]) != NULL) &&
+      !db->key_compare( key, node->key) )
+    {
+      if(db->record_lock_flag)
+        pthread_mutex_lock(&(node->rec_mutex));
+      if( func != NULL)
+        func( node->values, arg);
+      if(db->record_lock_flag)
+        pthread_mutex_unlock(&(node->rec_mutex));
+      ret = 1;
+    }
+  worm_unlock_reader(&(shard->worm_mutex));
 
   return ret;
 }
 
+// returns record id of key, 0 if not found
+uint32_t db_key_id( struct tree_db *db, void *key)
+{
+  struct tree_shard *shard;
+  struct tree_node *node;
+  uint32_t hash;
+  uint32_t id = 0;
+
+  shard = db_shard_hash( db, key, &hash);
+
+  worm_lock_reader(&(shard->worm_mutex));
+  node = shard_node_find( db, shard, key, hash);
+  if( node != NULL)
+    id = node->id;
+  worm_unlock_reader(&(shard->worm_mutex));
+
+  return id;
+}
+
 // if just seeing if in db, can pass a NULL func function
-int db_find_init( struct tree_db *db, void *key, void (* init)( void *, int), 
+int db_find_init( struct tree_db *db, void *key, void (* init)( void *, int),
                   void (* func)( void *, void *), void *arg)
 {
-  int ret = 0;
+  struct tree_shard *shard;
+  struct tree_node *node;
+  uint32_t hash;
 
-  worm_lock_reader(&(db->worm_mutex));
-  init( arg, db->number);
-  if( db->tree->left != NULL)
-    ret = tree_find( db, db->tree->left, key, func, arg);
-  worm_unlock_reader(&(db->worm_mutex));
+  shard = db_shard_hash( db, key, &hash);
 
-  return ret;
+  worm_lock_reader(&(shard->worm_mutex));
+  // other shards aren't locked, so total is only a snapshot
+  init( arg, db_number( db));
+  node = shard_node_find( db, shard, key, hash);
+  if( node != NULL)
+    node_apply( db, node, func, arg);
+  worm_unlock_reader(&(shard->worm_mutex));
+
+  return (node != NULL);
 }
 
 // returns 1 if there was an unresolvable conflict
 // new function accepts new data
 // existing function accepts old data and new data, to hash it out
-int db_add( struct tree_db *db, void *key, void *(* new_func)( void *), 
+int db_add( struct tree_db *db, void *key, void *(* new_func)( void *),
             void *(* existing_func)( void *, void *), void *arg)
 {
+  struct tree_shard *shard;
   struct tree_node *dbptr;
   char new_flag;
 
   new_flag = 0;
 
-  worm_lock_writer(&(db->worm_mutex));
-  dbptr = tree_add_recursive( db, db->tree->left, key, &new_flag, 
+  shard = db_shard( db, key);
+
+  worm_lock_writer(&(shard->worm_mutex));
+  dbptr = tree_add_recursive( db, shard, shard->tree->left, key, &new_flag,
                               new_func, existing_func, arg);
   if( dbptr == NULL)
     {
-      worm_unlock_writer(&(db->worm_mutex));
+      worm_unlock_writer(&(shard->worm_mutex));
       return 1;
     }
   dbptr->color = BLACK;
-  db->tree->left = dbptr;
+  shard->tree->left = dbptr;
   if( new_flag)
-    db->number++;
-  worm_unlock_writer(&(db->worm_mutex));
+    shard->number++;
+  worm_unlock_writer(&(shard->worm_mutex));
+
+  return 0;
+}
+
+
+// Bulk loading sorts the records of each shard, then links them into a
+// balanced tree in one pass.  Seen as a 2-3 tree, every leaf is at the
+// same depth, and keys are shared out as evenly as allowed between
+// 2-nodes and 3-nodes; a 3-node is a black node with a red left child.
+
+struct bulk_entry
+{
+  void *key;
+  void *value;
+  uint32_t shard;
+};
+
+static int bulk_entry_compare( const void *p1, const void *p2, void *arg)
+{
+  const struct bulk_entry *a = p1, *b = p2;
+  struct tree_db *db = arg;
+
+  if( a->shard != b->shard)
+    return (a->shard < b->shard) ? -1 : 1;
+  return db->key_compare( a->key, b->key);
+}
+
+// most keys in a 2-3 tree of this height, 3^height - 1
+static uint64_t tree_build_most( int height)
+{
+  uint64_t most;
+
+  most = 1;
+  while( height-- > 0)
+    most *= 3;
+  return most - 1;
+}
+
+// nodes are in key order, and their number fits the height
+static struct tree_node *tree_build( struct tree_node **nodes,
+                                     uint32_t number, int height)
+{
+  struct tree_node *node, *red;
+  uint32_t a, b, c;
+
+  if( !number)
+    return NULL;
+
+  if( number - 1 <= 2 * tree_build_most( height - 1))
+    {
+      a = (number - 1) / 2;
+      node = nodes[a];
+      node->color = BLACK;
+      node->left = tree_build( nodes, a, height - 1);
+      node->right = tree_build( nodes + a + 1, number - 1 - a, height - 1);
+      return node;
+    }
+
+  a = (number - 2) / 3;
+  b = (number - 2 - a) / 2;
+  c = number - 2 - a - b;
+  red = nodes[a];
+  red->color = RED;
+  red->left = tree_build( nodes, a, height - 1);
+  red->right = tree_build( nodes + a + 1, b, height - 1);
+  node = nodes[a + 1 + b];
+  node->color = BLACK;
+  node->left = red;
+  node->right = tree_build( nodes + a + b + 2, c, height - 1);
+  return node;
+}
+
+// builds tree of empty shard from sorted entries, returns 1 on failure
+static int shard_bulk_build( struct tree_db *db, struct tree_shard *shard,
+                             struct bulk_entry *entries, uint32_t number)
+{
+  struct tree_node **nodes;
+  uint32_t i;
+  int bits, height;
+
+  nodes = malloc( number * sizeof( struct tree_node *));
+  if( nodes == NULL)
+    return 1;
+
+  // index made big enough up front, instead of doubling along the way
+  if( shard->index_table != NULL)
+    {
+      bits = 32 - shard->index_shift;
+      while( 2 * (shard->index_number + number) > (1U << bits))
+        bits++;
+      if( bits != 32 - shard->index_shift)
+        shard_index_resize( shard, bits);
+    }
+
+  for( i = 0; i < number; i++)
+    {
+      nodes[i] = shard_node_alloc( shard);
+      if( (nodes[i] == NULL) || node_key_set( db, nodes[i], entries[i].key))
+        {
+          if( nodes[i] != NULL)
+            shard_node_free( shard, nodes[i]);
+          while( i-- > 0)
+            {
+              node_key_release( db, nodes[i]);
+              shard_node_free( shard, nodes[i]);
+            }
+          free( nodes);
+          return 1;
+        }
+    }
+
+  for( i = 0; i < number; i++)
+    {
+      nodes[i]->values = entries[i].value;
+      shard_slot_get( db, shard, nodes[i]);
+      shard_index_add( db, shard, nodes[i]);
+    }
+
+  // black height that has room for them all
+  height = 0;
+  while( (2ULL << height) - 1 <= number)
+    height++;
+  shard->tree->left = tree_build( nodes, number, height);
+  shard->number += number;
 
+  free( nodes);
   return 0;
 }
 
+static void *bulk_value( void *value)
+{
+  return value;
+}
+
+// Adds records in one go, much faster than one by one for an empty
+// database.  Keys are copied as with db_add().  A value whose key is
+// already in the database is given to existing_func with the old value,
+// as with db_add(), and is then its to keep or free.  Values of records
+// that couldn't be added, of keys repeated in the list, or of keys
+// already there when existing_func is NULL, are given to discard_func.
+// Returns number added.
+int db_bulk_load( struct tree_db *db, int number, void **keys, void **values,
+                  void *(* existing_func)( void *, void *),
+                  void (* discard_func)( void *))
+{
+  struct bulk_entry *entries;
+  struct tree_shard *shard;
+  struct tree_node *dbptr;
+  char new_flag;
+  int start, end, unique;
+  int added;
+  int i;
+
+  entries = malloc( number * sizeof( struct bulk_entry));
+  if( entries == NULL)
+    {
+      for( i = 0; i < number; i++)
+        discard_func( values[i]);
+      return 0;
+    }
+  for( i = 0; i < number; i++)
+    {
+      entries[i].key = keys[i];
+      entries[i].value = values[i];
+      entries[i].shard = db_shard( db, keys[i])->index;
+    }
+  qsort_r( entries, number, sizeof( struct bulk_entry), bulk_entry_compare,
+           db);
+
+  added = 0;
+  for( start = 0; start < number; start = end)
+    {
+      shard = &(db->shards[entries[start].shard]);
+
+      // only one of any repeated key is kept
+      unique = start + 1;
+      for( end = start + 1; (end < number) &&
+             (entries[end].shard == entries[start].shard); end++)
+        {
+          if( !db->key_compare( entries[end].key, entries[unique - 1].key))
+            discard_func( entries[end].value);
+          else
+            entries[unique++] = entries[end];
+        }
+
+      worm_lock_writer(&(shard->worm_mutex));
+      if( (shard->tree->left == NULL) &&
+          !shard_bulk_build( db, shard, entries + start, unique - start) )
+        added += unique - start;
+      else
+        {
+          // already has records, so they go in the usual way
+          for( i = start; i < unique; i++)
+            {
+              new_flag = 0;
+              dbptr = tree_add_recursive( db, shard, shard->tree->left,
+                                          entries[i].key, &new_flag,
+                                          bulk_value, existing_func,
+                                          entries[i].value);
+              if( dbptr != NULL)
+                {
+                  dbptr->color = BLACK;
+                  shard->tree->left = dbptr;
+                }
+              if( new_flag)
+                {
+                  shard->number++;
+                  added++;
+                }
+              else if( (dbptr == NULL) || (existing_func == NULL) )
+                discard_func( entries[i].value);
+            }
+        }
+      worm_unlock_writer(&(shard->worm_mutex));
+    }
+
+  free( entries);
+  return added;
+}
+
 
 
 struct key_sorter_struct
@@ -598,27 +1392,56 @@ struct key_sorter_struct
 int key_sorter(const void *p1, const void *p2, void *arg)
 {
   struct key_sorter_struct *kss;
-  
+
   kss = arg;
 
   return kss->key_sort_func(* (void * const *) p1, * (void * const *) p2);
 }
 
 
+// keys must be sorted, and all shards locked
+static void shards_multi_find( struct tree_db *db, int number, void **keys,
+                               void (* func)( void *, void *), void *arg)
+{
+  struct tree_shard *shard;
+  struct tree_node *node;
+  uint32_t hash;
+  int i;
+
+  if( (db->shard_number == 1) && (db->shards[0].index_table == NULL) )
+    {
+      if( db->shards[0].tree->left != NULL)
+        tree_multi_find( db, db->shards[0].tree->left, number, keys,
+                         func, arg );
+      return;
+    }
+
+  // keys in different shards (or indexed), so find them one at a time
+  for( i = 0; i < number; i++)
+    {
+      // duplicates are skipped
+      if( (i > 0) && !db->key_compare( keys[i-1], keys[i]) )
+        continue;
+      shard = db_shard_hash( db, keys[i], &hash);
+      if( (node = shard_node_find( db, shard, keys[i], hash)) != NULL)
+        node_apply( db, node, func, arg);
+    }
+}
+
 void db_multi_find( struct tree_db *db, int number, void **keys,
                     void (* func)( void *, void *), void *arg)
 {
   struct key_sorter_struct kss;
 
-  if( db->tree->left == NULL)
+  if( !db_number( db) )
     return;
-  
+
   kss.key_sort_func = db->key_compare;
   qsort_r( (void *) keys, number, sizeof( void *), key_sorter, (void *) &kss);
 
-  worm_lock_reader(&(db->worm_mutex));
-  tree_multi_find( db, db->tree->left, number, keys, func, arg );
-  worm_unlock_reader(&(db->worm_mutex));
+  db_lock_all_readers( db);
+  shards_multi_find( db, number, keys, func, arg );
+  db_unlock_all_readers( db);
 }
 
 void db_multi_find_init( struct tree_db *db, int number, void **keys,
@@ -626,100 +1449,168 @@ void db_multi_find_init( struct tree_db *db, int number, void **keys,
                          void (* func)( void *, void *), void *arg)
 {
   struct key_sorter_struct kss;
-  
+
   kss.key_sort_func = db->key_compare;
   qsort_r( (void *) keys, number, sizeof( void *), key_sorter, (void *) &kss);
 
-  worm_lock_reader(&(db->worm_mutex));
-  init( arg, db->number);
-  if( db->tree->left != NULL)
-    tree_multi_find( db, db->tree->left, number, keys, func, arg );
-  worm_unlock_reader(&(db->worm_mutex));
+  db_lock_all_readers( db);
+  init( arg, db_number( db));
+  shards_multi_find( db, number, keys, func, arg );
+  db_unlock_all_readers( db);
 }
- 
 
+
+// Goes through one shard at a time, so entries are only in key order
+// within each shard.
 void db_walk( struct tree_db *db, void (* func)( void *, void *), void *arg )
 {
-  if( db->tree->left == NULL)
-    return;
+  struct tree_shard *shard;
+  int i;
 
-  worm_lock_reader(&(db->worm_mutex));
-  tree_walk( db->tree->left, func, arg, db->record_lock_flag );
-  worm_unlock_reader(&(db->worm_mutex));
+  for( i = 0; i < db->shard_number; i++)
+    {
+      shard = &(db->shards[i]);
+      if( shard->tree->left == NULL)
+        continue;
+
+      worm_lock_reader(&(shard->worm_mutex));
+      if( shard->tree->left != NULL)
+        tree_walk( shard->tree->left, func, arg, db->record_lock_flag );
+      worm_unlock_reader(&(shard->worm_mutex));
+    }
 }
 
 
 // Red-black trees are very annoying to delete from.
 // Best strategy is to record what nodes to delete, then remove
 // them one by one so the tree doesn't get screwed up.
-// This locks down the entire database for entire process.
+// This locks down each shard in turn for the entire process.
 void db_walk_delete( struct tree_db *db, int (* func)( void *, void *),
                      void *arg )
 {
+  struct tree_shard *shard;
   struct key_link *deleted_list = NULL, *dn;
   int success;
-  
-  if( db->tree->left == NULL)
-    return;
+  int i;
 
-  worm_lock_writer(&(db->worm_mutex));
-  tree_walk_delete( db->tree->left, func, arg, db->record_lock_flag,
-                    &deleted_list );
-  
-  while( deleted_list != NULL)
+  for( i = 0; i < db->shard_number; i++)
     {
-      success = 0;  // this should always get changed to 1
-      db->tree->left = tree_delete( db, db->tree->left,
-                                    deleted_list->key, NULL, NULL, &success);
-      if( success)
-        db->number--;
+      shard = &(db->shards[i]);
+      if( shard->tree->left == NULL)
+        continue;
+
+      worm_lock_writer(&(shard->worm_mutex));
+      if( shard->tree->left != NULL)
+        tree_walk_delete( db, shard->tree->left, func, arg,
+                          db->record_lock_flag, &deleted_list );
+
+      while( deleted_list != NULL)
+        {
+          success = 0;  // this should always get changed to 1
+          shard->tree->left = tree_delete( db, shard, shard->tree->left,
+                                           deleted_list->key, NULL, NULL,
+                                           &success);
+          if( success)
+            shard->number--;
+
+          dn = deleted_list->next;
+          db->key_release( deleted_list->key);
+          free( deleted_list);
+          deleted_list = dn;
+        }
 
-      dn = deleted_list->next;
-      free( deleted_list);
-      deleted_list = dn;
+      worm_unlock_writer(&(shard->worm_mutex));
     }
-  
-  worm_unlock_writer(&(db->worm_mutex));
 }
 
 
+// all shards are held, so the entries are in key order
 void db_walk_init( struct tree_db *db, void (* init)( void *, int),
                    void (* func)( void *, void *), void *arg )
 {
-  worm_lock_reader(&(db->worm_mutex));
-  init( arg, db->number);
-  if( db->tree->left != NULL)
-    tree_walk( db->tree->left, func, arg, db->record_lock_flag );
-  worm_unlock_reader(&(db->worm_mutex));
+  db_lock_all_readers( db);
+  init( arg, db_number( db));
+  shards_walk_merged( db, func, arg);
+  db_unlock_all_readers( db);
 }
 
 
 
-int db_delete( struct tree_db *db, void *key, int (* func)( void *, void *), 
+int db_delete( struct tree_db *db, void *key, int (* func)( void *, void *),
                void *arg)
 {
+  struct tree_shard *shard;
   int success = 0;
 
-  if( db->tree->left == NULL)
+  shard = db_shard( db, key);
+  if( shard->tree->left == NULL)
     return 0;
 
-  worm_lock_writer(&(db->worm_mutex));
-  db->tree->left = tree_delete( db, db->tree->left, key, func, arg, &success);
+  worm_lock_writer(&(shard->worm_mutex));
+  if( shard->tree->left != NULL)
+    shard->tree->left = tree_delete( db, shard, shard->tree->left, key, 
+                                     func, arg, &success);
   if( success)
-    db->number--;
-  worm_unlock_writer(&(db->worm_mutex));
-  
+    shard->number--;
+  worm_unlock_writer(&(shard->worm_mutex));
+
   return success;
 }
 
 
 
-struct tree_db *db_create(void *(* key_copy)( void *), 
+void db_inline_keys( struct tree_db *db, size_t (* key_size)( const void *))
+{
+  db->key_size = key_size;
+}
+
+
+int db_hash_index( struct tree_db *db)
+{
+  int i;
+
+  if( db->key_hash == NULL)
+    return 1;
+
+  for( i = 0; i < db->shard_number; i++)
+    if( shard_index_resize( &(db->shards[i]), TREE_INDEX_MIN_BITS) )
+      {
+        while( i--)
+          {
+            free( db->shards[i].index_table);
+            db->shards[i].index_table = NULL;
+            db->shards[i].index_size = 0;
+          }
+        return 1;
+      }
+
+  return 0;
+}
+
+
+struct tree_db *db_create(void *(* key_copy)( void *),
                           void (* key_release)( void *),
                           int (* key_compare)( const void *, const void *),
                           int auto_lock_records)
+{
+  return db_create_sharded( key_copy, key_release, key_compare,
+                            auto_lock_records, NULL, 1);
+}
+
+// key_hash can be NULL if there is only one shard
+struct tree_db *db_create_sharded(void *(* key_copy)( void *),
+                                  void (* key_release)( void *),
+                                  int (* key_compare)( const void *,
+                                                       const void *),
+                                  int auto_lock_records,
+                                  unsigned int (* key_hash)( const void *),
+                                  int shard_number)
 {
   struct tree_db *db;
+  int i;
+
+  if( (shard_number < 1) || ((shard_number > 1) && (key_hash == NULL)) )
+    return NULL;
 
   db = calloc( 1, sizeof( struct tree_db) );
   if( db == NULL)
@@ -730,18 +1621,36 @@ struct tree_db *db_create(void *(* key_copy)( void *),
   else
     db->record_lock_flag = 1;
 
-  db->number = 0;
   db->key_copy = key_copy;
   db->key_release = key_release;
   db->key_compare = key_compare;
-  db->tree = tree_create();
-  if( db->tree == NULL)
+  db->key_hash = key_hash;
+  db->shard_number = shard_number;
+  db->shards = calloc( shard_number, sizeof( struct tree_shard) );
+  if( db->shards == NULL)
     {
       free(db);
       return NULL;
     }
+  for( i = 0; i < shard_number; i++)
+    {
+      db->shards[i].index = i;
+      db->shards[i].number = 0;
+      db->shards[i].tree = tree_create();
+      if( db->shards[i].tree == NULL)
+        {
+          while( i--)
+            {
+              free( db->shards[i].tree);
+              worm_clear( &(db->shards[i].worm_mutex));
+            }
+          free( db->shards);
+          free(db);
+          return NULL;
+        }
 
-  worm_init( &(db->worm_mutex));
+      worm_init( &(db->shards[i].worm_mutex));
+    }
 
   return db;
 }
@@ -749,18 +1658,29 @@ struct tree_db *db_create(void *(* key_copy)( void *),
 
 void db_destroy(struct tree_db *db, void (* func)( void *, void *), void *arg )
 {
-  worm_lock_writer(&(db->worm_mutex));
-  db->number = 0;
-  tree_destroy( db, func, arg);
-  worm_unlock_writer(&(db->worm_mutex));
-  worm_clear(&(db->worm_mutex));
+  struct tree_shard *shard;
+  int i;
+
+  for( i = 0; i < db->shard_number; i++)
+    {
+      shard = &(db->shards[i]);
+      worm_lock_writer(&(shard->worm_mutex));
+      shard->number = 0;
+      tree_destroy( db, shard->tree, func, arg);
+      shard_nodes_destroy( shard);
+      free( shard->index_table);
+      free( shard->slots);
+      free( shard->free_slots);
+      worm_unlock_writer(&(shard->worm_mutex));
+      worm_clear(&(shard->worm_mutex));
+    }
+  free( db->shards);
   free( db);
 }
 
 
 int db_count( struct tree_db *db)
 {
-  return db->number;
+  return db_number( db);
 }
 
-
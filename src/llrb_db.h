@@ -12,6 +12,8 @@
 #ifndef LLRB_DB_H
 #define LLRB_DB_H 1
 
+#include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
 
 #include "gentypes.h"
@@ -21,14 +23,57 @@
 
 enum { BLACK, RED };
 
+// keys up to this size (like IOC names) are kept in the node
+#define TREE_KEY_INLINE (64)
+
+// Fields used in searching come first, so a lookup stays in the first
+// cache lines of each node.
 struct tree_node
 {
-  char  color;    // 0:black, 1:red
-  pthread_mutex_t *rec_mutex; 
-  void *key;     // pointer to key
-  void *values;     // pointer to data or function
+  void *key;     // pointer to key, which can be key_inline
   struct tree_node *left;
   struct tree_node *right;
+  char  color;    // 0:black, 1:red
+  uint32_t id;      // record id, 0 if none
+  uint32_t hash;    // key hash, if db has a hash index
+  char key_inline[TREE_KEY_INLINE];
+  void *values;     // pointer to data or function
+  pthread_mutex_t rec_mutex; 
+};
+
+// nodes are handed out from chunks, kept per shard
+struct tree_node_chunk;
+
+// hash index entry, pointing at the same node as the tree
+struct tree_index_entry
+{
+  uint32_t hash;
+  struct tree_node *node;   // NULL if empty
+};
+
+// each shard is an independently locked tree
+struct tree_shard
+{
+  int index;
+  int number;
+  struct tree_node *tree;
+  struct worm_mutex_struct worm_mutex; 
+
+  // record id slots, pointing to nodes
+  uint32_t slot_size;
+  uint32_t slot_next;   // slots past here never used
+  struct tree_node **slots;
+  uint32_t free_number;
+  uint32_t *free_slots;
+
+  struct tree_node_chunk *node_chunks;
+  struct tree_node *node_free;
+
+  // open addressing hash index, NULL if not used
+  struct tree_index_entry *index_table;
+  uint32_t index_size;   // power of two
+  uint32_t index_number;
+  int index_shift;
 };
 
 struct tree_db
@@ -38,9 +83,10 @@ struct tree_db
   void *(* key_copy)( void *);
   void (* key_release)( void *);
   int (* key_compare)( const void *, const void *); // key comparison function
-  int number;
-  struct tree_node *tree;
-  struct worm_mutex_struct worm_mutex; 
+  unsigned int (* key_hash)( const void *); // picks shard, NULL if one shard
+  size_t (* key_size)( const void *); // for inline keys, NULL if never
+  int shard_number;
+  struct tree_shard *shards;
 };
 
 ///////////////////////////
@@ -49,8 +95,27 @@ struct tree_db *db_create(void *(* key_copy)( void *),
                           void (* key_release)( void *),
                           int (* key_compare)( const void *, const void *),
                           int auto_lock_records);
+struct tree_db *db_create_sharded(void *(* key_copy)( void *), 
+                                  void (* key_release)( void *),
+                                  int (* key_compare)( const void *, 
+                                                       const void *),
+                                  int auto_lock_records,
+                                  unsigned int (* key_hash)( const void *),
+                                  int shard_number);
+unsigned int db_string_hash( const void *key);
+// keys that fit are copied into the nodes, done before adding anything
+void db_inline_keys( struct tree_db *db, size_t (* key_size)( const void *));
+// point lookups use a hash index instead of the tree, needs key_hash,
+// done before adding anything; returns 1 on failure
+int db_hash_index( struct tree_db *db);
+size_t db_string_size( const void *key);
+
 int db_add( struct tree_db *db, void *key, void *(* new_func)( void *), 
             void *(* existing_func)( void *, void *), void *arg);
+// sorts and builds each shard's tree at once; returns number added
+int db_bulk_load( struct tree_db *db, int number, void **keys, void **values,
+                  void *(* existing_func)( void *, void *),
+                  void (* discard_func)( void *));
 
 void db_walk( struct tree_db *db, void (* func)( void *, void *), void *arg );
 void db_walk_init( struct tree_db *db, void (* init)( void *, int),
@@ -60,6 +125,9 @@ int db_find( struct tree_db *db, void *key, void (* func)( void *, void *),
              void *arg );
 int db_find_init( struct tree_db *db, void *key, void (* init)( void *, int), 
                   void (* func)( void *, void *), void *arg);
+int db_find_id( struct tree_db *db, uint32_t id, void *key,
+                void (* func)( void *, void *), void *arg);
+uint32_t db_key_id( struct tree_db *db, void *key);
 
 void db_multi_find( struct tree_db *db, int number, void **keys,
                     void (* func)( void *, void *), void *arg);
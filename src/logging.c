@@ -15,9 +15,13 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <pthread.h>
+#include <sys/uio.h>
 
 
 #include "alived.h"
@@ -30,38 +34,324 @@ extern struct alived_config config;
 
 /////////////////////////////////////////////////
 
-int log_flag = 1;
-pthread_mutex_t log_lock;
-char *log_name;
+/*
+  Log and debug messages are formatted straight into the slots of a
+  ring buffer, so that a caller does no file calls and takes no lock.
+  A single writer thread keeps the files open, copies out whatever has
+  built up, and flushes once for each batch.
+
+  The ring is a bounded multi-producer queue.  A producer claims a
+  position by moving the head forward, and each slot's sequence number
+  tells whether it is free for that position (equal to it), or holds a
+  finished message (one past it).  If the ring is full, the message is
+  dropped and counted instead of making the caller wait, and the writer
+  notes the count in the file.  Messages longer than a slot are cut short.
+
+  The files get reopened with log_reopen(), so they can be rotated.
+*/
 
+#define LOG_RING_SLOTS (1024)  // must be power of two
+#define LOG_SLOT_SIZE (256)
 
-void log_init(char *name)
+struct log_slot
 {
-  log_name = strdup(name);
-  pthread_mutex_init(&log_lock, NULL);
-}
+  uint32_t sequence;
+  uint32_t length;
+  char text[LOG_SLOT_SIZE];
+};
 
-void log_write(  char *fmt, ...)
+struct log_stream
 {
+  char *name;
   FILE *fptr;
-  va_list args;
+  int timestamp;
+  struct log_slot *ring;  // set last, once the stream is ready
+
+  uint32_t head;  // next position for producers
+  uint32_t tail;  // next position for the writer
+  uint32_t dropped;
+};
+
+static struct
+{
+  pthread_once_t once;
+  pthread_mutex_t lock;
+  pthread_cond_t c_work;  // writer waits on this
+  pthread_cond_t c_done;  // log_flush waits on this
+  int sleeping;
+  int reopen;
+} log_writer = { PTHREAD_ONCE_INIT, PTHREAD_MUTEX_INITIALIZER,
+                 PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static struct log_stream log_stream;
+static struct log_stream debug_stream;
+
+
+static void log_writer_wake( void)
+{
+  pthread_mutex_lock( &(log_writer.lock));
+  pthread_cond_signal( &(log_writer.c_work));
+  pthread_mutex_unlock( &(log_writer.lock));
+}
+
+
+static void stream_write( struct log_stream *ls, char *fmt, va_list args)
+{
+  struct log_slot *ring;
+  struct log_slot *slot;
+  uint32_t pos;
+  uint32_t seq;
+  int32_t diff;
+  int len, cnt;
 
   char time_str[32];
 
-  if( !log_flag)
+  ring = __atomic_load_n( &(ls->ring), __ATOMIC_ACQUIRE);
+  if( ring == NULL)
+    return;
+
+  pos = __atomic_load_n( &(ls->head), __ATOMIC_RELAXED);
+  while( 1)
+    {
+      slot = &(ring[pos & (LOG_RING_SLOTS - 1)]);
+      seq = __atomic_load_n( &(slot->sequence), __ATOMIC_ACQUIRE);
+      diff = (int32_t) (seq - pos);
+      if( diff == 0)
+        {
+          // a failed exchange loads the new head into pos
+          if( __atomic_compare_exchange_n( &(ls->head), &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED) )
+            break;
+        }
+      else if( diff < 0)
+        {
+          // writer hasn't emptied this slot yet, so ring is full
+          __atomic_add_fetch( &(ls->dropped), 1, __ATOMIC_RELAXED);
+          return;
+        }
+      else
+        pos = __atomic_load_n( &(ls->head), __ATOMIC_RELAXED);
+    }
+
+  len = 0;
+  if( ls->timestamp)
+    len = sprintf( slot->text, "[%s] ",
+                   time_to_string( time_str, time(NULL)));
+  cnt = vsnprintf( slot->text + len, LOG_SLOT_SIZE - len, fmt, args);
+  if( cnt > 0)
+    len += cnt;
+  if( len >= LOG_SLOT_SIZE)
+    {
+      // keep a cut message on its own line
+      len = LOG_SLOT_SIZE - 1;
+      slot->text[len - 1] = '\n';
+    }
+  slot->length = len;
+
+  // paired with the writer setting sleeping, then checking the ring
+  __atomic_store_n( &(slot->sequence), pos + 1, __ATOMIC_SEQ_CST);
+  if( __atomic_load_n( &(log_writer.sleeping), __ATOMIC_SEQ_CST))
+    log_writer_wake();
+}
+
+
+static int stream_ready( struct log_stream *ls)
+{
+  struct log_slot *ring;
+  uint32_t pos;
+
+  ring = __atomic_load_n( &(ls->ring), __ATOMIC_ACQUIRE);
+  if( ring == NULL)
+    return 0;
+  pos = ls->tail;
+  return __atomic_load_n( &(ring[pos & (LOG_RING_SLOTS - 1)].sequence),
+                          __ATOMIC_SEQ_CST) == pos + 1;
+}
+
+
+// returns number of messages written
+static int stream_drain( struct log_stream *ls)
+{
+  struct log_slot *ring;
+  struct log_slot *slot;
+  uint32_t pos;
+  uint32_t dropped;
+  int count;
+
+  char time_str[32];
+
+  ring = __atomic_load_n( &(ls->ring), __ATOMIC_ACQUIRE);
+  if( ring == NULL)
+    return 0;
+
+  // the file is tried again if it couldn't be opened before
+  if( ls->fptr == NULL)
+    ls->fptr = fopen( ls->name, "a");
+
+  count = 0;
+  pos = ls->tail;
+  while( 1)
+    {
+      slot = &(ring[pos & (LOG_RING_SLOTS - 1)]);
+      if( __atomic_load_n( &(slot->sequence), __ATOMIC_ACQUIRE) != pos + 1)
+        break;
+      if( ls->fptr != NULL)
+        fwrite( slot->text, 1, slot->length, ls->fptr);
+      __atomic_store_n( &(slot->sequence), pos + LOG_RING_SLOTS,
+                        __ATOMIC_RELEASE);
+      pos++;
+      count++;
+    }
+  __atomic_store_n( &(ls->tail), pos, __ATOMIC_RELEASE);
+
+  dropped = __atomic_exchange_n( &(ls->dropped), 0, __ATOMIC_RELAXED);
+  if( ls->fptr != NULL)
+    {
+      if( dropped)
+        fprintf( ls->fptr, "[%s] %u messages dropped, log buffer full\n",
+                 time_to_string( time_str, time(NULL)), dropped);
+      if( count || dropped)
+        fflush( ls->fptr);
+    }
+
+  return count;
+}
+
+
+static void stream_reopen( struct log_stream *ls)
+{
+  if( __atomic_load_n( &(ls->ring), __ATOMIC_ACQUIRE) == NULL)
     return;
 
-  pthread_mutex_lock(&log_lock);
-  if( (fptr = fopen( log_name, "a")) != NULL)
+  if( ls->fptr != NULL)
+    fclose( ls->fptr);
+  ls->fptr = fopen( ls->name, "a");
+}
+
+
+static void *log_writer_thread( void *data)
+{
+  struct timespec ts;
+  int count;
+
+  while( 1)
     {
-      va_start(args, fmt);
-      fprintf( fptr, "[%s] ", time_to_string( time_str, time(NULL)));
-      vfprintf( fptr, fmt, args);
-      va_end(args);
+      if( __atomic_exchange_n( &(log_writer.reopen), 0, __ATOMIC_ACQ_REL))
+        {
+          stream_reopen( &log_stream);
+          stream_reopen( &debug_stream);
+        }
+
+      count = stream_drain( &log_stream);
+      count += stream_drain( &debug_stream);
+      if( count)
+        continue;
+
+      pthread_mutex_lock( &(log_writer.lock));
+      pthread_cond_broadcast( &(log_writer.c_done));
+      __atomic_store_n( &(log_writer.sleeping), 1, __ATOMIC_SEQ_CST);
+      if( !stream_ready( &log_stream) && !stream_ready( &debug_stream) &&
+          !__atomic_load_n( &(log_writer.reopen), __ATOMIC_ACQUIRE) )
+        {
+          // timeout is only a backstop
+          clock_gettime( CLOCK_REALTIME, &ts);
+          ts.tv_sec += 1;
+          pthread_cond_timedwait( &(log_writer.c_work), &(log_writer.lock),
+                                  &ts);
+        }
+      __atomic_store_n( &(log_writer.sleeping), 0, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock( &(log_writer.lock));
+    }
+
+  return NULL;
+}
+
+
+static void log_writer_start( void)
+{
+  pthread_t thread;
+  pthread_attr_t attr;
 
-      fclose(fptr);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_create(&thread, &attr, log_writer_thread, NULL );
+  pthread_attr_destroy( &attr);
+}
+
+
+static void stream_init( struct log_stream *ls, char *name, char *mode,
+                         int timestamp)
+{
+  struct log_slot *ring;
+  int i;
+
+  ls->name = strdup(name);
+  ls->timestamp = timestamp;
+  ls->fptr = fopen( ls->name, mode);
+
+  ring = malloc( LOG_RING_SLOTS * sizeof( struct log_slot));
+  if( ring == NULL)
+    return;
+  for( i = 0; i < LOG_RING_SLOTS; i++)
+    ring[i].sequence = i;
+  __atomic_store_n( &(ls->ring), ring, __ATOMIC_RELEASE);
+
+  pthread_once( &(log_writer.once), log_writer_start);
+}
+
+
+// has the writer reopen the files, for after they get rotated
+void log_reopen( void)
+{
+  __atomic_store_n( &(log_writer.reopen), 1, __ATOMIC_RELEASE);
+  log_writer_wake();
+}
+
+
+// waits up to a few seconds for what has been written so far to be in files
+void log_flush( void)
+{
+  struct timespec ts;
+  int i;
+
+  pthread_mutex_lock( &(log_writer.lock));
+  for( i = 0; i < 3; i++)
+    {
+      if( (__atomic_load_n( &(log_stream.tail), __ATOMIC_ACQUIRE) ==
+           __atomic_load_n( &(log_stream.head), __ATOMIC_RELAXED)) &&
+          (__atomic_load_n( &(debug_stream.tail), __ATOMIC_ACQUIRE) ==
+           __atomic_load_n( &(debug_stream.head), __ATOMIC_RELAXED)) )
+        break;
+      pthread_cond_signal( &(log_writer.c_work));
+      clock_gettime( CLOCK_REALTIME, &ts);
+      ts.tv_sec += 1;
+      pthread_cond_timedwait( &(log_writer.c_done), &(log_writer.lock), &ts);
     }
-  pthread_mutex_unlock(&log_lock);
+  pthread_mutex_unlock( &(log_writer.lock));
+}
+
+
+/////////////////////////////////////////////////
+
+int log_flag = 1;
+
+
+void log_init(char *name)
+{
+  stream_init( &log_stream, name, "a", 1);
+}
+
+void log_write(  char *fmt, ...)
+{
+  va_list args;
+
+  if( !log_flag)
+    return;
+
+  va_start(args, fmt);
+  stream_write( &log_stream, fmt, args);
+  va_end(args);
 }
 
 void log_error_write( int errnum, char *message)
@@ -79,44 +369,24 @@ void log_error_write( int errnum, char *message)
 
 
 int debug_flag = 1;
-pthread_mutex_t debug_lock;
-char *debug_name;
 
 
 void debug_init(char *name)
 {
-  FILE *fptr;
-
-  debug_name = strdup(name);
-  pthread_mutex_init(&debug_lock, NULL);
-
   // this will zero out existing file
-  fptr = fopen( debug_name, "w");
-  if( fptr != NULL)
-    fclose(fptr);
+  stream_init( &debug_stream, name, "w", 0);
 }
 
 void debug_write(  char *fmt, ...)
 {
-  FILE *fptr;
   va_list args;
 
-  //  char time_str[32];
-
   if( !debug_flag)
     return;
 
-  pthread_mutex_lock(&debug_lock);
-  if( (fptr = fopen( debug_name, "a")) != NULL)
-    {
-      va_start(args, fmt);
-      //      fprintf( fptr, "[%s] ", time_to_string( time_str, time(NULL)));
-      vfprintf( fptr, fmt, args);
-      va_end(args);
-
-      fclose(fptr);
-    }
-  pthread_mutex_unlock(&debug_lock);
+  va_start(args, fmt);
+  stream_write( &debug_stream, fmt, args);
+  va_end(args);
 }
 
 void debug_error_write( int errnum, char *message)
@@ -135,13 +405,230 @@ void debug_error_write( int errnum, char *message)
 
 // event log file stuff
 
-int event_write( char *ioc_name, uint32_t timestamp, uint32_t address,
-                 uint32_t message, uint8_t event)
+/*
+  Event files are written through a cache of open descriptors, so an
+  IOC having a run of events doesn't get its file opened and closed for
+  each one.  Up to event_file_cache IOC files are kept open, found with
+  a hash table, and the least recently used one is closed when room is
+  needed.  The global event file stays open, and its text lines are
+  held until event_file_sync() or until the line buffer fills, then
+  written together with writev().  Descriptors are opened for append,
+  so readers of the files always see whole records.
+*/
+
+#define EVENT_LINES (64)
+#define EVENT_LINE_SIZE (384)  // fits longest IOC name
+
+struct event_fd
+{
+  char *ioc_name;
+  int fd;
+  struct event_fd *hash_next;
+  // use order, newest first
+  struct event_fd *prev;
+  struct event_fd *next;
+};
+
+static struct
+{
+  pthread_mutex_t lock;
+  struct event_fd **table;  // NULL if not caching
+  uint32_t table_mask;
+  uint32_t number;
+  uint32_t capacity;
+  struct event_fd *newest;
+  struct event_fd *oldest;
+
+  int global_fd;
+  int line_number;
+  char lines[EVENT_LINES][EVENT_LINE_SIZE];
+  struct iovec iov[EVENT_LINES];
+
+  uint64_t hits;
+  uint64_t misses;
+} event_cache = { PTHREAD_MUTEX_INITIALIZER, .global_fd = -1 };
+
+
+static uint32_t event_name_hash( char *ioc_name)
+{
+  uint32_t hash;
+
+  // FNV-1a
+  hash = 2166136261U;
+  while( *ioc_name)
+    {
+      hash ^= (uint8_t) *ioc_name++;
+      hash *= 16777619U;
+    }
+  return hash;
+}
+
+static int event_fd_open( char *ioc_name)
 {
-  FILE *fptr;
   char *filename;
+  int fd;
+
+  filename = make_file_path( config.event_dir, ioc_name);
+  if( filename == NULL)
+    return -1;
+  fd = open( filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+  free( filename);
+
+  return fd;
+}
+
+static void event_fd_unlink( struct event_fd *efd)
+{
+  if( efd->prev == NULL)
+    event_cache.newest = efd->next;
+  else
+    efd->prev->next = efd->next;
+  if( efd->next == NULL)
+    event_cache.oldest = efd->prev;
+  else
+    efd->next->prev = efd->prev;
+}
+
+static void event_fd_push( struct event_fd *efd)
+{
+  efd->prev = NULL;
+  efd->next = event_cache.newest;
+  if( event_cache.newest == NULL)
+    event_cache.oldest = efd;
+  else
+    event_cache.newest->prev = efd;
+  event_cache.newest = efd;
+}
+
+// takes it out of the cache and closes the descriptor
+static void event_fd_drop( struct event_fd *efd)
+{
+  struct event_fd **link;
+
+  link = &(event_cache.table[event_name_hash( efd->ioc_name) &
+                             event_cache.table_mask]);
+  while( *link != efd)
+    link = &((*link)->hash_next);
+  *link = efd->hash_next;
+
+  event_fd_unlink( efd);
+  event_cache.number--;
+
+  close( efd->fd);
+  free( efd->ioc_name);
+  free( efd);
+}
+
+static struct event_fd *event_fd_find( char *ioc_name)
+{
+  struct event_fd *efd;
+
+  efd = event_cache.table[event_name_hash( ioc_name) &
+                          event_cache.table_mask];
+  while( (efd != NULL) && strcmp( efd->ioc_name, ioc_name))
+    efd = efd->hash_next;
 
+  return efd;
+}
+
+// Returns open descriptor for the IOC's file, or -1, setting cached to
+// whether it is kept open, else the caller closes it.  Cache must be
+// locked.
+static int event_fd_get( char *ioc_name, int *cached)
+{
+  struct event_fd *efd;
+  struct event_fd **bucket;
+  int fd;
+
+  *cached = 0;
+  if( event_cache.table == NULL)
+    return event_fd_open( ioc_name);
+
+  if( (efd = event_fd_find( ioc_name)) != NULL)
+    {
+      event_cache.hits++;
+      if( efd != event_cache.newest)
+        {
+          event_fd_unlink( efd);
+          event_fd_push( efd);
+        }
+      *cached = 1;
+      return efd->fd;
+    }
+
+  event_cache.misses++;
+  if( (fd = event_fd_open( ioc_name)) == -1)
+    return -1;
+
+  if( event_cache.number >= event_cache.capacity)
+    event_fd_drop( event_cache.oldest);
+
+  efd = malloc( sizeof( struct event_fd));
+  if( (efd == NULL) || ((efd->ioc_name = strdup( ioc_name)) == NULL) )
+    {
+      // still gets written, just not kept open
+      free( efd);
+      return fd;
+    }
+  efd->fd = fd;
+  bucket = &(event_cache.table[event_name_hash( ioc_name) &
+                               event_cache.table_mask]);
+  efd->hash_next = *bucket;
+  *bucket = efd;
+  event_fd_push( efd);
+  event_cache.number++;
+
+  *cached = 1;
+  return fd;
+}
+
+// cache must be locked
+static void event_lines_write( void)
+{
+  if( !event_cache.line_number)
+    return;
+
+  if( event_cache.global_fd == -1)
+    event_cache.global_fd = open( config.event_file, O_WRONLY | O_APPEND | 
+                                  O_CREAT | O_CLOEXEC, 0666);
+  if( event_cache.global_fd != -1)
+    {
+      if( writev( event_cache.global_fd, event_cache.iov,
+                  event_cache.line_number) == -1)
+        log_error_write(errno, "Event file write");
+    }
+  event_cache.line_number = 0;
+}
+
+
+// capacity is the most IOC event files kept open, 0 means none
+int event_file_init( int capacity)
+{
+  uint32_t size;
+
+  event_cache.capacity = capacity;
+  if( !capacity)
+    return 0;
+
+  // at most half full
+  size = 1;
+  while( size < 2*capacity)
+    size <<= 1;
+  event_cache.table = calloc( size, sizeof( struct event_fd *));
+  if( event_cache.table == NULL)
+    return 1;
+  event_cache.table_mask = size - 1;
+
+  return 0;
+}
+
+int event_write( char *ioc_name, uint32_t timestamp, uint32_t address,
+                 uint32_t message, uint8_t event)
+{
   uint32_t data[4];
+  int fd, cached;
+  int cnt;
+  int ret;
 
   char *event_strings[] = {"NONE", "FAIL", "BOOT", "RECOVER", "MESSAGE", 
                            "CONFLICT_START", "CONFLICT_STOP"};
@@ -150,41 +637,97 @@ int event_write( char *ioc_name, uint32_t timestamp, uint32_t address,
   char addr_str[16];
 
 
-  filename = make_file_path( config.event_dir, ioc_name);
-  fptr = fopen( filename, "a");
-  free( filename);
-  if( fptr == NULL)
-    {
-      log_error_write(errno, "IOC boot file write");
-      return -1;
-    }
-
   // done this way to write both at same time
   data[0] = timestamp;
   data[1] = address;
   data[2] = message;
   // really only uses first byte, leaving three bytes for later if needed
   data[3] = event; 
-  fwrite( data, sizeof(uint32_t), 4, fptr);
-  fclose( fptr);
 
-  if( (fptr = fopen( config.event_file, "a")) == NULL)
-    return -1;
-  fprintf( fptr, "%s %s %s %s %d\n", time_to_string( time_str, timestamp),
-           ioc_name, event_strings[event],
-           address_to_string( addr_str, address), message);
-  fclose(fptr);
+  ret = 0;
+  pthread_mutex_lock( &(event_cache.lock));
 
-  return 0;
+  if( (fd = event_fd_get( ioc_name, &cached)) == -1)
+    {
+      log_error_write(errno, "IOC boot file write");
+      ret = -1;
+    }
+  else
+    {
+      if( write( fd, data, 4*sizeof(uint32_t)) == -1)
+        {
+          log_error_write(errno, "IOC boot file write");
+          ret = -1;
+        }
+      if( !cached)
+        close( fd);
+    }
+
+  cnt = snprintf( event_cache.lines[event_cache.line_number], EVENT_LINE_SIZE,
+                  "%s %s %s %s %d\n", time_to_string( time_str, timestamp),
+                  ioc_name, event_strings[event],
+                  address_to_string( addr_str, address), message);
+  if( cnt >= EVENT_LINE_SIZE)
+    {
+      cnt = EVENT_LINE_SIZE - 1;
+      event_cache.lines[event_cache.line_number][cnt - 1] = '\n';
+    }
+  event_cache.iov[event_cache.line_number].iov_base = 
+    event_cache.lines[event_cache.line_number];
+  event_cache.iov[event_cache.line_number].iov_len = cnt;
+  event_cache.line_number++;
+  if( event_cache.line_number == EVENT_LINES)
+    event_lines_write();
+
+  pthread_mutex_unlock( &(event_cache.lock));
+
+  return ret;
+}
+
+// writes out the lines held for the global event file
+void event_file_sync( void)
+{
+  pthread_mutex_lock( &(event_cache.lock));
+  event_lines_write();
+  pthread_mutex_unlock( &(event_cache.lock));
+}
+
+// closes all the files, so that they get opened again when next written
+void event_files_close( void)
+{
+  pthread_mutex_lock( &(event_cache.lock));
+  event_lines_write();
+  if( event_cache.global_fd != -1)
+    close( event_cache.global_fd);
+  event_cache.global_fd = -1;
+  while( event_cache.oldest != NULL)
+    event_fd_drop( event_cache.oldest);
+  pthread_mutex_unlock( &(event_cache.lock));
+}
+
+void event_file_stats( uint64_t *hits, uint64_t *misses)
+{
+  pthread_mutex_lock( &(event_cache.lock));
+  *hits = event_cache.hits;
+  *misses = event_cache.misses;
+  pthread_mutex_unlock( &(event_cache.lock));
 }
 
 int event_file_remove( char *ioc_name)
 {
+  struct event_fd *efd;
   char *filename;
   int ret;
 
   filename = make_file_path( config.event_dir, ioc_name);
+
+  // the descriptor has to go too, or the next event writes to nothing
+  pthread_mutex_lock( &(event_cache.lock));
+  if( (event_cache.table != NULL) && 
+      ((efd = event_fd_find( ioc_name)) != NULL) )
+    event_fd_drop( efd);
   ret = unlink( filename);
+  pthread_mutex_unlock( &(event_cache.lock));
   free(filename);
 
   if( ret)
@@ -24,8 +24,15 @@ void debug_init(char *name);
 void debug_write(  char *fmt, ...);
 void debug_error_write( int errnum, char *message);
 
+void log_reopen( void);
+void log_flush( void);
+
+int event_file_init( int capacity);
 int event_write( char *ioc_name, uint32_t timestamp, uint32_t address,
                  uint32_t message, uint8_t event);
+void event_file_sync( void);
+void event_files_close( void);
+void event_file_stats( uint64_t *hits, uint64_t *misses);
 int event_file_remove( char *ioc_name);
 int event_file_send( char *ioc_name, int socket);
 
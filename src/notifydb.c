@@ -383,7 +383,7 @@ static int subscriber_accept( struct sockaddr_in *addr, socklen_t len,
   ssa.subinfo->attempts = 10;
 
   // connection counts as a heartbeat
-  ssa.subinfo->last_heartbeat_time = time(NULL);
+  ssa.subinfo->last_heartbeat_time = clock_mono();
 
   db_add( ndb.db->subs, &sks, db_subscriber_accept_add,
           db_subscriber_accept_replace, (void *) &ssa);
@@ -664,7 +664,7 @@ static void db_acknowledge_heartbeat( void *data, void *arg)
   if( linfo->incarnation != sah->incarnation)
     return;
 
-  linfo->last_heartbeat_time = time(NULL);
+  linfo->last_heartbeat_time = clock_mono();
 
   send_heartbeat_ack( sah->socket , &(linfo->addr), linfo->addr_len,
                       linfo->incarnation);
@@ -793,7 +793,7 @@ static int db_process_events_messages( void *data, void *arg)
 
   // if event retries zero out, or if it's been a long time since
   // last contact (like a heartbeat), drop subscriber
-  if( !sinfo->attempts || ((time(NULL) - sinfo->last_heartbeat_time) > 300) )
+  if( !sinfo->attempts || ((clock_mono() - sinfo->last_heartbeat_time) > 300) )
     {
       free_subscriber( sinfo);
 
@@ -896,6 +896,8 @@ static void *th_service_subscribers( void *data)
       tv.tv_sec = 0;
       tv.tv_usec = 100000;
       retval = select( sockfd + 1, &rset, NULL, NULL, &tv);
+      // this wakes often, so it keeps the coarse clock fresh
+      clock_update();
       if( retval < 0)
         continue;
       gettimeofday( &now, NULL);
@@ -366,3 +366,55 @@ uint32_t timediff_msec( struct timeval earlier, struct timeval later)
     (later.tv_usec - earlier.tv_usec)/1000 ;
 }
 
+
+/////////////////////////////////////////////////////
+
+// Coarse clock, so the busy loops don't need a system call for every
+// time they want.  Each loop calls clock_update() once per pass, and
+// everyone else just reads the cached values.  Wall clock time is for
+// anything reported or stored, while monotonic time is for measuring
+// intervals, as it doesn't jump when the system clock is set.
+
+static struct
+{
+  uint32_t wall;
+  uint32_t mono;
+  int64_t offset;  // nsec, wall clock minus monotonic
+} coarse_clock;
+
+void clock_update( void)
+{
+  struct timespec wall, mono;
+
+  clock_gettime( CLOCK_REALTIME, &wall);
+  clock_gettime( CLOCK_MONOTONIC, &mono);
+
+  __atomic_store_n( &(coarse_clock.wall), (uint32_t) wall.tv_sec,
+                    __ATOMIC_RELAXED);
+  __atomic_store_n( &(coarse_clock.mono), (uint32_t) mono.tv_sec,
+                    __ATOMIC_RELAXED);
+  __atomic_store_n( &(coarse_clock.offset), 
+                    (wall.tv_sec - mono.tv_sec) * 1000000000LL + 
+                    (wall.tv_nsec - mono.tv_nsec), __ATOMIC_RELAXED);
+}
+
+uint32_t clock_now( void)
+{
+  return __atomic_load_n( &(coarse_clock.wall), __ATOMIC_RELAXED);
+}
+
+uint32_t clock_mono( void)
+{
+  return __atomic_load_n( &(coarse_clock.mono), __ATOMIC_RELAXED);
+}
+
+// monotonic seconds for a wall clock time, like a kernel timestamp
+uint32_t clock_mono_from_wall( struct timespec *ts)
+{
+  int64_t offset;
+
+  offset = __atomic_load_n( &(coarse_clock.offset), __ATOMIC_RELAXED);
+  return (uint32_t) ((ts->tv_sec * 1000000000LL + ts->tv_nsec - offset) / 
+                     1000000000LL);
+}
+
@@ -13,6 +13,7 @@
 #define UTILITY_H 1
 
 #include <stdio.h>
+#include <time.h>
 
 char *address_to_string( char string[16], uint32_t address );
 char *time_to_string( char string[32], uint32_t time);
@@ -33,5 +34,10 @@ char *make_file_path( char *dir, char *ioc_name);
 
 uint32_t timediff_msec( struct timeval earlier, struct timeval later);
 
+void clock_update( void);
+uint32_t clock_now( void);
+uint32_t clock_mono( void);
+uint32_t clock_mono_from_wall( struct timespec *ts);
+
 
 #endif
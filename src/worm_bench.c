@@ -0,0 +1,253 @@
+/*************************************************************************\
+* Copyright (c) 2020 UChicago Argonne, LLC,
+*               as Operator of Argonne National Laboratory.
+\*************************************************************************/
+
+/*
+  Written by Dohn A. Arms (Advanced Photon Source, ANL)
+*/
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "gentypes.h"
+
+/*
+  Measures how many read lock/unlock pairs per second the worm mutex
+  handles as reader threads are added, next to a plain pthread rwlock.
+  A writer thread can be added, which takes the write lock at a fixed
+  interval, to see that readers still get through.
+*/
+
+#define BENCH_TABLE (64)
+
+struct
+{
+  int max_threads;
+  int msec;
+  int writer_usec;  // 0 means no writer
+} opts = { 8, 1000, 0 };
+
+struct bench_lock
+{
+  void (* lock_reader)( void *);
+  void (* unlock_reader)( void *);
+  void (* lock_writer)( void *);
+  void (* unlock_writer)( void *);
+  void *lock;
+};
+
+struct bench_thread
+{
+  pthread_t thread;
+  struct bench_lock *bl;
+  uint64_t count;
+  char pad[64];
+};
+
+int stop_flag;
+// stands in for what the lock protects
+uint32_t table[BENCH_TABLE];
+// keeps the reads from being optimized away
+volatile uint32_t sink;
+
+
+static void worm_lr( void *lock) { worm_lock_reader( lock); }
+static void worm_ur( void *lock) { worm_unlock_reader( lock); }
+static void worm_lw( void *lock) { worm_lock_writer( lock); }
+static void worm_uw( void *lock) { worm_unlock_writer( lock); }
+
+static void rw_lr( void *lock) { pthread_rwlock_rdlock( lock); }
+static void rw_ur( void *lock) { pthread_rwlock_unlock( lock); }
+static void rw_lw( void *lock) { pthread_rwlock_wrlock( lock); }
+static void rw_uw( void *lock) { pthread_rwlock_unlock( lock); }
+
+
+static void *reader_thread( void *data)
+{
+  struct bench_thread *bt;
+  struct bench_lock *bl;
+  uint64_t count;
+  uint32_t sum;
+  int i;
+
+  bt = data;
+  bl = bt->bl;
+
+  count = 0;
+  sum = 0;
+  i = 0;
+  while( !__atomic_load_n( &stop_flag, __ATOMIC_RELAXED))
+    {
+      bl->lock_reader( bl->lock);
+      sum += table[i];
+      bl->unlock_reader( bl->lock);
+      i = (i + 1) % BENCH_TABLE;
+      count++;
+    }
+
+  sink = sum;
+  bt->count = count;
+  return NULL;
+}
+
+static void *writer_thread( void *data)
+{
+  struct bench_thread *bt;
+  struct bench_lock *bl;
+  uint64_t count;
+
+  bt = data;
+  bl = bt->bl;
+
+  count = 0;
+  while( !__atomic_load_n( &stop_flag, __ATOMIC_RELAXED))
+    {
+      bl->lock_writer( bl->lock);
+      table[count % BENCH_TABLE]++;
+      bl->unlock_writer( bl->lock);
+      count++;
+      usleep( opts.writer_usec);
+    }
+
+  bt->count = count;
+  return NULL;
+}
+
+
+// returns read pairs per second
+static double bench_run( struct bench_lock *bl, int threads,
+                         uint64_t *writes)
+{
+  struct bench_thread *bts;
+  struct bench_thread writer;
+  struct timespec start, end;
+  uint64_t total;
+  double elapsed;
+  int i;
+
+  bts = calloc( threads, sizeof( struct bench_thread));
+  stop_flag = 0;
+
+  clock_gettime( CLOCK_MONOTONIC, &start);
+  for( i = 0; i < threads; i++)
+    {
+      bts[i].bl = bl;
+      pthread_create( &(bts[i].thread), NULL, reader_thread, &(bts[i]));
+    }
+  if( opts.writer_usec)
+    {
+      writer.bl = bl;
+      pthread_create( &(writer.thread), NULL, writer_thread, &writer);
+    }
+
+  usleep( opts.msec * 1000);
+  __atomic_store_n( &stop_flag, 1, __ATOMIC_RELAXED);
+
+  total = 0;
+  for( i = 0; i < threads; i++)
+    {
+      pthread_join( bts[i].thread, NULL);
+      total += bts[i].count;
+    }
+  *writes = 0;
+  if( opts.writer_usec)
+    {
+      pthread_join( writer.thread, NULL);
+      *writes = writer.count;
+    }
+  clock_gettime( CLOCK_MONOTONIC, &end);
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  free( bts);
+
+  return total / elapsed;
+}
+
+
+void helper(void)
+{
+  printf("worm_bench [-n <threads>] [-t <msec>] [-w <usec>]\n"
+         "  Reader throughput of the worm mutex and a pthread rwlock.\n"
+         "    -n  most reader threads, doubling from 1 (default 8)\n"
+         "    -t  run time for each test in milliseconds (default 1000)\n"
+         "    -w  adds a writer, locking every given microseconds\n"
+         );
+}
+
+
+int main( int argc, char *argv[])
+{
+  struct worm_mutex_struct worm;
+  pthread_rwlock_t rwlock;
+  struct bench_lock locks[2] = {
+    { worm_lr, worm_ur, worm_lw, worm_uw, &worm },
+    { rw_lr, rw_ur, rw_lw, rw_uw, &rwlock } };
+
+  double rate[2];
+  uint64_t writes[2];
+  int threads;
+  int opt;
+  int i;
+
+  while((opt = getopt( argc, argv, "hn:t:w:")) != -1)
+    {
+      switch(opt)
+        {
+        case 'h':
+          helper();
+          return 0;
+        case 'n':
+          opts.max_threads = atoi( optarg);
+          break;
+        case 't':
+          opts.msec = atoi( optarg);
+          break;
+        case 'w':
+          opts.writer_usec = atoi( optarg);
+          break;
+        case ':':
+        case '?':
+          return 2;
+          break;
+        }
+    }
+  if( (opts.max_threads < 1) || (opts.msec < 1) || (opts.writer_usec < 0))
+    {
+      printf("Error: Bad option value.\n");
+      return 2;
+    }
+
+  worm_init( &worm);
+  pthread_rwlock_init( &rwlock, NULL);
+
+  printf("%d CPUs online\n", (int) sysconf( _SC_NPROCESSORS_ONLN));
+  printf("threads     worm (Mops/s)   rwlock (Mops/s)");
+  if( opts.writer_usec)
+    printf("   writes (worm/rwlock)");
+  printf("\n");
+
+  for( threads = 1; threads <= opts.max_threads; threads *= 2)
+    {
+      for( i = 0; i < 2; i++)
+        rate[i] = bench_run( &(locks[i]), threads, &(writes[i]));
+      printf("%7d %16.2f %17.2f", threads, rate[0] / 1e6, rate[1] / 1e6);
+      if( opts.writer_usec)
+        printf("   %llu/%llu", (unsigned long long) writes[0],
+               (unsigned long long) writes[1]);
+      printf("\n");
+    }
+
+  pthread_rwlock_destroy( &rwlock);
+  worm_clear( &worm);
+
+  return 0;
+}